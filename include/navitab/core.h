@@ -6,6 +6,7 @@
 #include <functional>
 #include <filesystem>
 #include <nlohmann/json_fwd.hpp>
+#include "navitab/pixelbuffer.h"
 
 // This header file defines abstract interfaces to the main components of
 // Navitab, and a single factory function to make the central core object.
@@ -15,7 +16,6 @@ namespace navitab {
 struct PathServices;
 struct Simulator2Core;
 struct WindowPart;
-class PixelBuffer;
 class Toolbar;
 struct Toolbar2Core;
 class Modebar;
@@ -28,6 +28,7 @@ struct WindowControls;
 class BackingStore;
 class DocumentManager;
 class MapTileProvider;
+class ImagingKit;
 class NavProvider;
 
 enum HostPlatform { WIN, LNX, MAC };
@@ -121,6 +122,7 @@ struct AppServices : public BasicServices
     virtual std::shared_ptr<BackingStore> GetStoreManager() = 0;
     virtual std::shared_ptr<DocumentManager> GetDocsProvider() = 0;
     virtual std::shared_ptr<MapTileProvider> GetMapsProvider() = 0;
+    virtual std::shared_ptr<ImagingKit> GetImagingKit() = 0;
     virtual std::shared_ptr<NavProvider> GetNavProvider() = 0;
 
     virtual void EnableTools(int toolMask, int repeatersMask) = 0;
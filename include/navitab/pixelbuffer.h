@@ -0,0 +1,173 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+namespace navitab {
+
+// Pixel formats. Each format defines the storage type of one pixel, and the
+// buffer classes below are templated on the format.
+//
+// RGBA8888 - 32 bits, red in 7:0, green in 15:8, blue in 23:16, alpha in 31:24.
+//            This is the format used for all rendering and for the window parts.
+// RGB565   - 16 bits, red in 15:11, green in 10:5, blue in 4:0, no alpha. Used
+//            to halve the size of images sent to remote panels.
+// A8       - 8 bits of coverage/alpha only. Used for masks (eg text and symbols)
+//            that are blended onto an RGBA buffer in a single colour.
+
+struct RGBA8888
+{
+    typedef uint32_t Pixel;
+};
+
+struct RGB565
+{
+    typedef uint16_t Pixel;
+};
+
+struct A8
+{
+    typedef uint8_t Pixel;
+};
+
+// A PixelBuffer object is a convenience class that collates the storage, width and
+// height of a region of memory that holds an image. These objects do not necessarily
+// own the buffer, and so are normally only intended for transient use.
+
+template <class FMT>
+class PixelBufferT
+{
+public:
+    typedef typename FMT::Pixel PixelType;
+
+    PixelBufferT(unsigned w, unsigned h, PixelType* d) : width(w), height(h), span(w), data(d), premultiplied(false) { }
+    PixelBufferT(unsigned w, unsigned h, unsigned s, PixelType* d) : width(w), height(h), span(s), data(d), premultiplied(false) { }
+    ~PixelBufferT() = default;
+
+    unsigned Width() const { return width; }
+    unsigned Height() const { return height; }
+
+    // The span is the distance between the starts of each row, in pixels. This
+    // will be greater than the width if the rows are padded.
+    unsigned Span() const { return span; }
+    bool Contiguous() const { return span == width; }
+
+    // Pixels normally have straight alpha. Premultiplied pixels have had their colour
+    // channels scaled by alpha already, which makes blending them much cheaper.
+    bool Premultiplied() const { return premultiplied; }
+    void SetPremultiplied(bool p) { premultiplied = p; }
+
+    PixelType* Row(unsigned r) { return data + (r * span); }
+    const PixelType* Row(unsigned r) const { return data + (r * span); }
+    PixelType* Pixel(unsigned x, unsigned y) { return data + (y * span) + x; }
+
+    // Copy the source pixels into this buffer, clipping as required.
+    void PaintRegion(int x, int y, PixelBufferT& src);
+
+    // Blend the source pixels over this buffer. RGBA8888 only.
+    void BlendRegion(int x, int y, PixelBufferT& src);
+
+    // Blend a single (straight alpha) colour over this buffer, using an A8 mask
+    // for the coverage. RGBA8888 only.
+    void BlendMask(int x, int y, PixelBufferT<A8>& mask, uint32_t colour);
+
+    // Copy the source pixels into this buffer, converting them from the source's
+    // pixel format. The supported conversions are RGBA8888 to/from RGB565, and
+    // RGBA8888 to A8 (which extracts the alpha channel).
+    template <class SRC>
+    void ConvertRegion(int x, int y, PixelBufferT<SRC>& src);
+
+protected:
+    void SetData(PixelType* d) { data = d; }
+
+protected:
+    unsigned width;
+    unsigned height;
+    unsigned span;
+    PixelType* data;
+    bool premultiplied;
+
+};
+
+// Allocation options for ImageBuffers. The storage is always 64-byte aligned.
+// By default the rows are contiguous and all pixels are cleared to 0.
+
+struct ImageAlloc
+{
+    enum : unsigned {
+        ZEROED = 0,
+        UNINITIALISED = 1,  // pixels are not cleared, use when all pixels will be overwritten
+        PADDED = 2,         // pad each row to a multiple of 64 bytes, so every row is aligned
+        HUGEPAGES = 4       // use huge pages if the platform can, for canvas-sized images
+    };
+};
+
+// ImageBuffer objects are PixelBuffers that manage their storage, and are often
+// rendered by the Navitab core or apps, and given to the window interface to be
+// displayed.
+
+template <class FMT>
+class ImageBufferT : public PixelBufferT<FMT>
+{
+public:
+    typedef typename FMT::Pixel PixelType;
+
+    ImageBufferT(unsigned w, unsigned h, unsigned allocFlags = ImageAlloc::ZEROED);
+    ~ImageBufferT();
+
+    ImageBufferT(const ImageBufferT&) = delete;
+    ImageBufferT& operator=(const ImageBufferT&) = delete;
+
+    void Clear(PixelType px);
+
+    // Convert the image from straight to premultiplied alpha, if not already done.
+    // RGBA8888 only.
+    void Premultiply();
+
+    void PaintIcon(unsigned x, unsigned y, const PixelType *pix, unsigned w, unsigned h, PixelType bg = 0);
+
+    PixelType* PixAt(unsigned y, unsigned x) { return this->data + (y * this->span + x); }
+    const PixelType* PixAt(unsigned y, unsigned x) const { return this->data + (y * this->span + x); }
+    const PixelType* Data() const { return this->data; }
+
+    // total size of the pixel storage, including any row padding
+    size_t Bytes() const { return allocBytes; }
+
+protected:
+    // Subclasses can provide the storage for the image, eg from a pool. The storage
+    // is not freed by the ImageBuffer, and must outlive it.
+    ImageBufferT(unsigned w, unsigned h, unsigned span, PixelType* storage);
+
+private:
+    unsigned allocFlags;
+    size_t allocBytes;
+    bool ownsStorage;
+};
+
+// The format-specific members are only provided for the formats they make sense for.
+template <> void PixelBufferT<RGBA8888>::BlendRegion(int x, int y, PixelBufferT<RGBA8888>& src);
+template <> void PixelBufferT<RGBA8888>::BlendMask(int x, int y, PixelBufferT<A8>& mask, uint32_t colour);
+template <> template <> void PixelBufferT<RGB565>::ConvertRegion(int x, int y, PixelBufferT<RGBA8888>& src);
+template <> template <> void PixelBufferT<RGBA8888>::ConvertRegion(int x, int y, PixelBufferT<RGB565>& src);
+template <> template <> void PixelBufferT<A8>::ConvertRegion(int x, int y, PixelBufferT<RGBA8888>& src);
+template <> void ImageBufferT<RGBA8888>::Premultiply();
+
+extern template class PixelBufferT<RGBA8888>;
+extern template class PixelBufferT<RGB565>;
+extern template class PixelBufferT<A8>;
+extern template class ImageBufferT<RGBA8888>;
+extern template class ImageBufferT<RGB565>;
+extern template class ImageBufferT<A8>;
+
+// The RGBA8888 buffers are by far the most common, and keep their original names.
+// The name FrameBuffer is a synonym and is used in some APIs.
+typedef PixelBufferT<RGBA8888> PixelBuffer;
+typedef ImageBufferT<RGBA8888> ImageBuffer;
+typedef ImageBufferT<RGBA8888> FrameBuffer;
+typedef ImageBufferT<RGB565> ImageBuffer565;
+typedef ImageBufferT<A8> MaskBuffer;
+
+} // namespace navitab
@@ -12,16 +12,24 @@
 
 namespace navitab {
 
+class TilePool;
+
+// RasterTiles always have padded rows, and their storage is recycled through
+// the TilePool rather than being freed.
+
 class RasterTile : public ImageBuffer
 {
 public:
     static const unsigned DefaultWidth = 256;
     static const unsigned DefaultHeight = 256;
 
-    RasterTile(unsigned w, unsigned h) : ImageBuffer(w, h) {}
-    RasterTile() : ImageBuffer(DefaultWidth, DefaultHeight) {}
+    RasterTile(unsigned w, unsigned h, unsigned allocFlags = ImageAlloc::ZEROED);
+    RasterTile();
+
+    virtual ~RasterTile();
 
-    virtual ~RasterTile() = default;
+private:
+    std::shared_ptr<TilePool> pool;
 };
 
 } // namespace navitab
@@ -9,6 +9,7 @@
 #include <functional>
 #include <vector>
 #include "navitab/deferred.h"
+#include "navitab/pixelbuffer.h"
 
 
 namespace navitab {
@@ -21,7 +22,6 @@ struct Toolbar;
 struct Modebar;
 struct Doodler;
 struct Keypad;
-class ImageBuffer;
 struct ImageRegion;
 
 // The PartPainter interface defines the services the UI window provides to the
@@ -97,62 +97,6 @@ struct ImageRegion
     bool Empty() const { return (left >= right) || (top >= bottom); }
 };
 
-// A PixelBuffer object is a convenience class that collates the storage, width and
-// height of a region of memory that holds an image. These objects do not necessarily
-// own the buffer, and so are normally only intended for transient use.
-
-class PixelBuffer
-{
-public:
-    PixelBuffer(unsigned w, unsigned h, uint32_t* d) : width(w), height(h), span(w), data(d) { }
-    PixelBuffer(unsigned w, unsigned h, unsigned s, uint32_t* d) : width(w), height(h), span(s), data(d) { }
-    ~PixelBuffer() = default;
-
-    unsigned Width() const { return width; }
-    unsigned Height() const { return height; }
-
-    uint32_t* Row(unsigned r) { return data + (r * span); }
-    uint32_t* Pixel(unsigned x, unsigned y) { return data + (y * span) + x; }
-
-    void PaintRegion(int x, int y, PixelBuffer& src);
-    void BlendRegion(int x, int y, PixelBuffer& src);
-
-protected:
-    PixelBuffer(unsigned w, unsigned h) : width(w), height(h), span(w), data(nullptr) { }
-    void SetData(uint32_t* d) { data = d; }
-    void BlendRow(unsigned row, unsigned offset, uint32_t *s, int n);
-
-protected:
-    unsigned width;
-    unsigned height;
-    unsigned span;
-    uint32_t* data;
-
-};
-
-// ImageBuffer objects are PixelBuffers that manage their storage, and are often
-// rendered by the Navitab core or apps, and given to the window interface to be
-// displayed. The name FrameBuffer is a synonym and is used in some APIs.
-
-class ImageBuffer : public PixelBuffer
-{
-public:
-    ImageBuffer(unsigned w, unsigned h) : PixelBuffer(w, h) { data.resize(width * height); SetData(&data[0]); }
-    ~ImageBuffer() = default;
-
-    void Clear(uint32_t px) { std::fill(data.begin(), data.end(), px); }
-
-    void PaintIcon(unsigned x, unsigned y, const uint32_t *pix, unsigned w, unsigned h, uint32_t bg = 0);
-
-    std::vector<uint32_t>::iterator PixAt(unsigned y, unsigned x) { return data.begin() + (y * width + x); }
-    std::vector<uint32_t>::const_iterator PixAt(unsigned y, unsigned x) const { return data.begin() + (y * width + x); }
-    const std::vector<uint32_t>& Data() const { return data; }
-
-private:
-    std::vector<uint32_t> data;
-};
-typedef class ImageBuffer FrameBuffer; // synonym
-
 // Each window part (toolbar, modebar, canvas, doodler, keypad) implements
 // this interface so that the window manager can pass on UI events of interest.
 
@@ -224,7 +168,7 @@ protected:
     void SetImage(int w, int h) {
         assert(w);
         assert(h);
-        image = std::make_unique<ImageBuffer>(w, h);
+        image = std::make_unique<ImageBuffer>(w, h, ImageAlloc::HUGEPAGES);
     }
 
     void Invalidate(const ImageRegion &r) {
@@ -245,24 +189,4 @@ private:
 
 };
 
-inline void ImageBuffer::PaintIcon(unsigned x, unsigned y, const uint32_t *pix, unsigned w, unsigned h, uint32_t bg)
-{
-    assert((x + w) <= width);
-    assert((y + h) <= height);
-
-    for (int iy = 0; iy < h; ++iy) {
-        uint32_t *d = &data[((y + iy) * width) + x];
-        const uint32_t *s = pix + iy * w;
-        if (bg == 0) {
-            memcpy(d, s, w * sizeof(uint32_t));
-        } else {
-            for (int k = 0; k < w; ++k) {
-                uint32_t p = *s++;
-                *d++ = (p == 0) ? bg : p;
-            }
-        }
-    }
-}
-
-
 } // namespace navitab
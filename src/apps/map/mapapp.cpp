@@ -6,22 +6,34 @@
 #include "navitab/simulator.h"
 #include "navitab/tiles.h"
 #include "../../maps/maptileprovider.h"
-#include "../../store/backingstore.h"
 #include <fmt/core.h>
 #include <lunasvg.h>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <memory>
 
 namespace navitab {
 
 MapApp::MapApp(std::shared_ptr<AppServices> core)
 :   App("mapapp", core),
-    store(core->GetStoreManager()),
     mapServer(core->GetMapsProvider()),
     followPlane(true),
-    centreTYX(0,0)
+    trackUp(false),
+    planeHeading(0.0),
+    resampler(ResampleFilter::BILINEAR),
+    centreTYX(0,0),
+    backdropValid(false),
+    backdropZoom(0),
+    backdropX(0),
+    backdropY(0),
+    backdropTY0(0),
+    backdropTX0(0),
+    backdropRows(0),
+    backdropCols(0)
 {
     tileSize = mapServer->GetTileDimensions();
+    GeneratePlaneIcons();
 
     mouseDrag.down = false;
 
@@ -29,7 +41,8 @@ MapApp::MapApp(std::shared_ptr<AppServices> core)
         (1 << ClickableTool::MENU) |
         (1 << ClickableTool::REDUCE) |
         (1 << ClickableTool::CENTRE) |
-        (1 << ClickableTool::MAGNIFY);
+        (1 << ClickableTool::MAGNIFY) |
+        (1 << ClickableTool::ROTATEC);
     repeatingToolsMask = 
         (1 << ClickableTool::REDUCE) |
         (1 << ClickableTool::MAGNIFY);
@@ -98,15 +111,18 @@ void MapApp::FlightLoop(const SimStateData& data)
     // the first thing to do is to work out the tile coordinate of the canvas centre.
 
     auto planeTYX = mapServer->Location2TileYX(planeTraj);
+    planeHeading = planeTraj.hdg_rad;
     if (followPlane) {
         // When the map is following the plane then the plane is positioned on an
         // ellipse facing towards the centre of the map, since it is assumed that
         // the useful part of the map is in front of the plane.
 
         double insetScale = 0.65f; // TODO - make this a user setting
-        // these are the tile coordinate deltas to add to position the centre point
+        // these are the tile coordinate deltas to add to position the centre point.
+        // in track-up mode the plane is always directly below the centre point.
+        auto insetX = trackUp ? canvasCentreY : canvasCentreX;
         auto tileDeltaY = canvasCentreY * insetScale * std::cos(planeTraj.hdg_rad) / tileH;
-        auto tileDeltaX = canvasCentreX * insetScale * std::sin(planeTraj.hdg_rad) / tileW;
+        auto tileDeltaX = insetX * insetScale * std::sin(planeTraj.hdg_rad) / tileW;
         centreTYX.first = planeTYX.first - tileDeltaY;
         centreTYX.second = planeTYX.second + tileDeltaX;
     }
@@ -114,27 +130,115 @@ void MapApp::FlightLoop(const SimStateData& data)
     // Identify which tile contains the centre point of the map
     // TODO - cty will exceed the tile server ranges near the poles, including infinity at the pole. needs handling.
     mapServer->NormaliseTileYX(centreTYX);
+    mapServer->SetFocus(centreTYX);
     auto& cty = centreTYX.first;
     auto& ctx = centreTYX.second;
 
-    // Get the centre tile from the map server, and then figure out where its left-top position is within the canvas
-    auto tile = mapServer->GetTile(cty, ctx);
-    int mainTileOriginX = canvasCentreX - (int)std::floor((ctx - std::floor(ctx)) * tileW);
-    int mainTileOriginY = canvasCentreY - (int)std::floor((cty - std::floor(cty)) * tileH);
-
-    // Figure out the starting (left-top) most tile index
-    int idx = 0;
-    while (mainTileOriginX + (idx * tileW) > 0) --idx;
-    int idy = 0;
-    while (mainTileOriginY + (idy * tileH) > 0) --idy;
-
-    // Iterate through the tiles which have some overlap with the canvas
-    for (int iy = idy; (mainTileOriginY + (iy * tileH) < (int)canvas.Height()); ++iy) {
-        for (int ix = idx; (mainTileOriginX + (ix * tileW) < (int)canvas.Width()); ++ix) {
-            auto tile = mapServer->GetTile(cty + iy, ctx + ix);
-            int tilePosT = mainTileOriginY + (iy * tileH);
-            int tilePosL = mainTileOriginX + (ix * tileW);
-            canvas.PaintRegion(tilePosL, tilePosT, *(std::static_pointer_cast<PixelBuffer>(tile)));
+    if (trackUp) {
+        PaintRotatedMap(canvas, -planeTraj.hdg_rad);
+        backdropValid = false;
+    } else {
+        PaintNorthUpMap(canvas);
+    }
+
+    // With the visible tiles requested, tiles ahead of the plane can be fetched
+    // before they scroll into view.
+    mapServer->Prefetch(planeTraj);
+
+    // Now paint all the movable stuff.
+    
+    // TODO - paint the copyright, bottom right
+    
+    // TODO - draw the scale(s), top right
+
+    // The plane icons are drawn centred on each plane's location. The offset from the
+    // centre of the map is rotated to match the map in track-up mode.
+    const double c = trackUp ? std::cos(planeTraj.hdg_rad) : 1.0;
+    const double s = trackUp ? std::sin(planeTraj.hdg_rad) : 0.0;
+    auto paintPlane = [&](const Trajectory& t, PlaneIcon variant) {
+        auto tyx = mapServer->Location2TileYX(t);
+        double dy = tileH * (tyx.first - cty);
+        double dx = tileW * (tyx.second - ctx);
+        int py = canvasCentreY + (int)(c * dy - s * dx) - (planeIcons->CellHeight() / 2);
+        int px = canvasCentreX + (int)(c * dx + s * dy) - (planeIcons->CellWidth() / 2);
+        double hdg = trackUp ? (t.hdg_rad - planeTraj.hdg_rad) : t.hdg_rad;
+        canvas.BlendRegion(px, py, PlaneIconSprite(variant, hdg));
+    };
+
+    for (size_t i = 0; i < std::min(data.nOtherPlanes, (size_t)SimStateData::MAX_OTHER_AIRCRAFT); ++i) {
+        auto& other = data.otherPlanes[i];
+        paintPlane(other, (other.alt_metres > data.myPlane.alt_metres) ? TRAFFIC_ABOVE : TRAFFIC_BELOW);
+    }
+    paintPlane(planeTraj, MY_PLANE);
+}
+
+void MapApp::PaintNorthUpMap(PixelBuffer& canvas)
+{
+    int tileH = tileSize.first;
+    int tileW = tileSize.second;
+    auto& cty = centreTYX.first;
+    auto& ctx = centreTYX.second;
+
+    // pixel coordinates of the canvas's top-left corner, in the whole map
+    const int64_t canvasX = (int64_t)std::floor(ctx * tileW) - (canvas.Width() / 2);
+    const int64_t canvasY = (int64_t)std::floor(cty * tileH) - (canvas.Height() / 2);
+
+    const unsigned bw = canvas.Width() + 2 * kBackdropMargin;
+    const unsigned bh = canvas.Height() + 2 * kBackdropMargin;
+    if (!backdrop || (backdrop->Width() != bw) || (backdrop->Height() != bh)) {
+        backdrop = std::make_unique<ImageBuffer>(bw, bh, ImageAlloc::UNINITIALISED | ImageAlloc::PADDED);
+        backdropValid = false;
+    }
+    if (backdropZoom != mapServer->GetZoom()) {
+        backdropZoom = mapServer->GetZoom();
+        backdropValid = false;
+    }
+    if (!backdropValid) backdropRows = backdropCols = 0;
+
+    // The backdrop is only moved when the canvas would no longer be inside it, so
+    // small movements don't repaint anything from the tiles. When it does move,
+    // whatever is still visible is scrolled rather than repainted.
+    const int64_t offsetX = canvasX - backdropX;
+    const int64_t offsetY = canvasY - backdropY;
+    if (!backdropValid || (offsetX < 0) || (offsetY < 0) || (offsetX > 2 * kBackdropMargin) || (offsetY > 2 * kBackdropMargin)) {
+        const int64_t dx = offsetX - kBackdropMargin;
+        const int64_t dy = offsetY - kBackdropMargin;
+        backdropX = canvasX - kBackdropMargin;
+        backdropY = canvasY - kBackdropMargin;
+        if (backdropValid && (std::abs(dx) < (int64_t)bw) && (std::abs(dy) < (int64_t)bh)) {
+            ScrollBackdrop((int)-dx, (int)-dy);
+            if (dx < 0) PaintBackdropRegion(0, 0, (unsigned)-dx, bh);
+            if (dx > 0) PaintBackdropRegion(bw - (int)dx, 0, (unsigned)dx, bh);
+            if (dy < 0) PaintBackdropRegion(0, 0, bw, (unsigned)-dy);
+            if (dy > 0) PaintBackdropRegion(0, bh - (int)dy, bw, (unsigned)dy);
+        } else {
+            backdropRows = backdropCols = 0;
+        }
+        backdropValid = true;
+    }
+
+    // Request all of the tiles that overlap the backdrop, and paint any that are
+    // new or have changed (eg a stand-in that has now been downloaded).
+    const int ty0 = (int)std::floor((double)backdropY / tileH);
+    const int tx0 = (int)std::floor((double)backdropX / tileW);
+    const int ty1 = (int)std::floor((double)(backdropY + bh - 1) / tileH);
+    const int tx1 = (int)std::floor((double)(backdropX + bw - 1) / tileW);
+    const int rows = ty1 - ty0 + 1;
+    const int cols = tx1 - tx0 + 1;
+    visibleTiles.assign((size_t)(rows * cols), nullptr);
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            auto tile = mapServer->GetTile(ty, tx);
+            const int py = ty - backdropTY0;
+            const int px = tx - backdropTX0;
+            bool painted = (py >= 0) && (py < backdropRows) && (px >= 0) && (px < backdropCols)
+                    && (backdropTiles[py * backdropCols + px] == tile);
+            if (!painted) {
+                int tilePosT = (int)((int64_t)ty * tileH - backdropY);
+                int tilePosL = (int)((int64_t)tx * tileW - backdropX);
+                backdrop->PaintRegion(tilePosL, tilePosT, *(std::static_pointer_cast<PixelBuffer>(tile)));
+            }
+            visibleTiles[(ty - ty0) * cols + (tx - tx0)] = tile;
 
             // TODO - blend the NavAid overlay 'tiles'
             // Design Note: the NavAid overlay will show the currently selected NavAids, AND
@@ -144,39 +248,100 @@ void MapApp::FlightLoop(const SimStateData& data)
             // frames. This cache will be cleared whenever the zoom or navaid filters are modified.
         }
     }
+    backdropTiles.swap(visibleTiles);
+    visibleTiles.clear();
+    backdropTY0 = ty0;
+    backdropTX0 = tx0;
+    backdropRows = rows;
+    backdropCols = cols;
+
+    // The whole canvas is copied from the backdrop on every frame. The canvas is
+    // also the UI toolkit's frame buffer and the plane icons are blended over it,
+    // so its previous contents can't be relied on, and scrolling it in place
+    // would touch as many pixels as this copy does.
+    canvas.PaintRegion((int)(backdropX - canvasX), (int)(backdropY - canvasY), *backdrop);
+}
 
-    // Now paint all the movable stuff.
-    
-    // TODO - paint the copyright, bottom right
-    
-    // TODO - draw the scale(s), top right
+void MapApp::ScrollBackdrop(int dx, int dy)
+{
+    // Move the backdrop's pixels by dx,dy in place. The rows are moved in an order
+    // that doesn't overwrite any that are still to be moved.
+    const size_t bytes = (backdrop->Width() - std::abs(dx)) * sizeof(uint32_t);
+    const unsigned srcX = (dx < 0) ? -dx : 0;
+    const unsigned dstX = (dx > 0) ? dx : 0;
+    auto moveRow = [&](int r) { std::memmove(backdrop->Row(r + dy) + dstX, backdrop->Row(r) + srcX, bytes); };
+    if (dy > 0) {
+        for (int r = (int)backdrop->Height() - 1 - dy; r >= 0; --r) moveRow(r);
+    } else {
+        for (int r = -dy; r < (int)backdrop->Height(); ++r) moveRow(r);
+    }
+}
 
-    // TODO - draw the other aircraft icons
-    
-    // TODO - put this into a function
-    // Get the plane icon from the backing store (or draw it if it's never been used before)
-    // TODO - add a local cache to avoid SQL queries on each frame drawn
-    auto hdg = HeadingToSteppedDegrees(planeTraj.hdg_rad);
-    auto name = fmt::format("myplane{:03d}", hdg);
-    auto icon = store->GetPixmap(name);
-    if (!icon) {
-        icon = GeneratePlaneIcon(hdg);
-        store->StorePixmap(name, icon);
+void MapApp::PaintBackdropRegion(int x, int y, unsigned w, unsigned h)
+{
+    // Repaint part of the backdrop that has been exposed by scrolling. This uses the
+    // tiles that the rest of the backdrop was painted with, any tiles that aren't
+    // painted anywhere yet are done when the visible tiles are checked.
+    int tileH = tileSize.first;
+    int tileW = tileSize.second;
+    PixelBuffer region(w, h, backdrop->Span(), backdrop->Pixel(x, y));
+    for (int r = 0; r < backdropRows; ++r) {
+        for (int c = 0; c < backdropCols; ++c) {
+            auto& tile = backdropTiles[r * backdropCols + c];
+            int tilePosT = (int)((int64_t)(backdropTY0 + r) * tileH - backdropY) - y;
+            int tilePosL = (int)((int64_t)(backdropTX0 + c) * tileW - backdropX) - x;
+            region.PaintRegion(tilePosL, tilePosT, *(std::static_pointer_cast<PixelBuffer>(tile)));
+        }
+    }
+}
+
+void MapApp::PaintRotatedMap(PixelBuffer& canvas, double rotation)
+{
+    // Rather than painting a north-up map and then rotating it, which would touch
+    // every pixel twice, each canvas pixel is sampled directly from the tiles
+    // through the rotation about the canvas centre.
+    int tileH = tileSize.first;
+    int tileW = tileSize.second;
+    double canvasCentreY = canvas.Height() / 2.0;
+    double canvasCentreX = canvas.Width() / 2.0;
+    auto& cty = centreTYX.first;
+    auto& ctx = centreTYX.second;
+
+    // collect all of the tiles that might be visible whatever the rotation
+    double radius = std::hypot(canvasCentreX, canvasCentreY) + 1.0;
+    int ty0 = (int)std::floor(cty - radius / tileH);
+    int tx0 = (int)std::floor(ctx - radius / tileW);
+    int ty1 = (int)std::floor(cty + radius / tileH);
+    int tx1 = (int)std::floor(ctx + radius / tileW);
+    TileGrid grid;
+    grid.tileW = tileW;
+    grid.tileH = tileH;
+    grid.cols = tx1 - tx0 + 1;
+    grid.rows = ty1 - ty0 + 1;
+    std::vector<std::shared_ptr<RasterTile>> tiles; // keeps the tiles alive until drawn
+    for (int iy = ty0; iy <= ty1; ++iy) {
+        for (int ix = tx0; ix <= tx1; ++ix) {
+            tiles.push_back(mapServer->GetTile(iy, ix));
+            grid.tiles.push_back(tiles.back().get());
+        }
     }
 
-    // Draw (blend) the plane icon in its current location
-    int dpy = (int)(tileH * (planeTYX.first - cty));
-    int dpx = (int)(tileW * (planeTYX.second - ctx));
-    int py = canvasCentreY + dpy - (icon->Height() / 2);
-    int px = canvasCentreX + dpx - (icon->Width() / 2);
-    canvas.BlendRegion(px, py, *icon);
+    auto m = AffineTransform::Translate((float)(-(ctx - tx0) * tileW), (float)(-(cty - ty0) * tileH))
+                .Then(AffineTransform::Rotate((float)rotation))
+                .Then(AffineTransform::Translate((float)canvasCentreX, (float)canvasCentreY));
+    resampler.Transform(canvas, grid, m);
+}
+
+PixelBuffer& MapApp::PlaneIconSprite(PlaneIcon variant, double hrad)
+{
+    return planeIcons->Sprite(variant * kHeadingSteps + HeadingToSteppedDegrees(hrad) / 6);
 }
 
 unsigned MapApp::HeadingToSteppedDegrees(double hrad)
 {
     // returns the heading in degrees, rounded to the nearest step, ie each one covers an arc of 6deg
     int headDeg = (int)std::floor(hrad * 180 / M_PI);
-    return 6 * (((headDeg + 363) % 360) / 6);
+    return 6 * ((((headDeg + 363) % 360) + 360) % 360 / 6);
 }
 
 static const char *planeIconFormat = R"SVG(
@@ -191,21 +356,36 @@ static const char *planeIconFormat = R"SVG(
 </g></g></g></svg>
 )SVG";
 
-std::shared_ptr<ImageBuffer> MapApp::GeneratePlaneIcon(unsigned rotation, bool myPlane, bool above)
+void MapApp::GeneratePlaneIcons()
 {
-    const unsigned wh = myPlane ? 30 : 24;
-    auto planeIconSvg = fmt::format(planeIconFormat, 1.0f, rotation, "red");
-    auto document = lunasvg::Document::loadFromData(planeIconSvg);
-    assert(document);
-    auto bitmap = document->renderToBitmap(wh, wh, 0);
-    assert(bitmap.valid());
-    bitmap.convertToRGBA();
-    auto p = bitmap.data();
-
-    auto icon = std::make_shared<ImageBuffer>(wh, wh);
-    memcpy(icon->Row(0), p, wh * wh * sizeof(uint32_t));
-
-    return icon;
+    // All of the plane icons are drawn once, into a single atlas, so that drawing
+    // them on each frame is just a lookup and a blend.
+    const unsigned wh = 30;
+    planeIcons = std::make_unique<SpriteAtlas>(wh, wh, kNumPlaneIcons * kHeadingSteps);
+    for (int v = 0; v < kNumPlaneIcons; ++v) {
+        // other planes are drawn smaller, and coloured to show if they are above or below us
+        float scale = (v == MY_PLANE) ? 1.0f : 0.8f;
+        const char* colour = (v == MY_PLANE) ? "red" : ((v == TRAFFIC_ABOVE) ? "royalblue" : "seagreen");
+        for (unsigned h = 0; h < kHeadingSteps; ++h) {
+            auto planeIconSvg = fmt::format(planeIconFormat, scale, h * 6, colour);
+            auto document = lunasvg::Document::loadFromData(planeIconSvg);
+            assert(document);
+            auto bitmap = document->renderToBitmap(wh, wh, 0);
+            assert(bitmap.valid());
+
+            // LunaSVG renders premultiplied ARGB, which is what we want for blending, so
+            // just swap the red and blue channels rather than using convertToRGBA().
+            auto& icon = planeIcons->Sprite(v * kHeadingSteps + h);
+            for (unsigned y = 0; y < wh; ++y) {
+                auto s = reinterpret_cast<const uint32_t *>(bitmap.data() + y * bitmap.stride());
+                auto d = icon.Row(y);
+                for (unsigned x = 0; x < wh; ++x) {
+                    auto pix = *s++;
+                    *d++ = (pix & 0xff00ff00) | ((pix << 16) & 0xff0000) | ((pix >> 16) & 0xff);
+                }
+            }
+        }
+    }
 }
 
 void MapApp::ToolClick(ClickableTool t)
@@ -224,6 +404,9 @@ void MapApp::ToolClick(ClickableTool t)
     case ClickableTool::CENTRE:
         followPlane = !followPlane;
         break;
+    case ClickableTool::ROTATEC:
+        trackUp = !trackUp;
+        break;
     default:
         UNIMPLEMENTED(__func__ + fmt::format("({})", (int)t));
         break;
@@ -261,8 +444,18 @@ void MapApp::MouseEvent(int x, int y, bool l)
         auto dx = x - mouseDrag.startX;
         auto dy = y - mouseDrag.startY;
         mouseDrag.dragDistance += std::abs(dx + dy);
-        double tdx = (double)dx / tileSize.second;
-        double tdy = (double)dy / tileSize.first;
+        double mdx = dx;
+        double mdy = dy;
+        if (trackUp) {
+            // the drag is on the rotated map, so undo the rotation that it was
+            // painted with to get the movement in the north-up tile axes
+            const double c = std::cos(planeHeading);
+            const double s = std::sin(planeHeading);
+            mdx = c * dx - s * dy;
+            mdy = s * dx + c * dy;
+        }
+        double tdx = mdx / tileSize.second;
+        double tdy = mdy / tileSize.first;
         centreTYX = std::make_pair(mouseDrag.startTYX.first - tdy, mouseDrag.startTYX.second - tdx);
     }
 }
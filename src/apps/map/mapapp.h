@@ -3,14 +3,17 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include "navitab/geometrics.h"
 #include "../app.h"
+#include "../../imgkit/resampler.h"
+#include "../../imgkit/spriteatlas.h"
 
 namespace navitab {
 
 class AppServices;
-class BackingStore;
 class MapTileProvider;
+class RasterTile;
 
 class MapApp : public App
 {
@@ -26,19 +29,51 @@ protected:
     void Demolish() override;
 
 private:
+    void PaintNorthUpMap(PixelBuffer& canvas);
+    void ScrollBackdrop(int dx, int dy);
+    void PaintBackdropRegion(int x, int y, unsigned w, unsigned h);
+    void PaintRotatedMap(PixelBuffer& canvas, double rotation);
     unsigned HeadingToSteppedDegrees(double hrad);
-    std::shared_ptr<ImageBuffer> GeneratePlaneIcon(unsigned rotation, bool myPlane = true, bool above = true);
+
+    // The plane icons are drawn at each 6 degree heading step for each of these variants.
+    enum PlaneIcon { MY_PLANE, TRAFFIC_ABOVE, TRAFFIC_BELOW, kNumPlaneIcons };
+    static const unsigned kHeadingSteps = 60;
+    void GeneratePlaneIcons();
+    PixelBuffer& PlaneIconSprite(PlaneIcon variant, double hrad);
 
 private:
-    std::shared_ptr<BackingStore> store;
     std::shared_ptr<MapTileProvider> mapServer;
+    std::unique_ptr<SpriteAtlas> planeIcons;
     // true if map is moving to follow plane
     bool followPlane;
+    // true if the map is rotated so that the plane's track is up
+    bool trackUp;
+    // the plane's heading on the last flight loop, which the map is rotated by in track-up mode
+    double planeHeading;
+    // samples the tiles into the canvas when the map is rotated
+    Resampler resampler;
     // tile dimensions (TODO - may change if the tile server is changed)
     std::pair<unsigned, unsigned> tileSize;
     // tile coordinates of the canvas centre
     std::pair<double, double> centreTYX;
 
+    // The north-up map is composited into the backdrop, which is a little larger
+    // than the canvas, and is scrolled as the map moves. Only the newly exposed
+    // strips, and tiles that have changed, need painting from the tiles on each
+    // frame, but the canvas is still copied from the backdrop in full.
+    static const int kBackdropMargin = 64;
+    std::unique_ptr<ImageBuffer> backdrop;
+    bool backdropValid;
+    unsigned backdropZoom;
+    // pixel coordinates of the backdrop's top-left corner, in the whole map at this zoom
+    int64_t backdropX, backdropY;
+    // the tiles that are painted in the backdrop, row by row, starting with the
+    // tile at backdropTY0,backdropTX0. The other vector is reused for each frame.
+    std::vector<std::shared_ptr<RasterTile>> backdropTiles;
+    std::vector<std::shared_ptr<RasterTile>> visibleTiles;
+    int backdropTY0, backdropTX0;
+    int backdropRows, backdropCols;
+
     // mouse click/drag state
     struct {
         bool down;
@@ -25,6 +25,9 @@
 #include "../apps/settings/settingsapp.h"
 #include "../platform/paths.h"
 #include "../lvglkit/toolkit.h"
+#include "../imgkit/pixelkernels.h"
+#include "../imgkit/tilepool.h"
+#include "../imgkit/imgkit.h"
 
 namespace navitab {
 
@@ -191,10 +194,57 @@ void Navitab::Start()
     running = true;
 
     curl_global_init(CURL_GLOBAL_ALL);
+    LOGS(fmt::format("Using {} pixel kernels", PixelKernelSet().name));
 
     storeManager = std::make_shared<BackingStore>(paths);
-    docManager = std::make_shared<DocumentManager>(paths);
-    maptileProvider = std::make_shared<MapTileProvider>(paths, settings, docManager);
+    imgKit = std::make_shared<ImagingKit>();
+    std::string colourMode = "day";
+    auto dp = settings->Get("/display");
+    try {
+        colourMode = dp.at("/colourmode"_json_pointer);
+    }
+    catch (...) {
+        dp["colourmode"] = colourMode;
+        settings->Put("/display", dp);
+    }
+    imgKit->SetColourMode(ColourModeFromName(colourMode));
+    unsigned tilePoolMax = TilePool::kDefaultHighWaterMark;
+    try {
+        tilePoolMax = dp.at("/tilepoolmax"_json_pointer);
+    }
+    catch (...) {
+        dp["tilepoolmax"] = tilePoolMax;
+        settings->Put("/display", dp);
+    }
+    TilePool::GetTilePool()->SetHighWaterMark(tilePoolMax);
+    unsigned maxDownloads = DocumentManager::kDefaultMaxDownloads;
+    auto dm = settings->Get("/docs");
+    try {
+        maxDownloads = dm.at("/maxdownloads"_json_pointer);
+    }
+    catch (...) {
+        dm["maxdownloads"] = maxDownloads;
+        settings->Put("/docs", dm);
+    }
+    unsigned docCacheMB = DocumentManager::kDefaultCacheMB;
+    try {
+        docCacheMB = dm.at("/cachemb"_json_pointer);
+    }
+    catch (...) {
+        dm["cachemb"] = docCacheMB;
+        settings->Put("/docs", dm);
+    }
+    unsigned docStoreMB = BackingStore::kDefaultDocumentLimitMB;
+    try {
+        docStoreMB = dm.at("/storemb"_json_pointer);
+    }
+    catch (...) {
+        dm["storemb"] = docStoreMB;
+        settings->Put("/docs", dm);
+    }
+    storeManager->SetDocumentLimit((size_t)docStoreMB << 20);
+    docManager = std::make_shared<DocumentManager>(paths, imgKit, storeManager, maxDownloads, docCacheMB);
+    maptileProvider = std::make_shared<MapTileProvider>(paths, settings, docManager, imgKit, storeManager);
     navProvider = std::make_shared<NavProvider>();
 
     // Start the background worker thread. Most of the actual work done in
@@ -253,7 +303,14 @@ void Navitab::Stop()
     navProvider.reset();
     maptileProvider.reset();
     docManager.reset();
+    imgKit.reset();
     settings.reset();
+    // all of the tiles should have been dropped by now, so the pool can be emptied
+    auto pool = TilePool::GetTilePool();
+    auto ps = pool->GetStats();
+    LOGS(fmt::format("Tile pool allocated {}, reused {}, discarded {}, peak in use {}, still in use {}",
+        ps.allocations, ps.reuses, ps.discards, ps.peakInUse, ps.inUse));
+    pool->Trim();
     if (running) {
         running = false;
         int a;
@@ -312,6 +369,11 @@ std::shared_ptr<MapTileProvider> Navitab::GetMapsProvider()
     return maptileProvider;
 }
 
+std::shared_ptr<ImagingKit> Navitab::GetImagingKit()
+{
+    return imgKit;
+}
+
 std::shared_ptr<NavProvider> Navitab::GetNavProvider()
 {
     return navProvider;
@@ -87,6 +87,7 @@ public:
     std::shared_ptr<BackingStore> GetStoreManager() override;
     std::shared_ptr<DocumentManager> GetDocsProvider() override;
     std::shared_ptr<MapTileProvider> GetMapsProvider() override;
+    std::shared_ptr<ImagingKit> GetImagingKit() override;
     std::shared_ptr<NavProvider> GetNavProvider() override;
     void EnableTools(int toolMask, int repeatMask) override;
     PixelBuffer GetCanvasPixels() override;
@@ -145,6 +146,7 @@ private:
     std::shared_ptr<lvglkit::Manager>   uiMgr;
 
     std::shared_ptr<BackingStore>       storeManager;
+    std::shared_ptr<ImagingKit>         imgKit;
     std::shared_ptr<DocumentManager>    docManager;
     std::shared_ptr<MapTileProvider>    maptileProvider;
     std::shared_ptr<NavProvider>        navProvider;
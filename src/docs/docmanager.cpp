@@ -4,142 +4,392 @@
 #include "downloader.h"
 #include "document.h"
 #include "navitab/platform.h"
+#include "../imgkit/imgkit.h"
+#include "../store/backingstore.h"
+#include "../store/mappedfile.h"
 #include <fmt/core.h>
 #include <mupdf/fitz.h>
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <filesystem>
 
 namespace navitab {
 
-DocumentManager::DocumentManager(std::shared_ptr<PathServices> ps)
+DocumentManager::DocumentManager(std::shared_ptr<PathServices> ps, std::shared_ptr<ImagingKit> ik, std::shared_ptr<BackingStore> bs, unsigned maxDownloads, unsigned cacheMB)
 :   LOG(std::make_unique<logging::Logger>("docmgr")),
-    running(true),
-    cancelDownload(false),
-    fzctx(nullptr)
+    cacheBudget((size_t)cacheMB << 20),
+    fetchSeq(0),
+    store(bs),
+    imgKit(ik),
+    fzctx(nullptr),
+    fetchCtx(nullptr)
 {
-    fzctx = fz_new_context(nullptr, nullptr, FZ_STORE_UNLIMITED);
-    if (!fzctx) {
+    // the documents are prepared using contexts that share the MuPDF store with
+    // the imaging kit's tile rendering threads. fetched documents are prepared on
+    // the downloader's thread, so that opening a large one (which reads all of
+    // its pages' bounds) doesn't hold up the core thread.
+    fzctx = imgKit->CloneContext();
+    fetchCtx = imgKit->CloneContext();
+    if (!fzctx || !fetchCtx) {
+        if (fzctx) fz_drop_context(fzctx);
+        if (fetchCtx) fz_drop_context(fetchCtx);
         throw std::runtime_error("Couldn't initialize MuPDF rasterizing libraries");
     }
-    fz_try(fzctx) {
-        fz_register_document_handlers(fzctx);
-    } fz_catch(fzctx) {
-        fz_drop_context(fzctx);
-        throw std::runtime_error(fmt::format("Cannot register MuPDF document handlers: {}", std::string(fz_caught_message(fzctx))));
-    }
 
-    // Start the background worker thread. This thread is used to download documents
-    // in the background and put them into the cache. For simplicity only one download
-    // can be requested at a time (maybe subject to future enhancement).
+    // Start the downloader. This has its own thread which downloads documents in
+    // the background, up to maxDownloads at a time, and the results are put into
+    // the cache.
 
-    worker = std::make_unique<std::thread>([this]() { AsyncWorker(); });
+    downloader = std::make_unique<Downloader>(maxDownloads,
+                [this](Downloader::Request& r) { return NextFetch(r.url, r.etag, r.lastModified); },
+                [this](const std::string& url, std::shared_ptr<Document> doc) { FetchDone(url, doc); });
+    LOGI(fmt::format("Downloading up to {} documents at a time, caching up to {}MB", maxDownloads, cacheMB));
 }
 
 DocumentManager::~DocumentManager()
 {
-    cancelDownload = true;
-    running = false;
-    jsync.notify_one();
-    worker->join();
+    // stop the downloader first, since it calls back into the document manager
+    downloader.reset();
 
-    // empty the document cache manually before shutting down MuPDF
-    // TODO - do we need to do SQL stuff here? hopefully the maintenance tick has already
-    // cached anything we didn't already have?
+    // empty the document cache manually before shutting down MuPDF. downloaded
+    // documents were queued for the backing store as they arrived.
 
     docCache.clear();
+    docAges.clear();
+    releasedDocs.clear();
+    fz_drop_context(fetchCtx);
     fz_drop_context(fzctx);
 }
 
 void DocumentManager::MaintenanceTick()
 {
-    // TODO - do some SQL database stuff here to create a persistent
-    // cache between runs.
+    // The documents' sizes change as they are used (eg a page's display list is
+    // made when it is first rendered), so the total is worked out afresh. Then the
+    // oldest documents are evicted until the cache is within its budget. Documents
+    // that are still in use elsewhere (eg waiting to be rendered) are kept.
+    //
+    // The cache's references are only dropped here, on the core thread, including
+    // those to documents that the downloader's thread replaced or finished with.
+    // A document may still outlive them if a rendering job holds it, which is safe
+    // since each document has its own MuPDF context.
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    releasedDocs.clear();
+    size_t bytes = 0;
+    for (auto& cd : docCache) {
+        bytes += cd.second.doc->MemoryUsage();
+    }
+    auto ai = docAges.end();
+    unsigned evicted = 0;
+    while ((bytes > cacheBudget) && (ai != docAges.begin())) {
+        --ai;
+        auto ci = docCache.find(*ai);
+        if (ci->second.doc.use_count() > 1) continue;
+        bytes -= ci->second.doc->MemoryUsage();
+        docCache.erase(ci);
+        ai = docAges.erase(ai);
+        ++evicted;
+    }
+    if (evicted) {
+        LOGD(fmt::format("Evicted {} documents, {} cached using {}KB", evicted, docCache.size(), bytes >> 10));
+    }
+}
+
+void DocumentManager::CacheDocument(const std::string& url, std::shared_ptr<Document> doc)
+{
+    // the caller must hold the cache mutex
+    auto ci = docCache.find(url);
+    if (ci != docCache.end()) {
+        if (ci->second.doc != doc) releasedDocs.push_back(std::move(ci->second.doc));
+        ci->second.doc = doc;
+        docAges.splice(docAges.begin(), docAges, ci->second.age);
+    } else {
+        docAges.push_front(url);
+        docCache[url] = CachedDoc{ doc, docAges.begin() };
+    }
+}
+
+std::shared_ptr<Document> DocumentManager::FindDocument(const std::string& url)
+{
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    auto ci = docCache.find(url);
+    if (ci == docCache.end()) return nullptr;
+    docAges.splice(docAges.begin(), docAges, ci->second.age);
+    auto& doc = ci->second.doc;
+    doc->Prepare(fzctx);
+    return doc;
+}
 
-#if 0 // TODO - rethink this, probably based on number of docs and age
+std::shared_ptr<Document> DocumentManager::AddDocument(const std::string& url, const std::string& type, std::vector<uint8_t>&& data)
+{
+    auto doc = std::make_shared<Document>(url, type, std::move(data));
+    doc->Prepare(fzctx);
     std::unique_lock<std::mutex> lock(cacheMutex);
-    auto ci = docCache.begin();
-    while (ci != docCache.end()) {
-        auto uc = ci->second.use_count();
-        // remove from the cache if not being used elsewhere (TODO, and has been stored in the persistent SQL database)
-        if (uc < 2) {
-            docCache.erase(ci++);
-        } else {
-            ++ci;
+    CacheDocument(url, doc);
+    return doc;
+}
+
+void DocumentManager::PrepareDocument(Document& doc)
+{
+    doc.Prepare(fzctx);
+}
+
+std::shared_ptr<Document> DocumentManager::GetDocument(std::string url, int priority, bool persist, std::shared_ptr<Document> stale)
+{
+    // the document is immediately available if it's in the cache
+    auto doc = FindDocument(url);
+    if (doc) return doc;
+
+    // otherwise queue a job to fetch it in the background. documents kept in the
+    // backing store are loaded by the job too, so that reading a large one never
+    // holds up the core thread.
+    if (QueueFetch(url, priority, persist, stale)) downloader->Wakeup();
+
+    // always return nullptr - the requestor will ask again later
+    return nullptr;
+}
+
+bool DocumentManager::QueueFetch(const std::string& url, int priority, bool persist, std::shared_ptr<Document> stale)
+{
+    // the job is queued unless it's already queued, in which case its priority is
+    // updated (eg a map tile that has moved nearer the centre of the screen), or
+    // it's already being fetched. returns true if a new job was queued.
+    std::lock_guard<std::mutex> lock(jmutex);
+    auto qi = queuedFetches.find(url);
+    if (qi != queuedFetches.end()) {
+        if (std::get<0>(qi->second) != priority) {
+            fetchQueue.erase(qi->second);
+            std::get<0>(qi->second) = priority;
+            fetchQueue.insert(qi->second);
         }
+        return false;
     }
-#endif
+    if (activeFetches.find(url) != activeFetches.end()) return false;
+    if (persist) persistentFetches.insert(url);
+    if (stale) staleDocs[url] = stale;
+    FetchOrder fo(priority, fetchSeq++, url);
+    queuedFetches[url] = fo;
+    fetchQueue.insert(fo);
+    return true;
 }
 
-std::shared_ptr<Document> DocumentManager::GetDocument(std::string url)
+void DocumentManager::CancelFetch(const std::string& url)
 {
-    // the document is immediately available if it's in the cache
     {
-        std::unique_lock<std::mutex> lock(cacheMutex);
-        auto ci = docCache.find(url);
-        if (ci != docCache.end()) {
-            auto& doc = ci->second;
-            doc->Prepare(fzctx);
-            return doc;
+        std::lock_guard<std::mutex> lock(jmutex);
+        auto qi = queuedFetches.find(url);
+        if (qi != queuedFetches.end()) {
+            fetchQueue.erase(qi->second);
+            queuedFetches.erase(qi);
+            persistentFetches.erase(url);
+            staleDocs.erase(url);
+            return;
         }
+        if (activeFetches.find(url) == activeFetches.end()) return;
     }
+    downloader->Cancel(url);
+}
 
-    // can we fetch it from the persistent SQL database?
-    // TODO ...
+bool DocumentManager::NextFetch(std::string& url, std::string& etag, std::string& lastModified)
+{
+    // called on the downloader's thread to get the most urgent job, along with the
+    // validators of a stale copy if there is one. local files, and documents that
+    // are fresh in the backing store, are loaded straight away rather than being
+    // given to the downloader.
+    while (1) {
+        bool persist;
+        {
+            std::lock_guard<std::mutex> lock(jmutex);
+            if (fetchQueue.empty()) return false;
+            url = std::get<2>(*fetchQueue.begin());
+            fetchQueue.erase(fetchQueue.begin());
+            queuedFetches.erase(url);
+            activeFetches.insert(url);
+            persist = persistentFetches.count(url) > 0;
+        }
+        if (url.substr(0, 5) == "file:") {
+            FetchDone(url, Readfile(url));
+            continue;
+        }
+        if (persist && store && LoadStoredDocument(url)) continue;
+        {
+            std::lock_guard<std::mutex> lock(jmutex);
+            auto si = staleDocs.find(url);
+            if (si != staleDocs.end()) {
+                etag = si->second->Caching().etag;
+                lastModified = si->second->Caching().lastModified;
+            }
+        }
+        return true;
+    }
+}
 
-    // otherwise start a job to initiate the fetch in the background if
-    // there isn't a job currently in progress
-    bool busy = true;
-    {
-        std::lock_guard<std::mutex> lock(jmutex);
-        busy = !job.empty();
+bool DocumentManager::LoadStoredDocument(const std::string& url)
+{
+    // called on the downloader's thread. returns true if the document was found
+    // in the backing store and hasn't expired, so there is nothing to download.
+    std::string type;
+    std::vector<uint8_t> data;
+    BackingStore::Validators v;
+    if (!store->GetDocument(url, type, data, v)) return false;
+    LOGD(fmt::format("Loaded {} from the backing store", url));
+    auto doc = std::make_shared<Document>(url, type, std::move(data));
+    Document::CacheInfo ci;
+    ci.etag = v.etag;
+    ci.lastModified = v.lastModified;
+    doc->SetCaching(ci);
+
+    // a fresh document is finished with as if it had been downloaded, except that
+    // it's already stored
+    if (v.expires > (int64_t)std::time(nullptr)) {
+        {
+            std::lock_guard<std::mutex> lock(jmutex);
+            persistentFetches.erase(url);
+        }
+        FetchDone(url, doc);
+        return true;
     }
-    if (!busy) {
-        job = url;
-        jsync.notify_one();
+
+    // an expired document is used while the server is asked if it has changed,
+    // which usually costs a 304 response rather than the whole document
+    doc->Prepare(fetchCtx);
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        CacheDocument(url, doc);
     }
+    std::lock_guard<std::mutex> lock(jmutex);
+    staleDocs[url] = doc;
+    return false;
+}
 
-    // always return nullptr - the requestor will ask again later
-    return nullptr;
+// The time at which a downloaded document expires, using the default lifetime if
+// the server didn't give one.
+static int64_t expiryTime(const Document::CacheInfo& ci, int64_t defaultLifetime)
+{
+    return (int64_t)std::time(nullptr) + ((ci.maxAge >= 0) ? ci.maxAge : defaultLifetime);
 }
 
-void DocumentManager::AsyncWorker()
+void DocumentManager::FetchDone(const std::string& url, std::shared_ptr<Document> doc)
 {
-    while (1) {
-        // pause until there's something to do
-        std::unique_lock<std::mutex> lock(jmutex);
-        jsync.wait(lock, [this]() { return !running || job.size(); });
-        if (!running) break;
-        lock.unlock();
-
-        // what's required to be done is coded in the job string
-        std::shared_ptr<Document> doc = nullptr;
-        if (job.substr(0, 5) == "file:") {
-            doc = Readfile(job);
-        } else {
-            doc = Download(job);
+    bool persist;
+    std::shared_ptr<Document> stale;
+    {
+        std::lock_guard<std::mutex> lock(jmutex);
+        activeFetches.erase(url);
+        persist = persistentFetches.erase(url) > 0;
+        auto si = staleDocs.find(url);
+        if (si != staleDocs.end()) {
+            stale = si->second;
+            staleDocs.erase(si);
         }
-
-        // if the outcome of the work was a document, then put it into the cache
-        if (doc) {
-            LOGI(fmt::format("Cached {}", job));
+    }
+    if (!doc) {
+        if (stale) {
             std::unique_lock<std::mutex> lock(cacheMutex);
-            docCache[job] = doc;
+            releasedDocs.push_back(std::move(stale));
         }
+        return;
+    }
+
+    // a stale copy that the server says is unchanged is used again, with the new
+    // validators (a 304 response need not repeat them) and freshness lifetime.
+    // the new document borrows the stale one's data rather than copying it, since
+    // the stale one may be in use elsewhere.
+    if (stale && (doc->Status() == Document::NOT_MODIFIED)) {
+        LOGD(fmt::format("Revalidated {}", url));
+        auto ci = stale->Caching();
+        auto& nci = doc->Caching();
+        if (!nci.etag.empty()) ci.etag = nci.etag;
+        if (!nci.lastModified.empty()) ci.lastModified = nci.lastModified;
+        ci.maxAge = nci.maxAge;
+        ci.noStore = nci.noStore;
+        ci.revalidated = true;
+        doc = std::make_shared<Document>(url, stale->Type(), stale->Data(), stale->Size(), stale);
+        doc->SetCaching(ci);
+    }
 
-        // clear the job ready for another request
-        lock.lock();
-        job = "";
+    // the document is opened here, on the downloader's thread, so it's ready to
+    // use as soon as it is found in the cache
+    if (doc->Status() == Document::OK) doc->Prepare(fetchCtx);
+
+    // if the outcome of the work was a document, then put it into the cache. a
+    // download is also written behind to the backing store, this only queues it.
+    const auto& ci = doc->Caching();
+    if (persist && store && !ci.noStore && (url.substr(0, 5) != "file:")) {
+        BackingStore::Validators v;
+        v.etag = ci.etag;
+        v.lastModified = ci.lastModified;
+        v.expires = expiryTime(ci, (int64_t)kStoredLifetimeDays * 24 * 60 * 60);
+        if (ci.revalidated) {
+            store->RefreshDocument(url, v);
+        } else if (doc->Status() == Document::OK) {
+            store->StoreDocument(url, doc->Type(), doc->Data(), doc->Size(), v);
+        }
     }
+    std::unique_lock<std::mutex> lock(cacheMutex);
+
+    // if revalidation failed (eg the network is down) the stale copy is better
+    // than nothing, so it stays in the cache
+    auto cached = docCache.find(url);
+    bool keepStale = stale && (doc->Status() != Document::OK) && (cached != docCache.end()) && (cached->second.doc == stale);
+    if (stale) releasedDocs.push_back(std::move(stale));
+    if (keepStale) return;
+    LOGI(fmt::format("Cached {}", url));
+    CacheDocument(url, doc);
 }
 
-std::shared_ptr<Document> DocumentManager::Download(const std::string& url)
+// The local path of a "file:" URL, which may or may not have an (empty) authority
+// part, and may have percent-encoded characters.
+static std::filesystem::path fileUrlPath(const std::string& url)
 {
-    Downloader d(url);
-    return d.Download(cancelDownload, fzctx);
+    std::string p = url.substr(5);
+    if (p.compare(0, 2, "//") == 0) {
+        auto slash = p.find('/', 2);
+        p = (slash == std::string::npos) ? "" : p.substr(slash);
+    }
+#if defined(NAVITAB_WINDOWS)
+    // file:///C:/charts/foo.pdf
+    if ((p.size() > 2) && (p[0] == '/') && (p[2] == ':')) p.erase(0, 1);
+#endif
+    std::string decoded;
+    for (size_t i = 0; i < p.size(); ++i) {
+        if ((p[i] == '%') && ((i + 2) < p.size()) && std::isxdigit((unsigned char)p[i + 1]) && std::isxdigit((unsigned char)p[i + 2])) {
+            decoded += (char)std::stoi(p.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            decoded += p[i];
+        }
+    }
+    return std::filesystem::u8path(decoded);
 }
 
-std::shared_ptr<Document> DocumentManager::Readfile(const std::string& fpath)
+// The MIME type of a local file, from its extension. MuPDF also accepts the
+// extension itself for the less common formats (eg xps, epub, cbz).
+static std::string fileType(const std::filesystem::path& path)
 {
-    UNIMPLEMENTED(__func__);
-    return nullptr;
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    if (ext == ".pdf") return "application/pdf";
+    if (ext == ".png") return "image/png";
+    if ((ext == ".jpg") || (ext == ".jpeg")) return "image/jpeg";
+    return ext;
+}
+
+std::shared_ptr<Document> DocumentManager::Readfile(const std::string& url)
+{
+    // Local files are mapped into memory rather than read, so that large chart
+    // binders open quickly and MuPDF reads them in place. The pages are only read
+    // from the file as they are used, and the mapping is shared with the OS's file
+    // cache, so they don't count against the document cache. This runs on the
+    // downloader's thread, and FetchDone opens the document there as well.
+    auto path = fileUrlPath(url);
+    auto file = std::make_shared<MappedFile>(path);
+    if (!file->IsOpen()) {
+        LOGE(fmt::format("Unable to open {}", path.string()));
+        return std::make_shared<Document>(url, Document::DocStatus::NOT_FOUND);
+    }
+    LOGD(fmt::format("Mapped {} ({}KB)", path.string(), file->Size() >> 10));
+    return std::make_shared<Document>(url, fileType(path), file->Data(), file->Size(), file);
 }
 
 
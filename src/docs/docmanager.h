@@ -10,14 +10,16 @@
 
 #include "navitab/logger.h"
 #include "navitab/deferred.h"
-#include "../imgkit/rasterizer.h"
 #include <memory>
 #include <functional>
-#include <queue>
+#include <list>
 #include <mutex>
-#include <condition_variable>
-#include <thread>
 #include <map>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 struct fz_context;
 
@@ -26,39 +28,104 @@ namespace navitab {
 struct PathServices;
 class RasterTile;
 class Document;
+class ImagingKit;
+class Downloader;
+class BackingStore;
 
 class DocumentManager
 {
 public:
-    DocumentManager(std::shared_ptr<PathServices>);
-
-    std::shared_ptr<Document> GetDocument(std::string url);
+    DocumentManager(std::shared_ptr<PathServices>, std::shared_ptr<ImagingKit>, std::shared_ptr<BackingStore>, unsigned maxDownloads = kDefaultMaxDownloads, unsigned cacheMB = kDefaultCacheMB);
+
+    // Get a document, if it is in the cache. Otherwise a fetch is queued (or the
+    // queued fetch is given the new priority) and nullptr is returned, so the
+    // caller should ask again later. Lower priority values are fetched first.
+    // Downloaded documents are kept in the backing store unless the caller stores
+    // them itself (eg map tiles), in which case persist is false, and the fetch
+    // loads them from there on later runs. A stored document that has expired is
+    // put in the cache as it is while it is revalidated with the server. A caller that has its own
+    // stale copy can pass it, and if the server says it is unchanged the cache
+    // gets a copy of it with Caching().revalidated set.
+    std::shared_ptr<Document> GetDocument(std::string url, int priority = 0, bool persist = true, std::shared_ptr<Document> stale = nullptr);
+
+    // Get a document only if it is in the cache, without fetching it.
+    std::shared_ptr<Document> FindDocument(const std::string& url);
+
+    // Add a document whose contents were obtained elsewhere (eg from the backing
+    // store) to the cache, ready for use.
+    std::shared_ptr<Document> AddDocument(const std::string& url, const std::string& type, std::vector<uint8_t>&& data);
+
+    // Prepare a document that is not going to be cached (eg a tile from a local
+    // archive, which can be found again just as quickly).
+    void PrepareDocument(Document& doc);
+
+    // Abandon the fetch of a document that is no longer wanted, whether it has
+    // started or not.
+    void CancelFetch(const std::string& url);
+
+    static const unsigned kDefaultMaxDownloads = 6;
+    static const unsigned kDefaultCacheMB = 64;
+    static const unsigned kStoredLifetimeDays = 30;
 
     void MaintenanceTick();
 
     virtual ~DocumentManager();
 
 protected:
-    void AsyncWorker();
-    std::shared_ptr<Document> Download(const std::string& url);
-    std::shared_ptr<Document> Readfile(const std::string& fpath);
+    bool QueueFetch(const std::string& url, int priority, bool persist, std::shared_ptr<Document> stale);
+    bool NextFetch(std::string& url, std::string& etag, std::string& lastModified);
+    bool LoadStoredDocument(const std::string& url);
+    void FetchDone(const std::string& url, std::shared_ptr<Document> doc);
+    std::shared_ptr<Document> Readfile(const std::string& url);
+    void CacheDocument(const std::string& url, std::shared_ptr<Document> doc);
 
 private:
     std::unique_ptr<logging::Logger>    LOG;
 
-    // simple in-memory cache of documents, keyed by URL
-    std::map<std::string, std::shared_ptr<Document> > docCache;
+    // in-memory cache of documents, keyed by URL. The cache is limited by the
+    // documents' estimated memory usage, and the least recently used documents
+    // that are not in use elsewhere are evicted during the maintenance tick.
+    struct CachedDoc {
+        std::shared_ptr<Document> doc;
+        std::list<std::string>::iterator age;
+    };
+    std::unordered_map<std::string, CachedDoc> docCache;
+    std::list<std::string>              docAges;    // most recently used first
+    size_t                              cacheBudget;
+
+    // documents that have left the cache (or the stale copies of revalidated
+    // documents) waiting for the core thread to release them
+    std::vector<std::shared_ptr<Document>> releasedDocs;
     std::mutex                          cacheMutex;
 
-    // flags and state for the asynchronous downloader
-    bool cancelDownload;
-    bool running;
-    std::unique_ptr<std::thread>    worker;
-    std::string                     job;
-    std::condition_variable         jsync;
-    std::mutex                      jmutex;
-
+    // The fetch queue is ordered by priority, and then by the order the requests
+    // were made. Each queued URL is also indexed, so that it can be reprioritised
+    // or cancelled, and so that duplicate requests are ignored.
+    typedef std::tuple<int, uint64_t, std::string> FetchOrder;
+    std::set<FetchOrder>                        fetchQueue;
+    std::unordered_map<std::string, FetchOrder> queuedFetches;
+    uint64_t                                    fetchSeq;
+
+    // the URLs that have been handed to the downloader, the URLs of fetches whose
+    // documents are to be kept in the backing store, and the stale copies of the
+    // documents that are being revalidated
+    std::unordered_set<std::string>             activeFetches;
+    std::unordered_set<std::string>             persistentFetches;
+    std::unordered_map<std::string, std::shared_ptr<Document>> staleDocs;
+    std::mutex                                  jmutex;
+
+    // the downloader runs the fetches in the background, taking the most urgent
+    // job from the fetch queue whenever it can start another transfer
+    std::unique_ptr<Downloader>     downloader;
+
+    // the persistent tier, which is written in the background
+    std::shared_ptr<BackingStore>   store;
+
+    // MuPDF contexts for preparing documents on the core thread (eg tiles from the
+    // backing store), and on the downloader's thread (everything it fetches)
+    std::shared_ptr<ImagingKit> imgKit;
     fz_context* fzctx;
+    fz_context* fetchCtx;
 
 };
 
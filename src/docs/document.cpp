@@ -1,55 +1,120 @@
 /* This file is part of the Navitab project. See the README and LICENSE for details. */
 
 #include "document.h"
-#include "navitab/tiles.h"
+#include "../imgkit/imagedecoder.h"
 #include <fmt/core.h>
 
 namespace navitab {
 
+// MuPDF doesn't report the sizes of its objects, so these are rough allowances for
+// an open document (including its context, which is mostly the error stack), each
+// page's bounds, and a page's display list. Decoded images and fonts are kept in
+// MuPDF's store, which has its own limit.
+static const size_t kMuPdfDocumentBytes = 128 * 1024;
+static const size_t kMuPdfPageBytes = 1024;
+static const size_t kMuPdfDisplayListBytes = 256 * 1024;
+
 Document::Document(const std::string& u, DocStatus e)
 :   LOG(std::make_unique<logging::Logger>("docmnt")),
     url(u),
     status(e),
     type("UNKNOWN"),
+    contentData(nullptr),
+    contentSize(0),
     fzctx(nullptr),
     stream(nullptr),
     doc(nullptr),
     activePageNum(-1),
-    activePageDisplayList(nullptr)
+    activePageDisplayList(nullptr),
+    pageCount(0),
+    rasterImage(false),
+    prepared(false)
 {
     // This is the constructor used to create a missing document. Keeping it in the
     // cache will avoid continuous retrying.
 }
 
-Document::Document(const std::string& u, const std::string& t, std::vector<uint8_t>& data)
+Document::Document(const std::string& u, const std::string& t, std::vector<uint8_t>&& data)
 :   LOG(std::make_unique<logging::Logger>("docmnt")),
     url(u),
     status(OK),
     type(t.size() ? t : "application/pdf"),
-    contents(data),
+    contents(std::move(data)),
+    contentData(contents.data()),
+    contentSize(contents.size()),
     fzctx(nullptr),
     stream(nullptr),
     doc(nullptr),
     activePageNum(-1),
-    activePageDisplayList(nullptr)
+    activePageDisplayList(nullptr),
+    pageCount(0),
+    rasterImage(false),
+    prepared(false)
 {
     // This constructor is used for downloaded documents stored in memory.
 }
 
+Document::Document(const std::string& u, const std::string& t, const uint8_t* data, size_t size, std::shared_ptr<const void> b)
+:   LOG(std::make_unique<logging::Logger>("docmnt")),
+    url(u),
+    status(OK),
+    type(t.size() ? t : "application/pdf"),
+    backing(b),
+    contentData(data),
+    contentSize(size),
+    fzctx(nullptr),
+    stream(nullptr),
+    doc(nullptr),
+    activePageNum(-1),
+    activePageDisplayList(nullptr),
+    pageCount(0),
+    rasterImage(false),
+    prepared(false)
+{
+    // This constructor is used for documents in memory owned by something else.
+}
+
 Document::~Document()
 {
-    dropActivePage();
-    if (doc) fz_drop_document(fzctx, doc);
-    if (stream) fz_drop_stream(fzctx, stream);
+    // the document has its own context, so it can be destroyed on any thread
+    if (fzctx) {
+        dropActivePage(fzctx);
+        if (doc) fz_drop_document(fzctx, doc);
+        if (stream) fz_drop_stream(fzctx, stream);
+        fz_drop_context(fzctx);
+    }
 }
 
 void Document::Prepare(fz_context* fzc)
 {
-    if (fzctx) return; // already prepared
-    fzctx = fzc;
+    std::lock_guard<std::mutex> lock(docMutex);
+    if (prepared) return;
+    prepared = true;
+
+    // PNG and JPEG images (nearly all map tiles) only need their header reading
+    // here, they are decoded when tiles are rendered.
+    unsigned iw, ih;
+    if ((type.compare(0, 6, "image/") == 0) && ImageDecoder::CanDecode(contentData, contentSize, iw, ih)) {
+        rasterImage = true;
+        pageCount = 1;
+        fz_rect rect = { 0.0f, 0.0f, (float)iw, (float)ih };
+        pageRects.push_back(rect);
+        return;
+    }
+
+    // Documents opened by MuPDF get their own context, cloned from the preparing
+    // thread's, which is only used to open and release the document. So whichever
+    // thread drops the last reference to the document, its context isn't in use
+    // by anyone else. The rendering threads use their own contexts.
+    fzctx = fz_clone_context(fzc);
+    if (!fzctx) {
+        LOGE(fmt::format("Unable to clone a MuPDF context for {}", url));
+        status = UNSUPPORTED;
+        return;
+    }
 
     fz_try(fzctx) {
-        stream = fz_open_memory(fzctx, contents.data(), contents.size());
+        stream = fz_open_memory(fzctx, contentData, contentSize);
         doc = fz_open_document_with_stream(fzctx, type.c_str(), stream);
     } fz_catch(fzctx) {
         if (stream) {
@@ -82,121 +147,56 @@ void Document::Prepare(fz_context* fzc)
     }
 }
 
-void Document::selectPage(int p)
+void Document::selectPage(fz_context* ctx, int p)
 {
     if ((activePageNum == p) && activePageDisplayList) return;
 
-    dropActivePage();
+    dropActivePage(ctx);
 
-    fz_try(fzctx) {
-        activePageDisplayList = fz_new_display_list_from_page_number(fzctx, doc, p);
+    fz_try(ctx) {
+        activePageDisplayList = fz_new_display_list_from_page_number(ctx, doc, p);
         activePageNum = p;
-    } fz_catch(fzctx) {
-        LOGE(fmt::format("MuPDF could not parse page {} for {}. It reported {}", p, url, fz_caught_message(fzctx)));
+    } fz_catch(ctx) {
+        LOGE(fmt::format("MuPDF could not parse page {} for {}. It reported {}", p, url, fz_caught_message(ctx)));
         activePageDisplayList = nullptr;
         activePageNum = -1;
     }
 }
 
-void Document::dropActivePage()
+void Document::dropActivePage(fz_context* ctx)
 {
     if (activePageNum >= 0) {
         if (activePageDisplayList) {
-            fz_drop_display_list(fzctx, activePageDisplayList);
+            fz_drop_display_list(ctx, activePageDisplayList);
             activePageDisplayList = nullptr;
         }
         activePageNum = -1;
     }
 }
 
+size_t Document::MemoryUsage()
+{
+    std::lock_guard<std::mutex> lock(docMutex);
+    size_t bytes = sizeof(Document) + contents.capacity();
+    if (doc) bytes += kMuPdfDocumentBytes + pageRects.size() * kMuPdfPageBytes;
+    if (activePageDisplayList) bytes += kMuPdfDisplayListBytes;
+    return bytes;
+}
+
 std::pair<unsigned, unsigned> Document::PageSize(unsigned page)
 {
     auto& rect = pageRects.at(page);
     return std::pair<unsigned, unsigned>(rect.x1 - rect.x0, rect.y1 - rect.y0);
 }
 
-std::shared_ptr<RasterTile> Document::GetTile(unsigned page, float scaleX, float scaleY, int x, int y, unsigned w, unsigned h)
+fz_display_list* Document::GetDisplayList(fz_context* ctx, unsigned page, fz_rect& bounds)
 {
-    selectPage(page);
-
-    if (!w) w = RasterTile::DefaultWidth;
-    if (!h) h = RasterTile::DefaultHeight;
-
-    auto tile = std::make_shared<RasterTile>(w, h);
-
-    int outStartX = w * x;
-    int outStartY = h * y;
-
-    int outWidth = w;
-    int outHeight = h;
-
-    fz_irect clipBox;
-    clipBox.x0 = outStartX;
-    clipBox.x1 = outStartX + outWidth;
-    clipBox.y0 = outStartY;
-    clipBox.y1 = outStartY + outHeight;
-
-    fz_pixmap* pix = nullptr;
-    fz_try(fzctx) {
-        uint8_t* outBuf = (uint8_t*)tile->Row(0);
-        pix = fz_new_pixmap_with_data(fzctx, fz_device_rgb(fzctx), outWidth, outHeight, nullptr, 1, outWidth * 4, outBuf);
-        pix->x = clipBox.x0;
-        pix->y = clipBox.y0;
-        pix->xres = 72; // 72 is the normal resolution of MuPDF
-        pix->yres = 72;
-    } fz_catch(fzctx) {
-        LOGE(fmt::format("MuPDF could not create pixmap. It reported {}", fz_caught_message(fzctx)));
-        return tile;
-    }
-
-    fz_device* dev = nullptr;
-    fz_try(fzctx) {
-        auto& rect = pageRects.at(activePageNum);
-        int currentPageWidth = rect.x1 - rect.x0;
-        int currentPageHeight = rect.y1 - rect.y0;
-
-        int translateX = 0, translateY = 0;
-
-        fz_matrix scaleMatrix = fz_scale(scaleX, scaleY);
-        fz_matrix rotateMatrix = fz_rotate(0);
-        fz_matrix rotateAndScaleMatrix = fz_concat(scaleMatrix, rotateMatrix);
-        fz_matrix translateMatrix = fz_translate(translateX, translateY);
-        fz_matrix transformMatrix = fz_concat(rotateAndScaleMatrix, translateMatrix);
-
-        dev = fz_new_draw_device_with_bbox(fzctx, transformMatrix, pix, &clipBox);
-
-        // pre-fill page with white
-        fz_path* path = fz_new_path(fzctx);
-        fz_moveto(fzctx, path, 0, 0);
-        fz_lineto(fzctx, path, 0, currentPageHeight);
-        fz_lineto(fzctx, path, currentPageWidth, currentPageHeight);
-        fz_lineto(fzctx, path, currentPageWidth, 0);
-        fz_closepath(fzctx, path);
-        float white = 1.0f;
-        fz_fill_path(fzctx, dev, path, 0, fz_identity, fz_device_gray(fzctx), &white, 1.0f, fz_default_color_params);
-        fz_drop_path(fzctx, path);
-
-        fz_rect pageRect;
-        pageRect.x0 = 0;
-        pageRect.y0 = 0;
-        pageRect.x1 = currentPageWidth;
-        pageRect.y1 = currentPageHeight;
-        fz_run_display_list(fzctx, activePageDisplayList, dev, fz_identity, pageRect, nullptr);
-        fz_close_device(fzctx, dev);
-        fz_drop_device(fzctx, dev);
-    } fz_catch(fzctx) {
-        if (dev) {
-            fz_drop_device(fzctx, dev);
-        }
-        fz_drop_pixmap(fzctx, pix);
-        LOGE(fmt::format("MuPDF could not render. It reported {}", fz_caught_message(fzctx)));
-    }
-
-    if (pix) {
-        fz_drop_pixmap(fzctx, pix);
-    }
-
-    return tile;
+    std::lock_guard<std::mutex> lock(docMutex);
+    if (!doc || (page >= pageRects.size())) return nullptr;
+    selectPage(ctx, page);
+    if (!activePageDisplayList) return nullptr;
+    bounds = pageRects[page];
+    return fz_keep_display_list(ctx, activePageDisplayList);
 }
 
 
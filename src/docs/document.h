@@ -5,6 +5,7 @@
 #include "navitab/logger.h"
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <mupdf/fitz.h>
 
  // This header file defines the interface for downloaded and local documents,
@@ -13,7 +14,6 @@
 
 namespace navitab {
 
-class RasterTile;
 
 class Document
 {
@@ -22,25 +22,63 @@ public:
         OK = 0,
         NOT_FOUND,
         LOAD_TIMEOUT,
-        UNSUPPORTED
+        UNSUPPORTED,
+        NOT_MODIFIED    // the server confirmed that a stale copy is still current
+    };
+
+    // HTTP caching information, for documents that have been downloaded or loaded
+    // from the backing store. The validators are sent when a stale copy of the
+    // document is revalidated with the server.
+    struct CacheInfo {
+        std::string etag;
+        std::string lastModified;
+        int64_t maxAge = -1;        // seconds the document is fresh for, -1 if not given
+        bool noStore = false;       // the server asked for the document not to be stored
+        bool revalidated = false;   // the contents are a stale copy that is still current
     };
 
     Document(const std::string& url, DocStatus err);
-    Document(const std::string& url, const std::string& type, std::vector<uint8_t>& data);
+
+    // A document that owns its contents, which are moved into it rather than copied.
+    Document(const std::string& url, const std::string& type, std::vector<uint8_t>&& data);
+
+    // A document whose contents are held elsewhere (eg in a memory mapped tile
+    // archive), which are used in place. The backing object is kept alive for as
+    // long as the document, and must keep the contents valid.
+    Document(const std::string& url, const std::string& type, const uint8_t* data, size_t size, std::shared_ptr<const void> backing);
     virtual ~Document();
 
     void Prepare(fz_context* fzc);
 
     DocStatus Status() { return status;  }
 
+    // the document's original (encoded) contents and MIME type
+    const uint8_t* Data() const { return contentData; }
+    size_t Size() const { return contentSize; }
+    const std::string& Type() const { return type; }
+
+    // The caching information can only be set before the document is shared.
+    const CacheInfo& Caching() const { return caching; }
+    void SetCaching(const CacheInfo& c) { caching = c; }
+
+    // True if the document is a single PNG or JPEG image, which is decoded directly
+    // by an ImageDecoder rather than being opened by MuPDF.
+    bool IsRasterImage() const { return rasterImage; }
+
+    // An estimate of the memory used by the document, including MuPDF's objects.
+    size_t MemoryUsage();
+
     unsigned PageCount();
     std::pair<unsigned, unsigned> PageSize(unsigned page = 0);
 
-    std::shared_ptr<RasterTile> GetTile(unsigned page, float scaleX, float scaleY, int x, int y, unsigned w = 0, unsigned h = 0);
+    // Get the display list for a page, and the page's bounds. The display list can be
+    // used from any thread, with that thread's MuPDF context (ctx), and must be dropped
+    // with fz_drop_display_list() when finished with. Returns nullptr on failure.
+    fz_display_list* GetDisplayList(fz_context* ctx, unsigned page, fz_rect& bounds);
 
 private:
-    void selectPage(int p);
-    void dropActivePage();
+    void selectPage(fz_context* ctx, int p);
+    void dropActivePage(fz_context* ctx);
 
 private:
     std::unique_ptr<logging::Logger> LOG;
@@ -48,8 +86,15 @@ private:
     DocStatus status;
     std::string const type;
     std::vector<uint8_t> const contents;
-
-    // these are the MuPDF (fitz) references
+    std::shared_ptr<const void> const backing;
+    const uint8_t* contentData;
+    size_t contentSize;
+    CacheInfo caching;
+
+    // these are the MuPDF (fitz) references, and the document's own context. The
+    // document itself can only be used by one thread at a time, so access to it is
+    // serialised by docMutex.
+    std::mutex docMutex;
     fz_context* fzctx;
     fz_stream* stream;
     fz_document* doc;
@@ -57,6 +102,8 @@ private:
     fz_display_list* activePageDisplayList;
     int pageCount;
     std::vector<fz_rect> pageRects;
+    bool rasterImage;
+    bool prepared;
 
 };
 
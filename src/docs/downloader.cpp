@@ -4,87 +4,259 @@
 #include "document.h"
 #include "navitab/config.h"
 #include <fmt/core.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
 
 namespace navitab {
 
-Downloader::Downloader(const std::string& u)
+// be polite to the tile servers, which usually limit connections per client
+static const long kMaxHostConnections = 4;
+
+// how long to wait for activity on the transfers before checking for new jobs
+static const int kPollTimeoutMs = 500;
+
+// download buffers grow by at least this much when the length isn't known, and
+// a Content-Length bigger than the limit isn't trusted for reserving space
+static const size_t kDownloadChunkBytes = 64 * 1024;
+static const curl_off_t kMaxReserveBytes = (curl_off_t)1 << 30;
+
+Downloader::Downloader(unsigned mt, JobSource source, JobDone done)
 :   LOG(std::make_unique<logging::Logger>("dwnldr")),
-    curl(curl_easy_init()),
-    url(u)
+    maxTransfers(std::max(1u, mt)),
+    nextJob(source),
+    jobDone(done),
+    multi(curl_multi_init()),
+    share(curl_share_init()),
+    running(true)
 {
+    if (!multi || !share) {
+        throw std::runtime_error("Unable to initialise curl for document downloads");
+    }
+
+    // the share is only used by the downloader's thread, so it needs no locking
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)maxTransfers);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, kMaxHostConnections);
+
+    worker = std::thread([this]() { AsyncWorker(); });
 }
 
 Downloader::~Downloader()
 {
-    if (curl) {
-        curl_easy_cleanup(curl);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    curl_multi_wakeup(multi);
+    worker.join();
+
+    for (auto& t : transfers) {
+        curl_multi_remove_handle(multi, t.first);
+        curl_easy_cleanup(t.first);
+    }
+    transfers.clear();
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
+}
+
+void Downloader::Wakeup()
+{
+    curl_multi_wakeup(multi);
+}
+
+void Downloader::Cancel(const std::string& url)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancels.push_back(url);
+    }
+    curl_multi_wakeup(multi);
+}
+
+void Downloader::AsyncWorker()
+{
+    while (1) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running) break;
+        }
+        CancelTransfers();
+
+        // start as many of the waiting jobs as the concurrency limit allows
+        Request request;
+        while ((transfers.size() < maxTransfers) && nextJob(request)) {
+            StartTransfer(request);
+            request = Request();
+        }
+
+        // progress all of the transfers, and collect any that have finished
+        int active = 0;
+        curl_multi_perform(multi, &active);
+        int queued = 0;
+        while (CURLMsg* m = curl_multi_info_read(multi, &queued)) {
+            if (m->msg == CURLMSG_DONE) {
+                FinishTransfer(m->easy_handle, m->data.result);
+            }
+        }
+
+        // sleep until there is network activity, or a wakeup for new jobs
+        curl_multi_poll(multi, nullptr, 0, kPollTimeoutMs, nullptr);
     }
 }
 
-std::shared_ptr<Document> Downloader::Download(bool& cancel, fz_context* fzc)
+void Downloader::StartTransfer(const Request& request)
 {
+    CURL* curl = curl_easy_init();
     if (!curl) {
         LOGE("Unable to initialise curl for document download");
-        return nullptr;
+        jobDone(request.url, std::make_shared<Document>(request.url, Document::DocStatus::NOT_FOUND));
+        return;
     }
+    auto t = std::make_unique<Transfer>();
+    t->url = request.url;
+    t->curl = curl;
 
-    std::vector<uint8_t> downloadBuf;
+    // a stale copy is revalidated rather than downloaded again if it is unchanged
+    if (!request.etag.empty()) {
+        t->headers = curl_slist_append(t->headers, fmt::format("If-None-Match: {}", request.etag).c_str());
+    }
+    if (!request.lastModified.empty()) {
+        t->headers = curl_slist_append(t->headers, fmt::format("If-Modified-Since: {}", request.lastModified).c_str());
+    }
+    if (t->headers) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, t->headers);
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_URL, t->url.c_str());
     curl_easy_setopt(curl, CURLOPT_USERAGENT, "Navitab " NAVITAB_VERSION_STR);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, onProgress);
-    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &cancel);
-
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&downloadBuf);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)t.get());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, onData);
 
-    CURLcode code = curl_easy_perform(curl);
+    curl_multi_add_handle(multi, curl);
+    transfers[curl] = std::move(t);
+}
 
-    if (code != CURLE_OK) {
-        if (code == CURLE_ABORTED_BY_CALLBACK) {
-            return nullptr;
-        } else {
-            LOGE(fmt::format("Error {} downloading {}", curl_easy_strerror(code), url));
-            return std::make_shared<Document>(url, Document::DocStatus::NOT_FOUND);
+// Get the validators and freshness lifetime from a response's headers.
+static Document::CacheInfo readCacheHeaders(CURL* curl)
+{
+    Document::CacheInfo ci;
+    struct curl_header* h = nullptr;
+    if (curl_easy_header(curl, "ETag", 0, CURLH_HEADER, -1, &h) == CURLHE_OK) {
+        ci.etag = h->value;
+    }
+    if (curl_easy_header(curl, "Last-Modified", 0, CURLH_HEADER, -1, &h) == CURLHE_OK) {
+        ci.lastModified = h->value;
+    }
+    if (curl_easy_header(curl, "Cache-Control", 0, CURLH_HEADER, -1, &h) == CURLHE_OK) {
+        std::string cc(h->value);
+        std::transform(cc.begin(), cc.end(), cc.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+        ci.noStore = cc.find("no-store") != std::string::npos;
+        auto ma = cc.find("max-age=");
+        if (cc.find("no-cache") != std::string::npos) {
+            ci.maxAge = 0;
+        } else if (ma != std::string::npos) {
+            ci.maxAge = (int64_t)std::strtoll(cc.c_str() + ma + 8, nullptr, 10);
         }
     }
+    if ((ci.maxAge < 0) && (curl_easy_header(curl, "Expires", 0, CURLH_HEADER, -1, &h) == CURLHE_OK)) {
+        time_t expires = curl_getdate(h->value, nullptr);
+        if (expires >= 0) ci.maxAge = std::max((int64_t)0, (int64_t)expires - (int64_t)std::time(nullptr));
+    }
+    // a response from a shared cache has already used up some of its lifetime
+    if ((ci.maxAge > 0) && (curl_easy_header(curl, "Age", 0, CURLH_HEADER, -1, &h) == CURLHE_OK)) {
+        ci.maxAge = std::max((int64_t)0, ci.maxAge - (int64_t)std::strtoll(h->value, nullptr, 10));
+    }
+    return ci;
+}
+
+void Downloader::FinishTransfer(CURL* curl, CURLcode code)
+{
+    auto ti = transfers.find(curl);
+    if (ti == transfers.end()) return;
+    auto t = std::move(ti->second);
+    transfers.erase(ti);
+    curl_multi_remove_handle(multi, curl);
 
+    std::shared_ptr<Document> doc;
     long httpStatus = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatus);
-    if (httpStatus != 200) {
-        LOGE(fmt::format("Error status {} downloading {}", httpStatus, url));
-        return std::make_shared<Document>(url, Document::DocStatus::NOT_FOUND);
+    if (code != CURLE_OK) {
+        LOGE(fmt::format("Error {} downloading {}", curl_easy_strerror(code), t->url));
+        doc = std::make_shared<Document>(t->url, Document::DocStatus::NOT_FOUND);
+    } else if (httpStatus == 304) {
+        doc = std::make_shared<Document>(t->url, Document::DocStatus::NOT_MODIFIED);
+        doc->SetCaching(readCacheHeaders(curl));
+    } else if (httpStatus != 200) {
+        LOGE(fmt::format("Error status {} downloading {}", httpStatus, t->url));
+        doc = std::make_shared<Document>(t->url, Document::DocStatus::NOT_FOUND);
+    } else {
+        // get the document type
+        char* ct = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &ct);
+        doc = std::make_shared<Document>(t->url, ct ? ct : "", std::move(t->data));
+        doc->SetCaching(readCacheHeaders(curl));
     }
-
-    // get the document type
-    char* ct = nullptr;
-    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &ct);
-
-    return std::make_shared<Document>(url, ct, downloadBuf);
+    curl_easy_cleanup(curl);
+    jobDone(t->url, doc);
 }
 
-size_t Downloader::onData(void* buffer, size_t size, size_t nmemb, void* vecPtr)
+void Downloader::CancelTransfers()
 {
-    std::vector<uint8_t>* vec = reinterpret_cast<std::vector<uint8_t> *>(vecPtr);
-    if (!vec) {
-        return 0;
+    std::vector<std::string> urls;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(urls, cancels);
+    }
+    for (auto& url : urls) {
+        for (auto ti = transfers.begin(); ti != transfers.end(); ++ti) {
+            if (ti->second->url == url) {
+                curl_multi_remove_handle(multi, ti->first);
+                curl_easy_cleanup(ti->first);
+                transfers.erase(ti);
+                jobDone(url, nullptr);
+                break;
+            }
+        }
     }
-    size_t pos = vec->size();
-    vec->resize(pos + size * nmemb);
-    std::memcpy(vec->data() + pos, buffer, size * nmemb);
-    return size * nmemb;
 }
 
-int Downloader::onProgress(void* client, curl_off_t dlTotal, curl_off_t dlNow, curl_off_t ulTotal, curl_off_t ulNow)
+size_t Downloader::onData(void* buffer, size_t size, size_t nmemb, void* transferPtr)
 {
-    bool* cancel = reinterpret_cast<bool*>(client);
-    return *cancel;
-}
+    Transfer* t = reinterpret_cast<Transfer *>(transferPtr);
+    if (!t) {
+        return 0;
+    }
+    auto& data = t->data;
+    const size_t n = size * nmemb;
 
+    // the headers have all arrived by the time the body starts, so the whole
+    // document can usually be given its space in one go
+    if (!t->reserved) {
+        t->reserved = true;
+        curl_off_t length = -1;
+        if ((curl_easy_getinfo(t->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK)
+                && (length > 0) && (length <= kMaxReserveBytes)) {
+            data.reserve((size_t)length);
+        }
+    }
+    if ((data.size() + n) > data.capacity()) {
+        data.reserve(std::max(data.capacity() * 2, data.size() + n + kDownloadChunkBytes));
+    }
+    auto p = static_cast<const uint8_t*>(buffer);
+    data.insert(data.end(), p, p + n);
+    return n;
+}
 
 }
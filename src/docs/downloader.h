@@ -4,8 +4,26 @@
 
 #include "navitab/logger.h"
 #include <curl/curl.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
-struct fz_context;
+// This header file defines the Downloader, which fetches documents over HTTP(S)
+// on a single background thread, using curl's multi interface to run several
+// transfers at once. All transfers share one connection cache, and the DNS and
+// TLS session caches, so that connections to a tile server are kept alive and
+// reused rather than paying for a new TCP and TLS handshake for every tile.
+// HTTP/2 is requested, and transfers to the same server are multiplexed on one
+// connection if the server (and the libcurl build) supports it.
+//
+// A request can carry the validators (ETag and Last-Modified) of a stale copy of
+// the document, in which case it is made conditional, and a 304 response gives a
+// NOT_MODIFIED document with no contents. The caching headers of each response
+// are attached to its document.
 
 namespace navitab {
 
@@ -14,18 +32,66 @@ class Document;
 class Downloader
 {
 public:
-    Downloader(const std::string& url);
-    std::shared_ptr<Document> Download(bool& cancel, fz_context* fzc);
+    struct Request {
+        std::string url;
+        std::string etag;           // the validators of a stale copy, if any
+        std::string lastModified;
+    };
+
+    // The job source is called on the downloader's thread whenever a transfer can
+    // be started, and returns false if there are no more jobs waiting. The done
+    // callback is called on the downloader's thread with each finished job. The
+    // document is nullptr if the job was cancelled.
+    typedef std::function<bool(Request& request)> JobSource;
+    typedef std::function<void(const std::string& url, std::shared_ptr<Document> doc)> JobDone;
+
+    Downloader(unsigned maxTransfers, JobSource source, JobDone done);
     virtual ~Downloader();
 
+    // Tell the downloader that there are new jobs in the job source.
+    void Wakeup();
+
+    // Abandon a transfer that is in progress.
+    void Cancel(const std::string& url);
+
 private:
-    static size_t onData(void* buffer, size_t size, size_t nmemb, void* resPtr);
-    static int onProgress(void* client, curl_off_t dlTotal, curl_off_t dlNow, curl_off_t ulTotal, curl_off_t ulNow);
+    // The response body is collected in data, which is given to the document when
+    // the transfer finishes. Space for it is reserved from the Content-Length when
+    // the first data arrives, so a large document isn't reallocated as it grows.
+    struct Transfer {
+        std::string url;
+        CURL* curl = nullptr;
+        std::vector<uint8_t> data;
+        bool reserved = false;
+        struct curl_slist* headers = nullptr;
+        ~Transfer() { curl_slist_free_all(headers); }
+    };
+
+    void AsyncWorker();
+    void StartTransfer(const Request& request);
+    void FinishTransfer(CURL* easy, CURLcode code);
+    void CancelTransfers();
+
+    static size_t onData(void* buffer, size_t size, size_t nmemb, void* transferPtr);
 
 private:
     std::unique_ptr<logging::Logger> LOG;
-    CURL* curl = nullptr;
-    std::string url;
+    const unsigned maxTransfers;
+    JobSource nextJob;
+    JobDone jobDone;
+
+    CURLM* multi;
+    CURLSH* share;
+
+    // the transfers in progress, only used by the downloader's thread
+    std::map<CURL*, std::unique_ptr<Transfer> > transfers;
+
+    // requests from other threads
+    std::mutex mutex;
+    bool running;
+    std::vector<std::string> cancels;
+
+    std::thread worker;
 };
 
 }
@@ -0,0 +1,80 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "colourtransform.h"
+#include "pixelkernels.h"
+#include <algorithm>
+#include <cmath>
+
+namespace navitab {
+
+ColourMode ColourModeFromName(const std::string& name)
+{
+    if (name == "dusk") return ColourMode::DUSK;
+    if (name == "night") return ColourMode::NIGHT;
+    return ColourMode::DAY;
+}
+
+const char* ColourModeName(ColourMode m)
+{
+    switch (m) {
+    case ColourMode::DUSK: return "dusk";
+    case ColourMode::NIGHT: return "night";
+    default: return "day";
+    }
+}
+
+ColourTransform::ColourTransform(ColourMode m)
+:   mode(m)
+{
+    // each channel's curve is c' = gain * c ^ gamma, on the range 0..1
+    struct Curve { float gain; float gamma; };
+    Curve curves[3] = { { 1.0f, 1.0f }, { 1.0f, 1.0f }, { 1.0f, 1.0f } };
+    switch (mode) {
+    case ColourMode::DUSK:
+        curves[0] = { 0.70f, 1.2f };
+        curves[1] = { 0.62f, 1.2f };
+        curves[2] = { 0.55f, 1.2f };
+        break;
+    case ColourMode::NIGHT:
+        curves[0] = { 0.45f, 1.4f };
+        curves[1] = { 0.20f, 1.5f };
+        curves[2] = { 0.12f, 1.5f };
+        break;
+    default:
+        break;
+    }
+    for (int c = 0; c < 3; ++c) {
+        for (int i = 0; i < 256; ++i) {
+            float v = curves[c].gain * std::pow(i / 255.0f, curves[c].gamma);
+            lut[c][i] = (uint8_t)std::lround(std::min(v, 1.0f) * 255.0f);
+        }
+    }
+}
+
+void ColourTransform::Apply(PixelBuffer& pb) const
+{
+    if (IsIdentity()) return;
+    const bool premul = pb.Premultiplied();
+    for (unsigned r = 0; r < pb.Height(); ++r) {
+        uint32_t* p = pb.Row(r);
+        for (unsigned i = 0; i < pb.Width(); ++i) {
+            uint32_t px = p[i];
+            uint32_t a = px >> 24;
+            if (a == 0) continue;
+            uint32_t out = px & 0xff000000;
+            for (int c = 0; c < 3; ++c) {
+                uint32_t v = (px >> (c * 8)) & 0xff;
+                if (premul && (a != 0xff)) {
+                    v = std::min((v * 255 + (a / 2)) / a, 0xffu);
+                    v = Div255(lut[c][v] * a);
+                } else {
+                    v = lut[c][v];
+                }
+                out |= v << (c * 8);
+            }
+            p[i] = out;
+        }
+    }
+}
+
+} // namespace navitab
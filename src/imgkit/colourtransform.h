@@ -0,0 +1,45 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "navitab/pixelbuffer.h"
+
+// This header file defines the colour transforms used to dim and tint the
+// rendered maps and documents for use in a dark cockpit. A transform is a
+// per-channel curve held in lookup tables, and is applied once to each tile
+// as it is rendered, before it goes into a cache, rather than to the whole
+// canvas on every frame.
+
+namespace navitab {
+
+enum class ColourMode
+{
+    DAY,    // no change
+    DUSK,   // dimmed, slightly warm
+    NIGHT   // strongly dimmed and red-shifted to preserve night vision
+};
+
+ColourMode ColourModeFromName(const std::string& name);
+const char* ColourModeName(ColourMode m);
+
+class ColourTransform
+{
+public:
+    ColourTransform(ColourMode m);
+    ~ColourTransform() = default;
+
+    ColourMode Mode() const { return mode; }
+    bool IsIdentity() const { return mode == ColourMode::DAY; }
+
+    // Transform the pixels in place. Premultiplied pixels are converted to
+    // straight alpha for the lookup, and back again afterwards.
+    void Apply(PixelBuffer& pb) const;
+
+private:
+    const ColourMode mode;
+    uint8_t lut[3][256];    // red, green, blue
+};
+
+} // namespace navitab
@@ -0,0 +1,80 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "imagedecoder.h"
+#include "pixelkernels.h"
+#include "navitab/tiles.h"
+#include "../docs/document.h"
+#include <fmt/core.h>
+#include <cmath>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#define STBI_ONLY_JPEG
+#define STBI_NO_STDIO
+#include <stb_image.h>
+
+namespace navitab {
+
+ImageDecoder::ImageDecoder()
+:   LOG(std::make_unique<logging::Logger>("decoder")),
+    resampler(ResampleFilter::BILINEAR)
+{
+}
+
+bool ImageDecoder::CanDecode(const uint8_t* data, size_t size, unsigned& width, unsigned& height)
+{
+    int w, h, comp;
+    if (!stbi_info_from_memory(data, (int)size, &w, &h, &comp)) return false;
+    width = w;
+    height = h;
+    return (w > 0) && (h > 0);
+}
+
+std::shared_ptr<RasterTile> ImageDecoder::Render(const Document& doc, float scaleX, float scaleY, int x, int y, unsigned w, unsigned h)
+{
+    if (!w) w = RasterTile::DefaultWidth;
+    if (!h) h = RasterTile::DefaultHeight;
+    auto tile = std::make_shared<RasterTile>(w, h, ImageAlloc::UNINITIALISED | ImageAlloc::PADDED);
+    tile->SetPremultiplied(true);
+
+    // stb always gives RGBA bytes when asked for 4 components, which is our pixel format
+    int iw, ih, comp;
+    uint8_t* pixels = stbi_load_from_memory(doc.Data(), (int)doc.Size(), &iw, &ih, &comp, 4);
+    if (!pixels) {
+        LOGE(fmt::format("Could not decode image, {}", stbi_failure_reason()));
+        tile->Clear(0);
+        return tile;
+    }
+    PixelBuffer image(iw, ih, reinterpret_cast<uint32_t*>(pixels));
+    auto& k = PixelKernelSet();
+
+    // images with transparency are drawn on a white background, as MuPDF would
+    if ((comp == 2) || (comp == 4)) {
+        std::vector<uint32_t> row(iw);
+        for (int r = 0; r < ih; ++r) {
+            k.premultiplyRow(row.data(), image.Row(r), iw);
+            k.fillRow(image.Row(r), 0xffffffff, iw);
+            k.blendPremulRow(image.Row(r), row.data(), iw);
+        }
+    }
+    image.SetPremultiplied(true);
+
+    // the usual case is a whole tile at its natural size, which is just copied
+    const float srcX = (w * x) / scaleX;
+    const float srcY = (h * y) / scaleY;
+    const float srcW = w / scaleX;
+    const float srcH = h / scaleY;
+    if ((x == 0) && (y == 0) && ((unsigned)iw == w) && ((unsigned)ih == h) && (std::fabs(srcW - w) < 0.01f) && (std::fabs(srcH - h) < 0.01f)) {
+        for (unsigned r = 0; r < h; ++r) {
+            k.copyRow(tile->Row(r), image.Row(r), w);
+        }
+    } else {
+        resampler.Scale(*tile, image, srcX, srcY, srcW, srcH);
+    }
+
+    stbi_image_free(pixels);
+    return tile;
+}
+
+} // namespace navitab
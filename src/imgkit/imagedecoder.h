@@ -0,0 +1,40 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include "navitab/logger.h"
+#include "resampler.h"
+#include <cstdint>
+#include <memory>
+
+// This header file defines the ImageDecoder, which draws tiles from documents that
+// are plain PNG or JPEG images (eg map tiles) by decoding them directly, rather
+// than opening them as MuPDF documents and running a display list. The result is
+// the same as the Rasterizer would give. Each thread that renders tiles needs its
+// own ImageDecoder.
+
+namespace navitab {
+
+class Document;
+class RasterTile;
+
+class ImageDecoder
+{
+public:
+    ImageDecoder();
+    ~ImageDecoder() = default;
+
+    // Check if an image can be decoded, and get its size, from just its header.
+    static bool CanDecode(const uint8_t* data, size_t size, unsigned& width, unsigned& height);
+
+    // Render the (x,y)th tile, of size w x h, of the document's image after it has
+    // been scaled by scaleX, scaleY. A default sized tile is produced if w or h
+    // is 0. A blank tile is returned if the image can't be decoded.
+    std::shared_ptr<RasterTile> Render(const Document& doc, float scaleX, float scaleY, int x, int y, unsigned w = 0, unsigned h = 0);
+
+private:
+    std::unique_ptr<logging::Logger> LOG;
+    Resampler resampler;
+};
+
+} // namespace navitab
@@ -1,9 +1,181 @@
 /* This file is part of the Navitab project. See the README and LICENSE for details. */
 
 #include "imgkit.h"
+#include "rasterizer.h"
+#include "imagedecoder.h"
+#include "navitab/tiles.h"
+#include "../docs/document.h"
+#include <algorithm>
+#include <stdexcept>
+#include <fmt/core.h>
+#include <mupdf/fitz.h>
 
 namespace navitab {
 
+// MuPDF calls these to lock and unlock its shared resources when it is used
+// from several threads.
 
+static void lockMupdf(void *user, int lock)
+{
+    (*static_cast<std::vector<std::mutex> *>(user))[lock].lock();
+}
+
+static void unlockMupdf(void *user, int lock)
+{
+    (*static_cast<std::vector<std::mutex> *>(user))[lock].unlock();
+}
+
+ImagingKit::ImagingKit(unsigned numWorkers)
+:   LOG(std::make_unique<logging::Logger>("imgkit")),
+    fzLocks(FZ_LOCK_MAX),
+    fzctx(nullptr),
+    colourMode(ColourMode::DAY),
+    running(true)
+{
+    for (auto m : { ColourMode::DAY, ColourMode::DUSK, ColourMode::NIGHT }) {
+        transforms.emplace_back(m);
+    }
+
+    fz_locks_context locks;
+    locks.user = &fzLocks;
+    locks.lock = lockMupdf;
+    locks.unlock = unlockMupdf;
+    fzctx = fz_new_context(nullptr, &locks, FZ_STORE_DEFAULT);
+    if (!fzctx) {
+        throw std::runtime_error("Couldn't initialize MuPDF rasterizing libraries");
+    }
+    fz_try(fzctx) {
+        fz_register_document_handlers(fzctx);
+    } fz_catch(fzctx) {
+        std::string msg(fz_caught_message(fzctx));
+        fz_drop_context(fzctx);
+        throw std::runtime_error(fmt::format("Cannot register MuPDF document handlers: {}", msg));
+    }
+
+    if (!numWorkers) {
+        // leave at least 2 cores for the simulator and the Navitab core thread
+        unsigned cores = std::thread::hardware_concurrency();
+        numWorkers = std::clamp(cores > 2 ? cores - 2 : 1, 1u, 4u);
+    }
+
+    // The contexts are cloned before any of the threads are started, since the
+    // base context can't be used while it is being cloned.
+    workers.resize(numWorkers);
+    activeOwners.assign(numWorkers, nullptr);
+    try {
+        for (auto& w : workers) {
+            w.ctx = fz_clone_context(fzctx);
+            if (!w.ctx) {
+                throw std::runtime_error("Couldn't clone MuPDF context for tile rendering");
+            }
+            w.rasterizer = std::make_unique<Rasterizer>(w.ctx);
+            w.decoder = std::make_unique<ImageDecoder>();
+        }
+    } catch (...) {
+        // none of the threads have started, so the contexts can just be dropped
+        for (auto& w : workers) {
+            w.rasterizer.reset();
+            if (w.ctx) fz_drop_context(w.ctx);
+        }
+        fz_drop_context(fzctx);
+        throw;
+    }
+    for (unsigned i = 0; i < numWorkers; ++i) {
+        workers[i].thread = std::make_unique<std::thread>([this, i]() { AsyncWorker(i); });
+    }
+    LOGS(fmt::format("Started {} tile rendering threads", numWorkers));
+}
+
+ImagingKit::~ImagingKit()
+{
+    {
+        std::lock_guard<std::mutex> lock(jmutex);
+        running = false;
+        jobs.clear();
+        bgJobs.clear();
+    }
+    jsync.notify_all();
+    for (auto& w : workers) {
+        w.thread->join();
+        w.rasterizer.reset();
+        w.decoder.reset();
+        fz_drop_context(w.ctx);
+    }
+    fz_drop_context(fzctx);
+}
+
+fz_context* ImagingKit::CloneContext()
+{
+    // cloning reads the base context, so serialise it with any other clone
+    std::lock_guard<std::mutex> lock(jmutex);
+    return fz_clone_context(fzctx);
+}
+
+void ImagingKit::Render(TileJob job)
+{
+    {
+        std::lock_guard<std::mutex> lock(jmutex);
+        auto& q = job.background ? bgJobs : jobs;
+        q.push_back(std::move(job));
+    }
+    jsync.notify_one();
+}
+
+void ImagingKit::Cancel(const void* owner, bool waitForRunning)
+{
+    std::unique_lock<std::mutex> lock(jmutex);
+    auto byOwner = [owner](const TileJob& j) { return j.owner == owner; };
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), byOwner), jobs.end());
+    bgJobs.erase(std::remove_if(bgJobs.begin(), bgJobs.end(), byOwner), bgJobs.end());
+
+    // a running job holds its document until it has finished
+    if (waitForRunning) {
+        jdone.wait(lock, [this, owner]() {
+            return std::find(activeOwners.begin(), activeOwners.end(), owner) == activeOwners.end();
+        });
+    }
+}
+
+void ImagingKit::SetColourMode(ColourMode m)
+{
+    if (colourMode.exchange(m) != m) {
+        LOGI(fmt::format("Colour mode changed to {}", ColourModeName(m)));
+    }
+}
+
+void ImagingKit::AsyncWorker(unsigned id)
+{
+    auto& rasterizer = *workers[id].rasterizer;
+    auto& decoder = *workers[id].decoder;
+    while (1) {
+        // pause until there's something to do
+        std::unique_lock<std::mutex> lock(jmutex);
+        jsync.wait(lock, [this]() { return !running || !jobs.empty() || !bgJobs.empty(); });
+        if (!running) break;
+        auto& q = jobs.empty() ? bgJobs : jobs;
+        TileJob job = std::move(q.front());
+        q.pop_front();
+        activeOwners[id] = job.owner;
+        lock.unlock();
+
+        // plain images (eg map tiles) are decoded directly, without going through MuPDF
+        std::shared_ptr<RasterTile> tile;
+        if (job.doc->IsRasterImage()) {
+            tile = decoder.Render(*job.doc, job.scaleX, job.scaleY, job.x, job.y, job.w, job.h);
+        } else {
+            tile = rasterizer.Render(*job.doc, job.page, job.scaleX, job.scaleY, job.x, job.y, job.w, job.h);
+        }
+        transforms[(int)job.colourMode].Apply(*tile);
+        job.done(tile);
+
+        // the job (and so possibly the last reference to its document) is dropped
+        // before its owner is told that it has finished
+        job = TileJob();
+        lock.lock();
+        activeOwners[id] = nullptr;
+        lock.unlock();
+        jdone.notify_all();
+    }
+}
 
 } // namespace navitab
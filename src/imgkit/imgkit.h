@@ -2,23 +2,116 @@
 
 #pragma once
 
+#include <memory>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 #include "navitab/logger.h"
+#include "colourtransform.h"
 
 // This header file defines the interface for the imaging kit, which provides
 // services to draw various forms of document into pixel buffers that are then
-// used as tiles for drawing into the app canvas..
+// used as tiles for drawing into the app canvas. Tiles are rendered by a pool
+// of worker threads, each with its own MuPDF context. The contexts all share
+// the one MuPDF store (cache of fonts, images etc), protected by a set of locks.
+
+struct fz_context;
 
 namespace navitab {
 
+class Document;
+class RasterTile;
+class Rasterizer;
+class ImageDecoder;
+
+// A request to render the (x,y)th tile, of size w x h, of a document's page
+// after it is scaled by scaleX, scaleY.
+struct TileJob
+{
+    std::shared_ptr<Document> doc;
+    unsigned page;
+    float scaleX, scaleY;
+    int x, y;
+    unsigned w, h;
+
+    // the colour transform applied to the tile once it is rendered
+    ColourMode colourMode;
+
+    // background jobs (eg prefetching) are only started when there are no
+    // others waiting
+    bool background;
+
+    // identifies who asked for the tile, so that their outstanding jobs can be cancelled
+    const void* owner;
+
+    // called from the worker thread with the rendered tile
+    std::function<void(std::shared_ptr<RasterTile>)> done;
+};
+
 class ImagingKit
 {
 public:
-    ImagingKit();
+    // If numWorkers is 0 then the number of worker threads is chosen to suit the
+    // number of CPU cores, leaving some for the simulator.
+    ImagingKit(unsigned numWorkers = 0);
+    virtual ~ImagingKit();
+
+    // Get a new MuPDF context sharing the kit's store and locks, for use on one
+    // other thread. The caller must drop it with fz_drop_context().
+    fz_context* CloneContext();
 
-    virtual ~ImagingKit() = default;
+    // Queue a job to render a tile. Jobs are started in the order they are queued,
+    // but with all foreground jobs before any background ones.
+    void Render(TileJob job);
+
+    // Discard any jobs from the owner that have not been started yet, and normally
+    // wait for any of its jobs that are running to finish, so that the owner can
+    // be destroyed safely.
+    void Cancel(const void* owner, bool waitForRunning = true);
+
+    unsigned NumWorkers() const { return (unsigned)workers.size(); }
+
+    // The colour mode that tiles should currently be rendered in. Anyone holding
+    // tiles should check this and re-render them when it changes.
+    void SetColourMode(ColourMode m);
+    ColourMode GetColourMode() const { return colourMode; }
+
+private:
+    void AsyncWorker(unsigned id);
 
 private:
     std::unique_ptr<logging::Logger> LOG;
+
+    // MuPDF's locks, and the base context the others are cloned from
+    std::vector<std::mutex> fzLocks;
+    fz_context* fzctx;
+
+    // the worker threads, each has its own context, rasterizer and image decoder
+    struct Worker {
+        std::unique_ptr<std::thread> thread;
+        fz_context* ctx = nullptr;
+        std::unique_ptr<Rasterizer> rasterizer;
+        std::unique_ptr<ImageDecoder> decoder;
+    };
+    std::vector<Worker> workers;
+
+    // one transform for each colour mode, indexed by the mode
+    std::vector<ColourTransform> transforms;
+    std::atomic<ColourMode> colourMode;
+
+    bool running;
+    std::deque<TileJob> jobs;
+    std::deque<TileJob> bgJobs;
+    std::condition_variable jsync;
+    std::mutex jmutex;
+
+    // the owner of the job each worker is running, nullptr if it is idle
+    std::vector<const void*> activeOwners;
+    std::condition_variable jdone;
 };
 
 } // namespace navitab
@@ -1,85 +1,304 @@
 /* This file is part of the Navitab project. See the README and LICENSE for details. */
 
-#include "navitab/window.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#if defined(NAVITAB_WINDOWS)
+#include <malloc.h>
+#elif defined(NAVITAB_LINUX)
+#include <sys/mman.h>
+#endif
+#include "navitab/pixelbuffer.h"
+#include "pixelkernels.h"
+#include "tilepool.h"
 
 namespace navitab {
 
-void PixelBuffer::PaintRegion(int destX, int destY, PixelBuffer &src)
+// Image storage is allocated with 64-byte (cache line) alignment, which is also
+// enough for any of the vector kernels. Large images can be put into huge pages
+// to reduce TLB misses when the whole image is traversed. This is only done on
+// Linux (via transparent huge pages) since Windows needs the user to have the
+// "lock pages in memory" privilege, and macOS has no equivalent for malloc'ed
+// memory.
+
+static const size_t kImageAlignment = 64;
+#if defined(NAVITAB_LINUX)
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+#endif
+
+void* AllocImageStorage(size_t bytes, unsigned flags)
+{
+    void *p = nullptr;
+#if defined(NAVITAB_LINUX)
+    if ((flags & ImageAlloc::HUGEPAGES) && (bytes >= kHugePageSize)) {
+        // anonymous mappings are always zero-filled, and are page aligned
+        p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        (void)madvise(p, bytes, MADV_HUGEPAGE);
+        return p;
+    }
+#endif
+#if defined(NAVITAB_WINDOWS)
+    p = _aligned_malloc(bytes, kImageAlignment);
+#else
+    if (posix_memalign(&p, kImageAlignment, bytes) != 0) p = nullptr;
+#endif
+    if (!p) throw std::bad_alloc();
+    if (!(flags & ImageAlloc::UNINITIALISED)) std::memset(p, 0, bytes);
+    return p;
+}
+
+void FreeImageStorage(void *p, size_t bytes, unsigned flags)
+{
+#if defined(NAVITAB_LINUX)
+    if ((flags & ImageAlloc::HUGEPAGES) && (bytes >= kHugePageSize)) {
+        munmap(p, bytes);
+        return;
+    }
+#endif
+#if defined(NAVITAB_WINDOWS)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+template <class FMT>
+static unsigned imageSpan(unsigned w, unsigned flags)
+{
+    if (!(flags & ImageAlloc::PADDED)) return w;
+    const unsigned pixelsPerLine = kImageAlignment / sizeof(typename FMT::Pixel);
+    return (w + pixelsPerLine - 1) & ~(pixelsPerLine - 1);
+}
+
+template <class FMT>
+ImageBufferT<FMT>::ImageBufferT(unsigned w, unsigned h, unsigned f)
+:   PixelBufferT<FMT>(w, h, imageSpan<FMT>(w, f), nullptr),
+    allocFlags(f),
+    allocBytes((size_t)this->span * h * sizeof(PixelType)),
+    ownsStorage(true)
+{
+    // always allocate something, so that Row(0) is a valid pointer
+    auto p = AllocImageStorage(std::max(allocBytes, kImageAlignment), allocFlags);
+    this->SetData(static_cast<PixelType *>(p));
+}
+
+template <class FMT>
+ImageBufferT<FMT>::ImageBufferT(unsigned w, unsigned h, unsigned s, PixelType* storage)
+:   PixelBufferT<FMT>(w, h, s, storage),
+    allocFlags(ImageAlloc::UNINITIALISED),
+    allocBytes((size_t)s * h * sizeof(PixelType)),
+    ownsStorage(false)
+{
+}
+
+template <class FMT>
+ImageBufferT<FMT>::~ImageBufferT()
 {
-    int srcCols = src.width;
-    int srcRows = src.height;
-    int srcXoff = 0;
-    int srcYoff = 0;
+    if (ownsStorage) {
+        FreeImageStorage(this->data, std::max(allocBytes, kImageAlignment), allocFlags);
+    }
+}
+
+// The part of a source image that is visible when placed at destX, destY in
+// a destination of width x height.
+struct ClippedRegion
+{
+    int destX, destY;
+    int srcX, srcY;
+    int cols, rows;
+};
+
+static bool clipRegion(int destX, int destY, unsigned srcW, unsigned srcH, unsigned width, unsigned height, ClippedRegion& c)
+{
+    c.cols = srcW;
+    c.rows = srcH;
+    c.srcX = 0;
+    c.srcY = 0;
     if (destX < 0) {
-        srcXoff = 0 - destX;
-        srcCols += destX;
+        c.srcX = 0 - destX;
+        c.cols += destX;
         destX = 0;
     }
-    if ((destX + srcCols) >= (int)width) {
-        srcCols = width - destX;
+    if ((destX + c.cols) >= (int)width) {
+        c.cols = width - destX;
     }
-    if (srcCols <= 0) return;
+    if (c.cols <= 0) return false;
     if (destY < 0) {
-        srcYoff = 0 - destY;
-        srcRows += destY;
+        c.srcY = 0 - destY;
+        c.rows += destY;
         destY = 0;
     }
-    if ((destY + srcRows) >= (int)height) {
-        srcRows = height - destY;
+    if ((destY + c.rows) >= (int)height) {
+        c.rows = height - destY;
+    }
+    if (c.rows <= 0) return false;
+    c.destX = destX;
+    c.destY = destY;
+    return true;
+}
+
+// Row copy and fill for each pixel type. Only the 32-bit pixels use the kernels.
+
+static inline void copyPixels(uint32_t *d, const uint32_t *s, size_t n)
+{
+    PixelKernelSet().copyRow(d, s, n);
+}
+
+template <typename P>
+static inline void copyPixels(P *d, const P *s, size_t n)
+{
+    std::memcpy(d, s, n * sizeof(P));
+}
+
+static inline void fillPixels(uint32_t *d, uint32_t px, size_t n)
+{
+    PixelKernelSet().fillRow(d, px, n);
+}
+
+template <typename P>
+static inline void fillPixels(P *d, P px, size_t n)
+{
+    std::fill_n(d, n, px);
+}
+
+static inline void keyPixels(uint32_t *d, const uint32_t *s, size_t n, uint32_t bg)
+{
+    PixelKernelSet().keyRow(d, s, n, bg);
+}
+
+template <typename P>
+static inline void keyPixels(P *d, const P *s, size_t n, P bg)
+{
+    while (n--) {
+        P p = *s++;
+        *d++ = (p == 0) ? bg : p;
+    }
+}
+
+template <class FMT>
+void PixelBufferT<FMT>::PaintRegion(int destX, int destY, PixelBufferT<FMT> &src)
+{
+    ClippedRegion c;
+    if (!clipRegion(destX, destY, src.width, src.height, width, height, c)) return;
+    for (int r = 0; r < c.rows; ++r) {
+        copyPixels(Row(c.destY + r) + c.destX, src.Row(c.srcY + r) + c.srcX, c.cols);
     }
-    if (srcRows <= 0) return;
-    while (srcRows > 0) {
-        auto dr = Row(destY++);
-        auto sr = src.Row(srcYoff++);
-        memcpy(dr + destX, sr + srcXoff, srcCols * sizeof(uint32_t));
-        --srcRows;
+}
+
+template <>
+void PixelBufferT<RGBA8888>::BlendRegion(int destX, int destY, PixelBufferT<RGBA8888> &src)
+{
+    ClippedRegion c;
+    if (!clipRegion(destX, destY, src.width, src.height, width, height, c)) return;
+    // premultiplied sources are composited properly, including the destination
+    // alpha, straight alpha sources are just blended onto the colour channels.
+    auto& k = PixelKernelSet();
+    auto blendRow = src.Premultiplied() ? k.blendPremulRow : k.blendRow;
+    for (int r = 0; r < c.rows; ++r) {
+        blendRow(Row(c.destY + r) + c.destX, src.Row(c.srcY + r) + c.srcX, c.cols);
     }
 }
 
-void PixelBuffer::BlendRegion(int destX, int destY, PixelBuffer &src)
+template <>
+void PixelBufferT<RGBA8888>::BlendMask(int destX, int destY, PixelBufferT<A8> &mask, uint32_t colour)
 {
-    int srcCols = src.width;
-    int srcRows = src.height;
-    int srcXoff = 0;
-    int srcYoff = 0;
-    if (destX < 0) {
-        srcXoff = 0 - destX;
-        srcCols += destX;
-        destX = 0;
+    ClippedRegion c;
+    if (!clipRegion(destX, destY, mask.Width(), mask.Height(), width, height, c)) return;
+    uint32_t pc;
+    PixelKernelSet().premultiplyRow(&pc, &colour, 1);
+    auto blendMaskRow = PixelKernelSet().blendMaskRow;
+    for (int r = 0; r < c.rows; ++r) {
+        blendMaskRow(Row(c.destY + r) + c.destX, mask.Row(c.srcY + r) + c.srcX, c.cols, pc);
     }
-    if ((destX + srcCols) >= (int)width) {
-        srcCols = width - destX;
+}
+
+template <>
+template <>
+void PixelBufferT<RGB565>::ConvertRegion(int destX, int destY, PixelBufferT<RGBA8888> &src)
+{
+    ClippedRegion c;
+    if (!clipRegion(destX, destY, src.Width(), src.Height(), width, height, c)) return;
+    auto toRgb565Row = PixelKernelSet().toRgb565Row;
+    for (int r = 0; r < c.rows; ++r) {
+        toRgb565Row(Row(c.destY + r) + c.destX, src.Row(c.srcY + r) + c.srcX, c.cols);
     }
-    if (srcCols <= 0) return;
-    if (destY < 0) {
-        srcYoff = 0 - destY;
-        srcRows += destY;
-        destY = 0;
+}
+
+template <>
+template <>
+void PixelBufferT<RGBA8888>::ConvertRegion(int destX, int destY, PixelBufferT<RGB565> &src)
+{
+    ClippedRegion c;
+    if (!clipRegion(destX, destY, src.Width(), src.Height(), width, height, c)) return;
+    auto fromRgb565Row = PixelKernelSet().fromRgb565Row;
+    for (int r = 0; r < c.rows; ++r) {
+        fromRgb565Row(Row(c.destY + r) + c.destX, src.Row(c.srcY + r) + c.srcX, c.cols);
+    }
+}
+
+template <>
+template <>
+void PixelBufferT<A8>::ConvertRegion(int destX, int destY, PixelBufferT<RGBA8888> &src)
+{
+    ClippedRegion c;
+    if (!clipRegion(destX, destY, src.Width(), src.Height(), width, height, c)) return;
+    auto alphaRow = PixelKernelSet().alphaRow;
+    for (int r = 0; r < c.rows; ++r) {
+        alphaRow(Row(c.destY + r) + c.destX, src.Row(c.srcY + r) + c.srcX, c.cols);
     }
-    if ((destY + srcRows) >= (int)height) {
-        srcRows = height - destY;
+}
+
+template <class FMT>
+void ImageBufferT<FMT>::Clear(PixelType px)
+{
+    if (this->Contiguous()) {
+        fillPixels(this->data, px, (size_t)this->width * this->height);
+    } else {
+        for (unsigned r = 0; r < this->height; ++r) {
+            fillPixels(this->Row(r), px, this->width);
+        }
     }
-    if (srcRows <= 0) return;
-    while (srcRows > 0) {
-        BlendRow(destY++, destX, src.Row(srcYoff++) + srcXoff, srcCols);
-        --srcRows;
+}
+
+template <>
+void ImageBufferT<RGBA8888>::Premultiply()
+{
+    if (premultiplied) return;
+    auto premultiplyRow = PixelKernelSet().premultiplyRow;
+    if (Contiguous()) {
+        premultiplyRow(data, data, (size_t)width * height);
+    } else {
+        for (unsigned r = 0; r < height; ++r) {
+            premultiplyRow(Row(r), Row(r), width);
+        }
     }
+    premultiplied = true;
 }
 
-void PixelBuffer::BlendRow(unsigned row, unsigned offset, uint32_t *s32, int n)
+template <class FMT>
+void ImageBufferT<FMT>::PaintIcon(unsigned x, unsigned y, const PixelType *pix, unsigned w, unsigned h, PixelType bg)
 {
-    uint32_t *d32 = Row(row) + offset;
-    while (n-- > 0) {
-        auto spix = *s32 & 0xffffff;
-        auto dpix = *d32 & 0xffffff;
-        float alpha = (*s32 >> 24) / 255.0;
-        uint8_t *d8 = reinterpret_cast<uint8_t *>(d32);
-        uint8_t *s8 = reinterpret_cast<uint8_t *>(s32);
-        *d8++ = (*d8 * (1.0 - alpha)) + (*s8++ * alpha); // R
-        *d8++ = (*d8 * (1.0 - alpha)) + (*s8++ * alpha); // G
-        *d8++ = (*d8 * (1.0 - alpha)) + (*s8++ * alpha); // B
-        ++s32; ++d32;
+    assert((x + w) <= this->width);
+    assert((y + h) <= this->height);
+
+    for (unsigned iy = 0; iy < h; ++iy) {
+        PixelType *d = this->Row(y + iy) + x;
+        const PixelType *s = pix + iy * w;
+        if (bg == 0) {
+            copyPixels(d, s, w);
+        } else {
+            keyPixels(d, s, w, bg);
+        }
     }
 }
 
+template class PixelBufferT<RGBA8888>;
+template class PixelBufferT<RGB565>;
+template class PixelBufferT<A8>;
+template class ImageBufferT<RGBA8888>;
+template class ImageBufferT<RGB565>;
+template class ImageBufferT<A8>;
+
 }
@@ -0,0 +1,244 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "pixelkernels.h"
+#include <algorithm>
+#include <cstring>
+#if defined(NAVITAB_KERNELS_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace navitab {
+
+// The scalar kernels are the reference implementations. The vector versions
+// fall back to these for the odd pixels at the end of each row.
+
+static void scalarCopyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    std::memcpy(d, s, n * sizeof(uint32_t));
+}
+
+static void scalarFillRow(uint32_t *d, uint32_t px, size_t n)
+{
+    while (n--) *d++ = px;
+}
+
+static void scalarKeyRow(uint32_t *d, const uint32_t *s, size_t n, uint32_t bg)
+{
+    while (n--) {
+        uint32_t p = *s++;
+        *d++ = (p == 0) ? bg : p;
+    }
+}
+
+static void scalarBlendRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    while (n--) {
+        uint32_t sp = *s++;
+        uint32_t a = sp >> 24;
+        if (a == 0xff) {
+            *d = (sp & 0x00ffffff) | (*d & 0xff000000);
+        } else if (a) {
+            uint32_t dp = *d;
+            uint32_t ia = 0xff - a;
+            uint32_t r = Div255((sp & 0xff) * a + (dp & 0xff) * ia);
+            uint32_t g = Div255(((sp >> 8) & 0xff) * a + ((dp >> 8) & 0xff) * ia);
+            uint32_t b = Div255(((sp >> 16) & 0xff) * a + ((dp >> 16) & 0xff) * ia);
+            *d = r | (g << 8) | (b << 16) | (dp & 0xff000000);
+        }
+        ++d;
+    }
+}
+
+static inline uint32_t premulOver(uint32_t sp, uint32_t dp)
+{
+    uint32_t ia = 0xff - (sp >> 24);
+    uint32_t r = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t c = ((sp >> shift) & 0xff) + Div255(((dp >> shift) & 0xff) * ia);
+        r |= std::min(c, 0xffu) << shift;
+    }
+    return r;
+}
+
+static void scalarBlendPremulRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    while (n--) {
+        uint32_t sp = *s++;
+        if ((sp >> 24) == 0xff) {
+            *d = sp;
+        } else if (sp) {
+            *d = premulOver(sp, *d);
+        }
+        ++d;
+    }
+}
+
+static void scalarPremultiplyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    while (n--) {
+        uint32_t sp = *s++;
+        uint32_t a = sp >> 24;
+        if (a == 0xff) {
+            *d = sp;
+        } else {
+            uint32_t r = Div255((sp & 0xff) * a);
+            uint32_t g = Div255(((sp >> 8) & 0xff) * a);
+            uint32_t b = Div255(((sp >> 16) & 0xff) * a);
+            *d = r | (g << 8) | (b << 16) | (a << 24);
+        }
+        ++d;
+    }
+}
+
+static void scalarBlendMaskRow(uint32_t *d, const uint8_t *m, size_t n, uint32_t colour)
+{
+    while (n--) {
+        uint32_t cover = *m++;
+        uint32_t sp = colour;
+        if (cover != 0xff) {
+            sp = 0;
+            for (int shift = 0; shift < 32; shift += 8) {
+                sp |= Div255(((colour >> shift) & 0xff) * cover) << shift;
+            }
+        }
+        if (sp) *d = premulOver(sp, *d);
+        ++d;
+    }
+}
+
+static void scalarToRgb565Row(uint16_t *d, const uint32_t *s, size_t n)
+{
+    while (n--) {
+        uint32_t sp = *s++;
+        *d++ = (uint16_t)(((sp & 0xf8) << 8) | ((sp & 0xfc00) >> 5) | ((sp & 0xf80000) >> 19));
+    }
+}
+
+static void scalarFromRgb565Row(uint32_t *d, const uint16_t *s, size_t n)
+{
+    // the top bits of each channel are replicated into the bottom bits, so that
+    // full intensity maps to 0xff
+    while (n--) {
+        uint32_t sp = *s++;
+        uint32_t r = (sp >> 8) & 0xf8;
+        uint32_t g = (sp >> 3) & 0xfc;
+        uint32_t b = (sp << 3) & 0xf8;
+        r |= r >> 5;
+        g |= g >> 6;
+        b |= b >> 5;
+        *d++ = r | (g << 8) | (b << 16) | 0xff000000;
+    }
+}
+
+static void scalarAlphaRow(uint8_t *d, const uint32_t *s, size_t n)
+{
+    while (n--) *d++ = (uint8_t)(*s++ >> 24);
+}
+
+static void scalarResampleRowH(uint32_t *d, const uint32_t *s, size_t n, const int32_t *starts, const int16_t *w, unsigned taps)
+{
+    while (n--) {
+        const uint32_t *sp = s + *starts++;
+        int32_t acc[4] = { 0, 0, 0, 0 };
+        for (unsigned k = 0; k < taps; ++k) {
+            uint32_t p = sp[k];
+            for (int c = 0; c < 4; ++c) {
+                acc[c] += w[k] * (int32_t)((p >> (c * 8)) & 0xff);
+            }
+        }
+        *d++ = ResampleClamp(acc[0]) | (ResampleClamp(acc[1]) << 8) | (ResampleClamp(acc[2]) << 16) | (ResampleClamp(acc[3]) << 24);
+        w += taps;
+    }
+}
+
+static void scalarResampleRowV(uint32_t *d, const uint32_t *const *rows, size_t n, const int16_t *w, unsigned taps)
+{
+    for (size_t i = 0; i < n; ++i) {
+        d[i] = ResampleColumn(rows, i, w, taps);
+    }
+}
+
+static void scalarBilinearRow(uint32_t *d, size_t n, const uint32_t *s, size_t span, int32_t u, int32_t v, int32_t du, int32_t dv)
+{
+    while (n--) {
+        const uint32_t *s0 = s + (size_t)(v >> 16) * span + (u >> 16);
+        const uint32_t *s1 = s0 + span;
+        *d++ = BilinearPixel(s0[0], s0[1], s1[0], s1[1], (u >> 8) & 0xff, (v >> 8) & 0xff);
+        u += du; v += dv;
+    }
+}
+
+static const PixelKernels scalarKernels = {
+    "scalar",
+    scalarCopyRow,
+    scalarCopyRow,
+    scalarFillRow,
+    scalarKeyRow,
+    scalarBlendRow,
+    scalarBlendPremulRow,
+    scalarPremultiplyRow,
+    scalarBlendMaskRow,
+    scalarToRgb565Row,
+    scalarFromRgb565Row,
+    scalarAlphaRow,
+    scalarResampleRowH,
+    scalarResampleRowV,
+    scalarBilinearRow
+};
+
+const PixelKernels* ScalarPixelKernels()
+{
+    return &scalarKernels;
+}
+
+#if defined(NAVITAB_KERNELS_X86)
+static bool cpuHasSse41()
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 1);
+    return (r[2] & (1 << 19)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static bool cpuHasAvx2()
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return false;
+    __cpuid(r, 1);
+    bool osxsave = (r[2] & (1 << 27)) != 0;
+    bool avx = (r[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) return false;
+    // the OS must also be saving the upper halves of the YMM registers
+    if ((_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static const PixelKernels* selectKernels()
+{
+    const PixelKernels* k = nullptr;
+#if defined(NAVITAB_KERNELS_X86)
+    if (cpuHasAvx2()) k = Avx2PixelKernels();
+    if (!k && cpuHasSse41()) k = Sse41PixelKernels();
+#elif defined(NAVITAB_KERNELS_NEON)
+    k = NeonPixelKernels();
+#endif
+    return k ? k : ScalarPixelKernels();
+}
+
+const PixelKernels& PixelKernelSet()
+{
+    static const PixelKernels* const selected = selectKernels();
+    return *selected;
+}
+
+} // namespace navitab
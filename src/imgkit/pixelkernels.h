@@ -0,0 +1,137 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// This header file defines the table of low-level pixel kernels which do the
+// inner-loop work for the PixelBuffer and ImageBuffer primitives. Each kernel
+// processes a single row of 32-bit pixels (red in 7:0, green in 15:8, blue in
+// 23:16, alpha in 31:24), or converts a row to or from one of the other pixel
+// formats. Variants using the host CPU's vector instructions
+// are selected once, on first use, and every variant must give bit-identical
+// results to the scalar versions.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define NAVITAB_KERNELS_X86 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define NAVITAB_KERNELS_NEON 1
+#endif
+
+namespace navitab {
+
+struct PixelKernels
+{
+    // name of the instruction set used, for logging
+    const char *name;
+
+    // copy n pixels from s to d, the rows must not overlap
+    void (*copyRow)(uint32_t *d, const uint32_t *s, size_t n);
+
+    // as copyRow, but using non-temporal stores where possible so that large copies
+    // do not evict everything else from the cache (best with 64-byte aligned rows)
+    void (*streamRow)(uint32_t *d, const uint32_t *s, size_t n);
+
+    // set n pixels starting at d to the value px
+    void (*fillRow)(uint32_t *d, uint32_t px, size_t n);
+
+    // copy n pixels from s to d, substituting bg for any source pixel that is 0
+    void (*keyRow)(uint32_t *d, const uint32_t *s, size_t n, uint32_t bg);
+
+    // blend n straight-alpha pixels from s over d, d's alpha is left unchanged
+    void (*blendRow)(uint32_t *d, const uint32_t *s, size_t n);
+
+    // composite n premultiplied-alpha pixels from s over d (all 4 channels)
+    void (*blendPremulRow)(uint32_t *d, const uint32_t *s, size_t n);
+
+    // convert n straight-alpha pixels from s to premultiplied alpha in d, s may equal d
+    void (*premultiplyRow)(uint32_t *d, const uint32_t *s, size_t n);
+
+    // composite the premultiplied colour over n pixels of d, scaled by the n A8
+    // coverage values in m
+    void (*blendMaskRow)(uint32_t *d, const uint8_t *m, size_t n, uint32_t colour);
+
+    // convert n pixels from s to RGB565 in d, the colour channels are truncated
+    void (*toRgb565Row)(uint16_t *d, const uint32_t *s, size_t n);
+
+    // convert n RGB565 pixels from s to opaque pixels in d
+    void (*fromRgb565Row)(uint32_t *d, const uint16_t *s, size_t n);
+
+    // copy the alpha channel of n pixels from s into the A8 values in d
+    void (*alphaRow)(uint8_t *d, const uint32_t *s, size_t n);
+
+    // horizontal resampling pass. Each of the n pixels in d is the weighted sum of
+    // taps consecutive pixels of s, starting at s[starts[i]], using the next taps
+    // fixed point weights from w.
+    void (*resampleRowH)(uint32_t *d, const uint32_t *s, size_t n, const int32_t *starts, const int16_t *w, unsigned taps);
+
+    // vertical resampling pass. Each of the n pixels in d is the weighted sum of the
+    // pixels in the same column of the taps rows, using the taps weights in w.
+    void (*resampleRowV)(uint32_t *d, const uint32_t *const *rows, size_t n, const int16_t *w, unsigned taps);
+
+    // bilinear sampling along a line through a source image with the given span.
+    // The source position of the first of the n pixels is (u, v), and it steps
+    // by (du, dv) for each pixel, all in 16.16 fixed point. Every sample and its
+    // right and lower neighbours must be within the source.
+    void (*bilinearRow)(uint32_t *d, size_t n, const uint32_t *s, size_t span, int32_t u, int32_t v, int32_t du, int32_t dv);
+};
+
+// Get the kernels best suited to the CPU we are running on.
+const PixelKernels& PixelKernelSet();
+
+// The individual kernel sets. The vector versions return nullptr if they were
+// not compiled for this target architecture.
+const PixelKernels* ScalarPixelKernels();
+const PixelKernels* Sse41PixelKernels();
+const PixelKernels* Avx2PixelKernels();
+const PixelKernels* NeonPixelKernels();
+
+// Integer approximation of x/255, exact (rounded) for 0 <= x <= 255*255.
+inline uint32_t Div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Resampling weights are signed fixed point with 14 fractional bits, and the
+// weights for each output pixel sum to 1 << ResampleBits. Each channel's sum is
+// rounded and then clamped to 0..255, since filters with negative lobes can
+// overshoot.
+const int ResampleBits = 14;
+
+inline uint32_t ResampleClamp(int32_t acc)
+{
+    acc += 1 << (ResampleBits - 1);
+    if (acc < 0) return 0;
+    acc >>= ResampleBits;
+    return (acc > 0xff) ? 0xff : (uint32_t)acc;
+}
+
+// One pixel of the vertical pass, shared by all of the variants for their tails.
+inline uint32_t ResampleColumn(const uint32_t *const *rows, size_t i, const int16_t *w, unsigned taps)
+{
+    int32_t acc[4] = { 0, 0, 0, 0 };
+    for (unsigned k = 0; k < taps; ++k) {
+        uint32_t p = rows[k][i];
+        for (int c = 0; c < 4; ++c) {
+            acc[c] += w[k] * (int32_t)((p >> (c * 8)) & 0xff);
+        }
+    }
+    return ResampleClamp(acc[0]) | (ResampleClamp(acc[1]) << 8) | (ResampleClamp(acc[2]) << 16) | (ResampleClamp(acc[3]) << 24);
+}
+
+// Bilinear interpolation of 4 pixels, with 8-bit fractions fx and fy (0..255).
+// The horizontal lerps fit in 16 bits, and the vertical one in 32 bits.
+inline uint32_t BilinearPixel(uint32_t p00, uint32_t p01, uint32_t p10, uint32_t p11, uint32_t fx, uint32_t fy)
+{
+    uint32_t r = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t top = ((p00 >> shift) & 0xff) * (256 - fx) + ((p01 >> shift) & 0xff) * fx;
+        uint32_t bottom = ((p10 >> shift) & 0xff) * (256 - fx) + ((p11 >> shift) & 0xff) * fx;
+        r |= ((top * (256 - fy) + bottom * fy + 0x8000) >> 16) << shift;
+    }
+    return r;
+}
+
+} // namespace navitab
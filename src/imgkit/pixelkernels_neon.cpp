@@ -0,0 +1,289 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "pixelkernels.h"
+
+// NEON versions of the pixel kernels. NEON is always available on the 64-bit
+// ARM targets that Navitab supports, so no runtime check is needed.
+
+#if defined(NAVITAB_KERNELS_NEON)
+
+#include <arm_neon.h>
+#include <cstring>
+
+namespace navitab {
+
+static void copyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    std::memcpy(d, s, n * sizeof(uint32_t));
+}
+
+static void neonFillRow(uint32_t *d, uint32_t px, size_t n)
+{
+    const uint32x4_t v = vdupq_n_u32(px);
+    while (n >= 4) {
+        vst1q_u32(d, v);
+        d += 4; n -= 4;
+    }
+    while (n--) *d++ = px;
+}
+
+static void neonKeyRow(uint32_t *d, const uint32_t *s, size_t n, uint32_t bg)
+{
+    const uint32x4_t vbg = vdupq_n_u32(bg);
+    while (n >= 4) {
+        uint32x4_t sp = vld1q_u32(s);
+        uint32x4_t m = vceqq_u32(sp, vdupq_n_u32(0));
+        vst1q_u32(d, vbslq_u32(m, vbg, sp));
+        s += 4; d += 4; n -= 4;
+    }
+    ScalarPixelKernels()->keyRow(d, s, n, bg);
+}
+
+// Blend one 8-bit channel of 8 pixels: (s * a + d * (255 - a)) / 255.
+// vraddhn(t, (t + 128) >> 8) gives the same rounding as Div255().
+static inline uint8x8_t blend8(uint8x8_t s, uint8x8_t d, uint8x8_t a, uint8x8_t ia)
+{
+    uint16x8_t t = vmlal_u8(vmull_u8(s, a), d, ia);
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void neonBlendRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 8) {
+        // de-interleave 8 pixels into separate r, g, b, a vectors
+        uint8x8x4_t sp = vld4_u8(reinterpret_cast<const uint8_t *>(s));
+        uint8_t amax = vmaxv_u8(sp.val[3]);
+        if (amax) {
+            uint8x8x4_t dp = vld4_u8(reinterpret_cast<const uint8_t *>(d));
+            if (vminv_u8(sp.val[3]) == 0xff) {
+                // all 8 source pixels are opaque
+                dp.val[0] = sp.val[0];
+                dp.val[1] = sp.val[1];
+                dp.val[2] = sp.val[2];
+            } else {
+                uint8x8_t ia = vmvn_u8(sp.val[3]);
+                dp.val[0] = blend8(sp.val[0], dp.val[0], sp.val[3], ia);
+                dp.val[1] = blend8(sp.val[1], dp.val[1], sp.val[3], ia);
+                dp.val[2] = blend8(sp.val[2], dp.val[2], sp.val[3], ia);
+            }
+            vst4_u8(reinterpret_cast<uint8_t *>(d), dp);
+        }
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->blendRow(d, s, n);
+}
+
+// Premultiplied 'over' is d = s + d * (255 - sa) / 255, on all four channels.
+static inline uint8x8_t scale8(uint8x8_t c, uint8x8_t a)
+{
+    uint16x8_t t = vmull_u8(c, a);
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void neonBlendPremulRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 8) {
+        uint8x8x4_t sp = vld4_u8(reinterpret_cast<const uint8_t *>(s));
+        uint8x8_t any = vorr_u8(vorr_u8(sp.val[0], sp.val[1]), vorr_u8(sp.val[2], sp.val[3]));
+        if (vmaxv_u8(any)) {
+            uint8x8x4_t dp;
+            if (vminv_u8(sp.val[3]) == 0xff) {
+                dp = sp;
+            } else {
+                dp = vld4_u8(reinterpret_cast<uint8_t *>(d));
+                uint8x8_t ia = vmvn_u8(sp.val[3]);
+                for (int c = 0; c < 4; ++c) {
+                    dp.val[c] = vqadd_u8(sp.val[c], scale8(dp.val[c], ia));
+                }
+            }
+            vst4_u8(reinterpret_cast<uint8_t *>(d), dp);
+        }
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->blendPremulRow(d, s, n);
+}
+
+static void neonPremultiplyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 8) {
+        uint8x8x4_t sp = vld4_u8(reinterpret_cast<const uint8_t *>(s));
+        sp.val[0] = scale8(sp.val[0], sp.val[3]);
+        sp.val[1] = scale8(sp.val[1], sp.val[3]);
+        sp.val[2] = scale8(sp.val[2], sp.val[3]);
+        vst4_u8(reinterpret_cast<uint8_t *>(d), sp);
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->premultiplyRow(d, s, n);
+}
+
+static void neonBlendMaskRow(uint32_t *d, const uint8_t *m, size_t n, uint32_t colour)
+{
+    const uint8x8_t cr = vdup_n_u8(colour & 0xff);
+    const uint8x8_t cg = vdup_n_u8((colour >> 8) & 0xff);
+    const uint8x8_t cb = vdup_n_u8((colour >> 16) & 0xff);
+    const uint8x8_t ca = vdup_n_u8(colour >> 24);
+    while (n >= 8) {
+        uint8x8_t cover = vld1_u8(m);
+        if (vmaxv_u8(cover)) {
+            uint8x8x4_t dp = vld4_u8(reinterpret_cast<uint8_t *>(d));
+            uint8x8_t sa = scale8(ca, cover);
+            uint8x8_t ia = vmvn_u8(sa);
+            dp.val[0] = vqadd_u8(scale8(cr, cover), scale8(dp.val[0], ia));
+            dp.val[1] = vqadd_u8(scale8(cg, cover), scale8(dp.val[1], ia));
+            dp.val[2] = vqadd_u8(scale8(cb, cover), scale8(dp.val[2], ia));
+            dp.val[3] = vqadd_u8(sa, scale8(dp.val[3], ia));
+            vst4_u8(reinterpret_cast<uint8_t *>(d), dp);
+        }
+        m += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->blendMaskRow(d, m, n, colour);
+}
+
+static void neonToRgb565Row(uint16_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 8) {
+        uint8x8x4_t sp = vld4_u8(reinterpret_cast<const uint8_t *>(s));
+        // shift each channel to the top of a 16-bit lane and insert below the previous one
+        uint16x8_t p = vshll_n_u8(sp.val[0], 8);
+        p = vsriq_n_u16(p, vshll_n_u8(sp.val[1], 8), 5);
+        p = vsriq_n_u16(p, vshll_n_u8(sp.val[2], 8), 11);
+        vst1q_u16(d, p);
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->toRgb565Row(d, s, n);
+}
+
+static void neonFromRgb565Row(uint32_t *d, const uint16_t *s, size_t n)
+{
+    while (n >= 8) {
+        uint16x8_t p = vld1q_u16(s);
+        uint8x8x4_t dp;
+        // the insertions replicate the top bits of each channel into the bottom bits
+        uint8x8_t r = vshrn_n_u16(p, 8);
+        uint8x8_t g = vshrn_n_u16(p, 3);
+        uint8x8_t b = vmovn_u16(vshlq_n_u16(p, 3));
+        dp.val[0] = vsri_n_u8(r, r, 5);
+        dp.val[1] = vsri_n_u8(g, g, 6);
+        dp.val[2] = vsri_n_u8(b, b, 5);
+        dp.val[3] = vdup_n_u8(0xff);
+        vst4_u8(reinterpret_cast<uint8_t *>(d), dp);
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->fromRgb565Row(d, s, n);
+}
+
+static void neonAlphaRow(uint8_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 8) {
+        uint8x8x4_t sp = vld4_u8(reinterpret_cast<const uint8_t *>(s));
+        vst1_u8(d, sp.val[3]);
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->alphaRow(d, s, n);
+}
+
+// Resampled channels are accumulated in 32-bit lanes, then rounded, narrowed and
+// clamped to 0..255 by the saturating shift and move instructions.
+static inline int16x4_t resampleRound(int32x4_t acc)
+{
+    return vqrshrn_n_s32(acc, ResampleBits);
+}
+
+static void neonResampleRowH(uint32_t *d, const uint32_t *s, size_t n, const int32_t *starts, const int16_t *w, unsigned taps)
+{
+    while (n--) {
+        const uint32_t *sp = s + *starts++;
+        int32x4_t acc = vdupq_n_s32(0);
+        for (unsigned k = 0; k < taps; ++k) {
+            uint16x8_t p = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(sp[k])));
+            acc = vmlal_n_s16(acc, vreinterpret_s16_u16(vget_low_u16(p)), w[k]);
+        }
+        int16x4_t r = resampleRound(acc);
+        uint8x8_t px = vqmovun_s16(vcombine_s16(r, r));
+        *d++ = vget_lane_u32(vreinterpret_u32_u8(px), 0);
+        w += taps;
+    }
+}
+
+static void neonResampleRowV(uint32_t *d, const uint32_t *const *rows, size_t n, const int16_t *w, unsigned taps)
+{
+    size_t i = 0;
+    for (; (i + 4) <= n; i += 4) {
+        int32x4_t acc0 = vdupq_n_s32(0), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (unsigned k = 0; k < taps; ++k) {
+            uint8x16_t p = vld1q_u8(reinterpret_cast<const uint8_t *>(rows[k] + i));
+            int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(p)));
+            int16x8_t hi = vreinterpretq_s16_u16(vmovl_high_u8(p));
+            acc0 = vmlal_n_s16(acc0, vget_low_s16(lo), w[k]);
+            acc1 = vmlal_n_s16(acc1, vget_high_s16(lo), w[k]);
+            acc2 = vmlal_n_s16(acc2, vget_low_s16(hi), w[k]);
+            acc3 = vmlal_n_s16(acc3, vget_high_s16(hi), w[k]);
+        }
+        uint8x8_t p01 = vqmovun_s16(vcombine_s16(resampleRound(acc0), resampleRound(acc1)));
+        uint8x8_t p23 = vqmovun_s16(vcombine_s16(resampleRound(acc2), resampleRound(acc3)));
+        vst1q_u8(reinterpret_cast<uint8_t *>(d + i), vcombine_u8(p01, p23));
+    }
+    for (; i < n; ++i) {
+        d[i] = ResampleColumn(rows, i, w, taps);
+    }
+}
+
+static void neonBilinearRow(uint32_t *d, size_t n, const uint32_t *s, size_t span, int32_t u, int32_t v, int32_t du, int32_t dv)
+{
+    while (n--) {
+        const uint32_t *s0 = s + (size_t)(v >> 16) * span + (u >> 16);
+        // each vector holds the 4 channels of the left and right pixels
+        uint16x8_t p0 = vmovl_u8(vld1_u8(reinterpret_cast<const uint8_t *>(s0)));
+        uint16x8_t p1 = vmovl_u8(vld1_u8(reinterpret_cast<const uint8_t *>(s0 + span)));
+        uint16_t fx = (uint16_t)((u >> 8) & 0xff);
+        uint16x8_t wx = vcombine_u16(vdup_n_u16(256 - fx), vdup_n_u16(fx));
+        uint16x8_t t = vmulq_u16(p0, wx);
+        uint16x8_t b = vmulq_u16(p1, wx);
+        uint16x4_t top = vadd_u16(vget_low_u16(t), vget_high_u16(t));
+        uint16x4_t bottom = vadd_u16(vget_low_u16(b), vget_high_u16(b));
+        uint16_t fy = (uint16_t)((v >> 8) & 0xff);
+        uint32x4_t r = vmlal_n_u16(vmull_n_u16(top, 256 - fy), bottom, fy);
+        uint16x4_t r16 = vrshrn_n_u32(r, 16);
+        uint8x8_t px = vmovn_u16(vcombine_u16(r16, r16));
+        *d++ = vget_lane_u32(vreinterpret_u32_u8(px), 0);
+        u += du; v += dv;
+    }
+}
+
+static const PixelKernels neonKernels = {
+    "neon",
+    copyRow,
+    copyRow,
+    neonFillRow,
+    neonKeyRow,
+    neonBlendRow,
+    neonBlendPremulRow,
+    neonPremultiplyRow,
+    neonBlendMaskRow,
+    neonToRgb565Row,
+    neonFromRgb565Row,
+    neonAlphaRow,
+    neonResampleRowH,
+    neonResampleRowV,
+    neonBilinearRow
+};
+
+const PixelKernels* NeonPixelKernels()
+{
+    return &neonKernels;
+}
+
+} // namespace navitab
+
+#else
+
+namespace navitab {
+
+const PixelKernels* NeonPixelKernels()
+{
+    return nullptr;
+}
+
+} // namespace navitab
+
+#endif
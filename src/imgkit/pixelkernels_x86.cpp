@@ -0,0 +1,580 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "pixelkernels.h"
+
+// SSE4.1 and AVX2 versions of the pixel kernels. These are compiled using
+// per-function target attributes rather than per-file compiler flags so that
+// the rest of the code (and universal macOS builds) are not affected, and
+// are only ever called after the CPU has been checked for support.
+
+#if defined(NAVITAB_KERNELS_X86)
+
+#include <immintrin.h>
+#include <cstring>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+namespace navitab {
+
+// The blend calculation is done on 16-bit lanes, ie two pixels per 128 bits.
+// For each colour channel: d = (s * a + d * (255 - a)) / 255, with the division
+// done using the same rounding approximation as Div255() in the scalar code.
+
+TARGET_SSE41 static inline __m128i blend16Sse(__m128i s16, __m128i d16)
+{
+    const __m128i c255 = _mm_set1_epi16(0xff);
+    const __m128i c128 = _mm_set1_epi16(0x80);
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+    __m128i ia = _mm_sub_epi16(c255, a);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s16, a), _mm_mullo_epi16(d16, ia));
+    t = _mm_add_epi16(t, c128);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void copyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    std::memcpy(d, s, n * sizeof(uint32_t));
+}
+
+TARGET_SSE41 static void sse41StreamRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    if (reinterpret_cast<uintptr_t>(d) & 3) {
+        // the pixels themselves are misaligned, so the stores can never be aligned
+        std::memcpy(d, s, n * sizeof(uint32_t));
+        return;
+    }
+    // copy up to the first 16-byte aligned destination pixel, then stream
+    while (n && (reinterpret_cast<uintptr_t>(d) & 15)) {
+        *d++ = *s++; --n;
+    }
+    while (n >= 4) {
+        _mm_stream_si128(reinterpret_cast<__m128i *>(d), _mm_loadu_si128(reinterpret_cast<const __m128i *>(s)));
+        s += 4; d += 4; n -= 4;
+    }
+    _mm_sfence();
+    while (n--) *d++ = *s++;
+}
+
+TARGET_SSE41 static void sse41FillRow(uint32_t *d, uint32_t px, size_t n)
+{
+    const __m128i v = _mm_set1_epi32((int)px);
+    while (n >= 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), v);
+        d += 4; n -= 4;
+    }
+    while (n--) *d++ = px;
+}
+
+TARGET_SSE41 static void sse41KeyRow(uint32_t *d, const uint32_t *s, size_t n, uint32_t bg)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vbg = _mm_set1_epi32((int)bg);
+    while (n >= 4) {
+        __m128i sp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        __m128i m = _mm_cmpeq_epi32(sp, zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), _mm_blendv_epi8(sp, vbg, m));
+        s += 4; d += 4; n -= 4;
+    }
+    ScalarPixelKernels()->keyRow(d, s, n, bg);
+}
+
+TARGET_SSE41 static void sse41BlendRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32((int)0xff000000);
+    while (n >= 4) {
+        __m128i sp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        __m128i sa = _mm_and_si128(sp, amask);
+        if (!_mm_testz_si128(sa, sa)) {
+            __m128i dp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(d));
+            __m128i r;
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, amask)) == 0xffff) {
+                // all 4 source pixels are opaque
+                r = sp;
+            } else {
+                __m128i lo = blend16Sse(_mm_unpacklo_epi8(sp, zero), _mm_unpacklo_epi8(dp, zero));
+                __m128i hi = blend16Sse(_mm_unpackhi_epi8(sp, zero), _mm_unpackhi_epi8(dp, zero));
+                r = _mm_packus_epi16(lo, hi);
+            }
+            r = _mm_blendv_epi8(r, dp, amask);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(d), r);
+        }
+        s += 4; d += 4; n -= 4;
+    }
+    ScalarPixelKernels()->blendRow(d, s, n);
+}
+
+// Premultiplied 'over' is d = s + d * (255 - sa) / 255, on all four channels.
+
+TARGET_SSE41 static inline __m128i scale16Sse(__m128i c16, __m128i a)
+{
+    const __m128i c128 = _mm_set1_epi16(0x80);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(c16, a), c128);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+TARGET_SSE41 static void sse41BlendPremulRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(0xff);
+    const __m128i amask = _mm_set1_epi32((int)0xff000000);
+    while (n >= 4) {
+        __m128i sp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        if (!_mm_testz_si128(sp, sp)) {
+            __m128i r;
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(sp, amask), amask)) == 0xffff) {
+                r = sp;
+            } else {
+                __m128i dp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(d));
+                __m128i slo = _mm_unpacklo_epi8(sp, zero);
+                __m128i shi = _mm_unpackhi_epi8(sp, zero);
+                __m128i ialo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xff), 0xff));
+                __m128i iahi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xff), 0xff));
+                __m128i lo = scale16Sse(_mm_unpacklo_epi8(dp, zero), ialo);
+                __m128i hi = scale16Sse(_mm_unpackhi_epi8(dp, zero), iahi);
+                r = _mm_adds_epu8(sp, _mm_packus_epi16(lo, hi));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(d), r);
+        }
+        s += 4; d += 4; n -= 4;
+    }
+    ScalarPixelKernels()->blendPremulRow(d, s, n);
+}
+
+TARGET_SSE41 static void sse41PremultiplyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32((int)0xff000000);
+    while (n >= 4) {
+        __m128i sp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        __m128i slo = _mm_unpacklo_epi8(sp, zero);
+        __m128i shi = _mm_unpackhi_epi8(sp, zero);
+        __m128i lo = scale16Sse(slo, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xff), 0xff));
+        __m128i hi = scale16Sse(shi, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xff), 0xff));
+        __m128i r = _mm_blendv_epi8(_mm_packus_epi16(lo, hi), sp, amask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), r);
+        s += 4; d += 4; n -= 4;
+    }
+    ScalarPixelKernels()->premultiplyRow(d, s, n);
+}
+
+TARGET_SSE41 static void sse41BlendMaskRow(uint32_t *d, const uint8_t *m, size_t n, uint32_t colour)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(0xff);
+    // spread the coverage values of pixels 0,1 and 2,3 across their 16-bit channel lanes
+    const __m128i spreadlo = _mm_setr_epi8(0, -1, 0, -1, 0, -1, 0, -1, 1, -1, 1, -1, 1, -1, 1, -1);
+    const __m128i spreadhi = _mm_setr_epi8(2, -1, 2, -1, 2, -1, 2, -1, 3, -1, 3, -1, 3, -1, 3, -1);
+    const __m128i c16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)colour), zero);
+    while (n >= 4) {
+        uint32_t m4;
+        std::memcpy(&m4, m, sizeof(m4));
+        if (m4) {
+            __m128i mv = _mm_cvtsi32_si128((int)m4);
+            __m128i slo = scale16Sse(c16, _mm_shuffle_epi8(mv, spreadlo));
+            __m128i shi = scale16Sse(c16, _mm_shuffle_epi8(mv, spreadhi));
+            __m128i dp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(d));
+            __m128i ialo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xff), 0xff));
+            __m128i iahi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xff), 0xff));
+            __m128i lo = scale16Sse(_mm_unpacklo_epi8(dp, zero), ialo);
+            __m128i hi = scale16Sse(_mm_unpackhi_epi8(dp, zero), iahi);
+            __m128i r = _mm_adds_epu8(_mm_packus_epi16(slo, shi), _mm_packus_epi16(lo, hi));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(d), r);
+        }
+        m += 4; d += 4; n -= 4;
+    }
+    ScalarPixelKernels()->blendMaskRow(d, m, n, colour);
+}
+
+TARGET_SSE41 static inline __m128i to565Sse(__m128i p)
+{
+    __m128i r = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf8)), 8);
+    __m128i g = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xfc00)), 5);
+    __m128i b = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf80000)), 19);
+    return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+TARGET_SSE41 static void sse41ToRgb565Row(uint16_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 8) {
+        __m128i p0 = to565Sse(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s)));
+        __m128i p1 = to565Sse(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), _mm_packus_epi32(p0, p1));
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->toRgb565Row(d, s, n);
+}
+
+TARGET_SSE41 static inline __m128i from565Sse(__m128i p)
+{
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf8));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0xfc));
+    __m128i b = _mm_and_si128(_mm_slli_epi32(p, 3), _mm_set1_epi32(0xf8));
+    r = _mm_or_si128(r, _mm_srli_epi32(r, 5));
+    g = _mm_or_si128(g, _mm_srli_epi32(g, 6));
+    b = _mm_or_si128(b, _mm_srli_epi32(b, 5));
+    __m128i rgb = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_slli_epi32(b, 16));
+    return _mm_or_si128(rgb, _mm_set1_epi32((int)0xff000000));
+}
+
+TARGET_SSE41 static void sse41FromRgb565Row(uint32_t *d, const uint16_t *s, size_t n)
+{
+    while (n >= 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), from565Sse(_mm_cvtepu16_epi32(v)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d + 4), from565Sse(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->fromRgb565Row(d, s, n);
+}
+
+TARGET_SSE41 static void sse41AlphaRow(uint8_t *d, const uint32_t *s, size_t n)
+{
+    while (n >= 16) {
+        auto vs = reinterpret_cast<const __m128i *>(s);
+        __m128i a0 = _mm_srli_epi32(_mm_loadu_si128(vs), 24);
+        __m128i a1 = _mm_srli_epi32(_mm_loadu_si128(vs + 1), 24);
+        __m128i a2 = _mm_srli_epi32(_mm_loadu_si128(vs + 2), 24);
+        __m128i a3 = _mm_srli_epi32(_mm_loadu_si128(vs + 3), 24);
+        __m128i a = _mm_packus_epi16(_mm_packus_epi32(a0, a1), _mm_packus_epi32(a2, a3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d), a);
+        s += 16; d += 16; n -= 16;
+    }
+    ScalarPixelKernels()->alphaRow(d, s, n);
+}
+
+// The resampling passes multiply pairs of taps at once with madd, having first
+// interleaved the channels of the two pixels so that each 32-bit lane of the
+// result accumulates one channel. The pair's weights are packed into each lane.
+
+TARGET_SSE41 static inline __m128i weightPairSse(int16_t w0, int16_t w1)
+{
+    return _mm_set1_epi32((int)(((uint32_t)(uint16_t)w1 << 16) | (uint16_t)w0));
+}
+
+TARGET_SSE41 static inline __m128i resampleRoundSse(__m128i acc)
+{
+    return _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << (ResampleBits - 1))), ResampleBits);
+}
+
+TARGET_SSE41 static void sse41ResampleRowH(uint32_t *d, const uint32_t *s, size_t n, const int32_t *starts, const int16_t *w, unsigned taps)
+{
+    // spread 2 pixels to 16-bit lanes, in the order r0 r1 g0 g1 b0 b1 a0 a1
+    const __m128i pairs = _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1, 2, -1, 6, -1, 3, -1, 7, -1);
+    while (n--) {
+        const uint32_t *sp = s + *starts++;
+        __m128i acc = _mm_setzero_si128();
+        unsigned k = 0;
+        for (; (k + 1) < taps; k += 2) {
+            __m128i p = _mm_shuffle_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(sp + k)), pairs);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(p, weightPairSse(w[k], w[k + 1])));
+        }
+        if (k < taps) {
+            __m128i p = _mm_shuffle_epi8(_mm_cvtsi32_si128((int)sp[k]), pairs);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(p, weightPairSse(w[k], 0)));
+        }
+        acc = resampleRoundSse(acc);
+        *d++ = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(acc, acc), acc));
+        w += taps;
+    }
+}
+
+TARGET_SSE41 static void sse41ResampleRowV(uint32_t *d, const uint32_t *const *rows, size_t n, const int16_t *w, unsigned taps)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; (i + 4) <= n; i += 4) {
+        __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+        for (unsigned k = 0; k < taps; k += 2) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+            __m128i b = zero;
+            int16_t wb = 0;
+            if ((k + 1) < taps) {
+                b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k + 1] + i));
+                wb = w[k + 1];
+            }
+            __m128i wk = weightPairSse(w[k], wb);
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wk));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wk));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wk));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wk));
+        }
+        __m128i p01 = _mm_packs_epi32(resampleRoundSse(acc0), resampleRoundSse(acc1));
+        __m128i p23 = _mm_packs_epi32(resampleRoundSse(acc2), resampleRoundSse(acc3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(d + i), _mm_packus_epi16(p01, p23));
+    }
+    for (; i < n; ++i) {
+        d[i] = ResampleColumn(rows, i, w, taps);
+    }
+}
+
+// Bilinear sampling can't usefully be spread across pixels without a gather, so
+// the vector lanes are used for the channels of each pixel instead. The pairs of
+// horizontally adjacent pixels are loaded together.
+TARGET_SSE41 static void sse41BilinearRow(uint32_t *d, size_t n, const uint32_t *s, size_t span, int32_t u, int32_t v, int32_t du, int32_t dv)
+{
+    const __m128i c256 = _mm_set1_epi16(256);
+    const __m128i round = _mm_set1_epi32(0x8000);
+    while (n--) {
+        const uint32_t *s0 = s + (size_t)(v >> 16) * span + (u >> 16);
+        __m128i p0 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(s0)));
+        __m128i p1 = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(s0 + span)));
+        // weights (256 - fx) for the left pixel, fx for the right
+        __m128i fx = _mm_set1_epi16((short)((u >> 8) & 0xff));
+        __m128i wx = _mm_blend_epi16(_mm_sub_epi16(c256, fx), fx, 0xf0);
+        __m128i t = _mm_mullo_epi16(p0, wx);
+        __m128i b = _mm_mullo_epi16(p1, wx);
+        t = _mm_cvtepu16_epi32(_mm_add_epi16(t, _mm_srli_si128(t, 8)));
+        b = _mm_cvtepu16_epi32(_mm_add_epi16(b, _mm_srli_si128(b, 8)));
+        int32_t fy = (v >> 8) & 0xff;
+        __m128i r = _mm_add_epi32(_mm_mullo_epi32(t, _mm_set1_epi32(256 - fy)), _mm_mullo_epi32(b, _mm_set1_epi32(fy)));
+        r = _mm_srli_epi32(_mm_add_epi32(r, round), 16);
+        r = _mm_packus_epi16(_mm_packus_epi32(r, r), r);
+        *d++ = (uint32_t)_mm_cvtsi128_si32(r);
+        u += du; v += dv;
+    }
+}
+
+TARGET_AVX2 static inline __m256i blend16Avx(__m256i s16, __m256i d16)
+{
+    const __m256i c255 = _mm256_set1_epi16(0xff);
+    const __m256i c128 = _mm256_set1_epi16(0x80);
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xff), 0xff);
+    __m256i ia = _mm256_sub_epi16(c255, a);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s16, a), _mm256_mullo_epi16(d16, ia));
+    t = _mm256_add_epi16(t, c128);
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET_AVX2 static void avx2StreamRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    if (reinterpret_cast<uintptr_t>(d) & 3) {
+        std::memcpy(d, s, n * sizeof(uint32_t));
+        return;
+    }
+    while (n && (reinterpret_cast<uintptr_t>(d) & 31)) {
+        *d++ = *s++; --n;
+    }
+    while (n >= 8) {
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(d), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s)));
+        s += 8; d += 8; n -= 8;
+    }
+    _mm_sfence();
+    while (n--) *d++ = *s++;
+}
+
+TARGET_AVX2 static void avx2FillRow(uint32_t *d, uint32_t px, size_t n)
+{
+    const __m256i v = _mm256_set1_epi32((int)px);
+    while (n >= 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(d), v);
+        d += 8; n -= 8;
+    }
+    while (n--) *d++ = px;
+}
+
+TARGET_AVX2 static void avx2KeyRow(uint32_t *d, const uint32_t *s, size_t n, uint32_t bg)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vbg = _mm256_set1_epi32((int)bg);
+    while (n >= 8) {
+        __m256i sp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+        __m256i m = _mm256_cmpeq_epi32(sp, zero);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(d), _mm256_blendv_epi8(sp, vbg, m));
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->keyRow(d, s, n, bg);
+}
+
+TARGET_AVX2 static void avx2BlendRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+    while (n >= 8) {
+        __m256i sp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+        __m256i sa = _mm256_and_si256(sp, amask);
+        if (!_mm256_testz_si256(sa, sa)) {
+            __m256i dp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(d));
+            __m256i r;
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, amask)) == -1) {
+                // all 8 source pixels are opaque
+                r = sp;
+            } else {
+                // unpack and pack both work within 128-bit lanes, so pixel order is preserved
+                __m256i lo = blend16Avx(_mm256_unpacklo_epi8(sp, zero), _mm256_unpacklo_epi8(dp, zero));
+                __m256i hi = blend16Avx(_mm256_unpackhi_epi8(sp, zero), _mm256_unpackhi_epi8(dp, zero));
+                r = _mm256_packus_epi16(lo, hi);
+            }
+            r = _mm256_blendv_epi8(r, dp, amask);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(d), r);
+        }
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->blendRow(d, s, n);
+}
+
+TARGET_AVX2 static inline __m256i scale16Avx(__m256i c16, __m256i a)
+{
+    const __m256i c128 = _mm256_set1_epi16(0x80);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(c16, a), c128);
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET_AVX2 static void avx2BlendPremulRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c255 = _mm256_set1_epi16(0xff);
+    const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+    while (n >= 8) {
+        __m256i sp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+        if (!_mm256_testz_si256(sp, sp)) {
+            __m256i r;
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(sp, amask), amask)) == -1) {
+                r = sp;
+            } else {
+                __m256i dp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(d));
+                __m256i slo = _mm256_unpacklo_epi8(sp, zero);
+                __m256i shi = _mm256_unpackhi_epi8(sp, zero);
+                __m256i ialo = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xff), 0xff));
+                __m256i iahi = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xff), 0xff));
+                __m256i lo = scale16Avx(_mm256_unpacklo_epi8(dp, zero), ialo);
+                __m256i hi = scale16Avx(_mm256_unpackhi_epi8(dp, zero), iahi);
+                r = _mm256_adds_epu8(sp, _mm256_packus_epi16(lo, hi));
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(d), r);
+        }
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->blendPremulRow(d, s, n);
+}
+
+TARGET_AVX2 static void avx2PremultiplyRow(uint32_t *d, const uint32_t *s, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+    while (n >= 8) {
+        __m256i sp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+        __m256i slo = _mm256_unpacklo_epi8(sp, zero);
+        __m256i shi = _mm256_unpackhi_epi8(sp, zero);
+        __m256i lo = scale16Avx(slo, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xff), 0xff));
+        __m256i hi = scale16Avx(shi, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xff), 0xff));
+        __m256i r = _mm256_blendv_epi8(_mm256_packus_epi16(lo, hi), sp, amask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(d), r);
+        s += 8; d += 8; n -= 8;
+    }
+    ScalarPixelKernels()->premultiplyRow(d, s, n);
+}
+
+TARGET_AVX2 static inline __m256i resampleRoundAvx(__m256i acc)
+{
+    return _mm256_srai_epi32(_mm256_add_epi32(acc, _mm256_set1_epi32(1 << (ResampleBits - 1))), ResampleBits);
+}
+
+TARGET_AVX2 static void avx2ResampleRowV(uint32_t *d, const uint32_t *const *rows, size_t n, const int16_t *w, unsigned taps)
+{
+    // the unpacks work within each 128-bit lane, so the accumulators hold pixels
+    // (0,4), (1,5), (2,6) and (3,7), and the packs put them back in order
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; (i + 8) <= n; i += 8) {
+        __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+        for (unsigned k = 0; k < taps; k += 2) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k] + i));
+            __m256i b = zero;
+            int16_t wb = 0;
+            if ((k + 1) < taps) {
+                b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k + 1] + i));
+                wb = w[k + 1];
+            }
+            __m256i wk = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)wb << 16) | (uint16_t)w[k]));
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), wk));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), wk));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), wk));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), wk));
+        }
+        __m256i p01 = _mm256_packs_epi32(resampleRoundAvx(acc0), resampleRoundAvx(acc1));
+        __m256i p23 = _mm256_packs_epi32(resampleRoundAvx(acc2), resampleRoundAvx(acc3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(d + i), _mm256_packus_epi16(p01, p23));
+    }
+    for (; i < n; ++i) {
+        d[i] = ResampleColumn(rows, i, w, taps);
+    }
+}
+
+static const PixelKernels sse41Kernels = {
+    "sse4.1",
+    copyRow,
+    sse41StreamRow,
+    sse41FillRow,
+    sse41KeyRow,
+    sse41BlendRow,
+    sse41BlendPremulRow,
+    sse41PremultiplyRow,
+    sse41BlendMaskRow,
+    sse41ToRgb565Row,
+    sse41FromRgb565Row,
+    sse41AlphaRow,
+    sse41ResampleRowH,
+    sse41ResampleRowV,
+    sse41BilinearRow
+};
+
+static const PixelKernels avx2Kernels = {
+    "avx2",
+    copyRow,
+    avx2StreamRow,
+    avx2FillRow,
+    avx2KeyRow,
+    avx2BlendRow,
+    avx2BlendPremulRow,
+    avx2PremultiplyRow,
+    // the mask, format conversion, horizontal resampling and bilinear kernels
+    // only have SSE4.1 versions
+    sse41BlendMaskRow,
+    sse41ToRgb565Row,
+    sse41FromRgb565Row,
+    sse41AlphaRow,
+    sse41ResampleRowH,
+    avx2ResampleRowV,
+    sse41BilinearRow
+};
+
+const PixelKernels* Sse41PixelKernels()
+{
+    return &sse41Kernels;
+}
+
+const PixelKernels* Avx2PixelKernels()
+{
+    return &avx2Kernels;
+}
+
+} // namespace navitab
+
+#else
+
+namespace navitab {
+
+const PixelKernels* Sse41PixelKernels()
+{
+    return nullptr;
+}
+
+const PixelKernels* Avx2PixelKernels()
+{
+    return nullptr;
+}
+
+} // namespace navitab
+
+#endif
@@ -1,139 +1,45 @@
 /* This file is part of the Navitab project. See the README and LICENSE for details. */
 
-#if 0
 #include "rasterizer.h"
+#include "navitab/tiles.h"
+#include "../docs/document.h"
 #include <fmt/core.h>
-#include <thread>
-#include <chrono>
+#include <mupdf/fitz.h>
 
 namespace navitab {
 
-Rasterizer::Rasterizer(const std::string &utf8Path)
-:   LOG(std::make_unique<logging::Logger>("rstrzr"))
+Rasterizer::Rasterizer(fz_context* ctx)
+:   LOG(std::make_unique<logging::Logger>("rstrzr")),
+    fzctx(ctx)
 {
-    initFitz();
-    loadFile(utf8Path);
 }
 
-Rasterizer::Rasterizer(const std::vector<uint8_t> &data, const std::string type)
-:   LOG(std::make_unique<logging::Logger>("rstrzr"))
+std::shared_ptr<RasterTile> Rasterizer::Render(Document& doc, unsigned page, float scaleX, float scaleY, int x, int y, unsigned w, unsigned h)
 {
-    initFitz();
-    loadMemory(data, type);
-}
-
-void Rasterizer::initFitz()
-{
-    // thread ID not formattable - LOGD(fmt::format("Init fitz in thread {}", std::this_thread::get_id()));
-    ctx = fz_new_context(nullptr, nullptr, FZ_STORE_UNLIMITED);
-    if (!ctx) {
-        throw std::runtime_error("Couldn't initialize fitz");
-    }
-
-    fz_try(ctx) {
-        fz_register_document_handlers(ctx);
-    } fz_catch(ctx) {
-        fz_drop_context(ctx);
-        throw std::runtime_error("Cannot register document handlers: " + std::string(fz_caught_message(ctx)));
-    }
-}
-
-void Rasterizer::loadFile(const std::string& file) {
-    fz_try(ctx) {
-        doc = fz_open_document(ctx, file.c_str());
-    } fz_catch(ctx) {
-        throw std::runtime_error("Cannot open document: " + std::string(fz_caught_message(ctx)));
-    }
-
-    loadDocument();
-}
-
-void Rasterizer::loadMemory(const std::vector<uint8_t> &data, const std::string type) {
-    dataBuf = data;
-    const char *mimeType(type.empty() ? "application/pdf" : type.c_str());
-
-    fz_try(ctx) {
-        stream = fz_open_memory(ctx, dataBuf.data(), dataBuf.size());
-        doc = fz_open_document_with_stream(ctx, mimeType, stream);
-    } fz_catch(ctx) {
-        if (stream) {
-            fz_drop_stream(ctx, stream);
-            stream = nullptr;
-        }
-        throw std::runtime_error("Cannot open document: " + std::string(fz_caught_message(ctx)));
-    }
-
-    loadDocument();
-}
-
-void Rasterizer::loadDocument() {
-    // thread ID not formattable - LOGI(fmt::format("Loading document in thread {}}", std::this_thread::get_id()));
-
-    fz_try(ctx) {
-        totalPages = fz_count_pages(ctx, doc);
-        LOGD(fmt::format("Document has {} pages", totalPages));
-    } fz_catch(ctx) {
-        fz_drop_document(ctx, doc);
-        throw std::runtime_error("Cannot count pages: " + std::string(fz_caught_message(ctx)));
+    if (!w) w = RasterTile::DefaultWidth;
+    if (!h) h = RasterTile::DefaultHeight;
+
+    // The tile's pixels are not cleared when it is allocated, since normally they
+    // are all rendered. It only needs clearing if some of it is outside the page.
+    auto tile = std::make_shared<RasterTile>(w, h, ImageAlloc::UNINITIALISED | ImageAlloc::PADDED);
+
+    // MuPDF pixmaps with an alpha channel always hold premultiplied pixels
+    tile->SetPremultiplied(true);
+
+    // The display list is shared by all of the threads rendering this page, and
+    // can be used without holding the document's lock.
+    fz_rect rect;
+    fz_display_list* list = doc.GetDisplayList(fzctx, page, rect);
+    if (!list) {
+        tile->Clear(0);
+        return tile;
     }
 
-    for (int i = 0; i < totalPages; i++) {
-        auto page = fz_load_page(ctx, doc, i);
-        if (!page) {
-            fz_drop_document(ctx, doc);
-            throw std::runtime_error("Couldn't load page");
-        }
-        auto rect = fz_bound_page(ctx, page);
-        pageRects.push_back(rect);
-        fz_drop_page(ctx, page);
-    }
+    int outStartX = w * x;
+    int outStartY = h * y;
 
-    LOGI("Document loaded");
-}
-
-int Rasterizer::getTileSize() {
-    return tileSize;
-}
-
-double Rasterizer::getAspectRatio(int page) {
-    auto &rect = pageRects.at(page);
-    return (rect.x1 - rect.x0) / (rect.y1 - rect.y0);
-}
-
-int Rasterizer::getPageWidth(int page, int zoom) {
-    bool swapXY = (preRotateAngle % 180) == 90;
-    auto &rect = pageRects.at(page);
-    int width = swapXY ? rect.y1 - rect.y0 : rect.x1 - rect.x0;
-    return width * zoomToScale(zoom);
-}
-
-int Rasterizer::getPageHeight(int page, int zoom) {
-    bool swapXY = (preRotateAngle % 180) == 90;
-    auto &rect = pageRects.at(page);
-    int height = swapXY ? rect.x1 - rect.x0 : rect.y1 - rect.y0;
-    return height * zoomToScale(zoom);
-}
-
-int Rasterizer::getPageCount() const {
-    return totalPages;
-}
-
-std::unique_ptr<ImageBuffer> Rasterizer::loadTile(int page, int x, int y, int zoom, bool nightMode) {
-    loadPage(page);
-
-    if (logLoadTimes) {
-        // thread ID not formattable - LOGI(fmt::format("Loading tile {}, {}, {}, {} in thread {}", page, x, y, zoom, std::this_thread::get_id()));
-    }
-
-    auto image = std::make_unique<ImageBuffer>(tileSize, tileSize);
-
-    int outStartX = tileSize * x;
-    int outStartY = tileSize * y;
-
-    int outWidth = image->Width();
-    int outHeight = image->Height();
-
-    float scale = zoomToScale(zoom);
+    int outWidth = w;
+    int outHeight = h;
 
     fz_irect clipBox;
     clipBox.x0 = outStartX;
@@ -141,144 +47,69 @@ std::unique_ptr<ImageBuffer> Rasterizer::loadTile(int page, int x, int y, int zo
     clipBox.y0 = outStartY;
     clipBox.y1 = outStartY + outHeight;
 
-    fz_pixmap *pix = nullptr;
-    fz_try(ctx) {
-        uint8_t *outBuf = (uint8_t *) image->Row(0);
-        pix = fz_new_pixmap_with_data(ctx, fz_device_bgr(ctx), outWidth, outHeight, nullptr, 1, outWidth * 4, outBuf);
+    fz_pixmap* pix = nullptr;
+    fz_try(fzctx) {
+        uint8_t* outBuf = (uint8_t*)tile->Row(0);
+        pix = fz_new_pixmap_with_data(fzctx, fz_device_rgb(fzctx), outWidth, outHeight, nullptr, 1, tile->Span() * 4, outBuf);
         pix->x = clipBox.x0;
         pix->y = clipBox.y0;
-        pix->xres = 72; // fz_bound_page returned pixels with 72 dpi
+        pix->xres = 72; // 72 is the normal resolution of MuPDF
         pix->yres = 72;
-    } fz_catch(ctx) {
-        throw std::runtime_error("Couldn't create pixmap: " + std::string(fz_caught_message(ctx)));
+    } fz_catch(fzctx) {
+        LOGE(fmt::format("MuPDF could not create pixmap. It reported {}", fz_caught_message(fzctx)));
+        fz_drop_display_list(fzctx, list);
+        tile->Clear(0);
+        return tile;
     }
 
-    fz_device *dev = nullptr;
-    fz_try(ctx) {
-        auto &rect = pageRects.at(currentPageNum);
+    fz_device* dev = nullptr;
+    fz_try(fzctx) {
         int currentPageWidth = rect.x1 - rect.x0;
         int currentPageHeight = rect.y1 - rect.y0;
-
-        auto startAt = std::chrono::steady_clock::now();
+        if ((clipBox.x1 > (int)(currentPageWidth * scaleX)) || (clipBox.y1 > (int)(currentPageHeight * scaleY))) {
+            tile->Clear(0);
+        }
 
         int translateX = 0, translateY = 0;
-        switch(preRotateAngle) {
-        case 0:
-            translateX = 0;
-            translateY = 0;
-            break;
-        case 90:
-            translateX = currentPageHeight * scale;
-            translateY = 0;
-            break;
-        case 180:
-            translateX = currentPageWidth * scale;
-            translateY = currentPageHeight * scale;
-            break;
-        case 270:
-            translateX = 0;
-            translateY = currentPageWidth * scale;
-            break;
-        default:
-            LOGE(fmt::format("Invalid preRotateAngle {}", preRotateAngle));
-            break;
-        }
 
-        fz_matrix scaleMatrix = fz_scale(scale, scale);
-        fz_matrix rotateMatrix = fz_rotate(preRotateAngle);
+        fz_matrix scaleMatrix = fz_scale(scaleX, scaleY);
+        fz_matrix rotateMatrix = fz_rotate(0);
         fz_matrix rotateAndScaleMatrix = fz_concat(scaleMatrix, rotateMatrix);
         fz_matrix translateMatrix = fz_translate(translateX, translateY);
         fz_matrix transformMatrix = fz_concat(rotateAndScaleMatrix, translateMatrix);
 
-        dev = fz_new_draw_device_with_bbox(ctx, transformMatrix, pix, &clipBox);
+        dev = fz_new_draw_device_with_bbox(fzctx, transformMatrix, pix, &clipBox);
 
         // pre-fill page with white
-        fz_path *path = fz_new_path(ctx);
-        fz_moveto(ctx, path, 0, 0);
-        fz_lineto(ctx, path, 0, currentPageHeight);
-        fz_lineto(ctx, path, currentPageWidth, currentPageHeight);
-        fz_lineto(ctx, path, currentPageWidth, 0);
-        fz_closepath(ctx, path);
+        fz_path* path = fz_new_path(fzctx);
+        fz_moveto(fzctx, path, 0, 0);
+        fz_lineto(fzctx, path, 0, currentPageHeight);
+        fz_lineto(fzctx, path, currentPageWidth, currentPageHeight);
+        fz_lineto(fzctx, path, currentPageWidth, 0);
+        fz_closepath(fzctx, path);
         float white = 1.0f;
-        if (nightMode) {
-            white = 0.6f;
-        }
-        fz_fill_path(ctx, dev, path, 0, fz_identity, fz_device_gray(ctx), &white, 1.0f, fz_default_color_params);
-        fz_drop_path(ctx, path);
+        fz_fill_path(fzctx, dev, path, 0, fz_identity, fz_device_gray(fzctx), &white, 1.0f, fz_default_color_params);
+        fz_drop_path(fzctx, path);
 
         fz_rect pageRect;
         pageRect.x0 = 0;
         pageRect.y0 = 0;
         pageRect.x1 = currentPageWidth;
         pageRect.y1 = currentPageHeight;
-        fz_run_display_list(ctx, currentPageList, dev, fz_identity, pageRect, nullptr);
-        fz_close_device(ctx, dev);
-        fz_drop_device(ctx, dev);
-
-        if (logLoadTimes) {
-            auto endAt = std::chrono::steady_clock::now();
-            auto dur = std::chrono::duration_cast<std::chrono::milliseconds>(endAt - startAt).count();
-            LOGI(fmt::format("Tile loaded in {} millis", dur));
-        }
-    } fz_catch(ctx) {
+        fz_run_display_list(fzctx, list, dev, fz_identity, pageRect, nullptr);
+        fz_close_device(fzctx, dev);
+        fz_drop_device(fzctx, dev);
+    } fz_catch(fzctx) {
         if (dev) {
-            fz_drop_device(ctx, dev);
+            fz_drop_device(fzctx, dev);
         }
-        fz_drop_pixmap(ctx, pix);
-        throw std::runtime_error("Couldn't render page: " + std::string(fz_caught_message(ctx)));
-    }
-
-    if (pix) {
-        fz_drop_pixmap(ctx, pix);
+        tile->Clear(0);
+        LOGE(fmt::format("MuPDF could not render. It reported {}", fz_caught_message(fzctx)));
     }
 
-    return image;
-}
-
-void Rasterizer::loadPage(int page) {
-    if (page == currentPageNum && currentPageList != nullptr) {
-        return;
-    }
-
-    freeCurrentPage();
-
-    // thread ID not formattable - LOGD(fmt::format("Loading page {} in thread {}", (int)page, std::this_thread::get_id()));
-
-    fz_try(ctx) {
-        currentPageList = fz_new_display_list_from_page_number(ctx, doc, page);
-        currentPageNum = page;
-    } fz_catch(ctx) {
-        throw std::runtime_error("Cannot parse page: " + std::string(fz_caught_message(ctx)));
-    }
-
-    LOGD(fmt::format("Page {} rasterized", currentPageNum));
-}
-
-float Rasterizer::zoomToScale(int zoom) const {
-    return std::pow(M_SQRT2, zoom);
-}
-
-void Rasterizer::freeCurrentPage() {
-    if (currentPageList) {
-        fz_drop_display_list(ctx, currentPageList);
-        currentPageList = nullptr;
-    }
-}
-
-void Rasterizer::setPreRotate(int angle) {
-    preRotateAngle = angle;
-}
-
-Rasterizer::~Rasterizer() {
-    freeCurrentPage();
-    fz_drop_document(ctx, doc);
-    if (stream) {
-        fz_drop_stream(ctx, stream);
-    }
-    fz_drop_context(ctx);
+    fz_drop_pixmap(fzctx, pix);
+    fz_drop_display_list(fzctx, list);
+    return tile;
 }
 
 } // namespace navitab
-
-
-#endif
\ No newline at end of file
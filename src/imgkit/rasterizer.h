@@ -2,52 +2,35 @@
 
 #pragma once
 
-#include "navitab/window.h"
 #include "navitab/logger.h"
 #include <memory>
-#include <vector>
-#include <string>
-#include <mupdf/fitz.h>
 
-namespace navitab {
+// This header file defines the Rasterizer, which draws a tile from a page of
+// a document. Each thread that renders tiles needs its own Rasterizer, using
+// a MuPDF context that belongs to that thread.
 
-class Rasterizer {
-public:
-    Rasterizer(const std::string &utf8Path);
-    Rasterizer(const std::vector<uint8_t> &data, const std::string type);
+struct fz_context;
+
+namespace navitab {
 
-    int getTileSize();
-    int getPageWidth(int page, int zoom);
-    int getPageHeight(int page, int zoom);
-    double getAspectRatio(int page);
-    std::unique_ptr<ImageBuffer> loadTile(int page, int x, int y, int zoom, bool nightMode);
-    void setPreRotate(int angle);
+class Document;
+class RasterTile;
 
-    int getPageCount() const;
+class Rasterizer
+{
+public:
+    // The context is not owned by the rasterizer, and must outlive it.
+    Rasterizer(fz_context* ctx);
+    ~Rasterizer() = default;
 
-    virtual ~Rasterizer();
+    // Render the (x,y)th tile, of size w x h, of the document's page after it has
+    // been scaled by scaleX, scaleY. A default sized tile is produced if w or h
+    // is 0. A blank tile is returned if the page can't be rendered.
+    std::shared_ptr<RasterTile> Render(Document& doc, unsigned page, float scaleX, float scaleY, int x, int y, unsigned w = 0, unsigned h = 0);
 
 private:
     std::unique_ptr<logging::Logger> LOG;
-    std::vector<uint8_t> dataBuf;
-    std::vector<fz_rect> pageRects;
-    bool logLoadTimes = false;
-    int tileSize = 1024;
-    int totalPages = 0;
-    int currentPageNum = 0;
-    int preRotateAngle = 0;
-    fz_stream *stream{};
-    fz_document *doc{};
-    fz_display_list *currentPageList {};
-
-    void initFitz();
-    void loadFile(const std::string &file);
-    void loadMemory(const std::vector<uint8_t> &data, const std::string type);
-    void loadDocument();
-    void loadPage(int page);
-    float zoomToScale(int zoom) const;
-    void freeCurrentPage();
+    fz_context* const fzctx;
 };
 
 } // namespace navitab
-
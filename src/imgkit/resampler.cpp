@@ -0,0 +1,266 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "resampler.h"
+#include "pixelkernels.h"
+#include <algorithm>
+#include <cmath>
+
+namespace navitab {
+
+AffineTransform AffineTransform::Identity()
+{
+    return AffineTransform{ 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f };
+}
+
+AffineTransform AffineTransform::Translate(float tx, float ty)
+{
+    return AffineTransform{ 1.0f, 0.0f, tx, 0.0f, 1.0f, ty };
+}
+
+AffineTransform AffineTransform::Scale(float sx, float sy)
+{
+    return AffineTransform{ sx, 0.0f, 0.0f, 0.0f, sy, 0.0f };
+}
+
+AffineTransform AffineTransform::Rotate(float radians)
+{
+    float c = std::cos(radians);
+    float s = std::sin(radians);
+    return AffineTransform{ c, -s, 0.0f, s, c, 0.0f };
+}
+
+AffineTransform AffineTransform::Then(const AffineTransform& n) const
+{
+    return AffineTransform{
+        n.a * a + n.b * d, n.a * b + n.b * e, n.a * c + n.b * f + n.c,
+        n.d * a + n.e * d, n.d * b + n.e * e, n.d * c + n.e * f + n.f
+    };
+}
+
+AffineTransform AffineTransform::Inverse() const
+{
+    float det = a * e - b * d;
+    if (std::fabs(det) < 1e-12f) return AffineTransform{ 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    AffineTransform r;
+    r.a = e / det;
+    r.b = -b / det;
+    r.d = -d / det;
+    r.e = a / det;
+    r.c = -(r.a * c + r.b * f);
+    r.f = -(r.d * c + r.e * f);
+    return r;
+}
+
+void AffineTransform::Apply(float x, float y, float& ox, float& oy) const
+{
+    ox = a * x + b * y + c;
+    oy = d * x + e * y + f;
+}
+
+static double filterRadius(ResampleFilter f)
+{
+    return (f == ResampleFilter::LANCZOS3) ? 3.0 : 1.0;
+}
+
+static double filterValue(ResampleFilter f, double x)
+{
+    x = std::fabs(x);
+    if (f == ResampleFilter::BILINEAR) {
+        return (x < 1.0) ? (1.0 - x) : 0.0;
+    }
+    if (x < 1e-6) return 1.0;
+    if (x >= 3.0) return 0.0;
+    const double px = 3.14159265358979323846 * x;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+Resampler::Resampler(ResampleFilter f)
+:   filter(f),
+    xWeights{ 0, 0, 0.0f, 0.0f, 0, {}, {} },
+    yWeights{ 0, 0, 0.0f, 0.0f, 0, {}, {} }
+{
+}
+
+const Resampler::AxisWeights& Resampler::GetWeights(AxisWeights& aw, unsigned srcLen, float offset, float extent, unsigned dstLen)
+{
+    if ((aw.srcLen != srcLen) || (aw.dstLen != dstLen) || (aw.offset != offset) || (aw.extent != extent)) {
+        aw.srcLen = srcLen;
+        aw.dstLen = dstLen;
+        aw.offset = offset;
+        aw.extent = extent;
+        ComputeWeights(aw);
+    }
+    return aw;
+}
+
+void Resampler::ComputeWeights(AxisWeights& aw)
+{
+    // When downscaling the filter is stretched to cover all of the source pixels
+    // that contribute to each output pixel, otherwise pixels would be skipped.
+    const double scale = aw.dstLen / (double)aw.extent;
+    const double fscale = std::max(1.0, 1.0 / scale);
+    const double support = filterRadius(filter) * fscale;
+    aw.taps = std::min((unsigned)std::ceil(support * 2.0) + 1, aw.srcLen);
+    aw.starts.resize(aw.dstLen);
+    aw.weights.assign((size_t)aw.dstLen * aw.taps, 0);
+
+    const int last = (int)aw.srcLen - 1;
+    std::vector<double> fw(aw.taps);
+    for (unsigned i = 0; i < aw.dstLen; ++i) {
+        double centre = aw.offset + (i + 0.5) / scale - 0.5;
+        int lo = (int)std::ceil(centre - support);
+        int hi = (int)std::floor(centre + support);
+        int start = std::min(std::max(lo, 0), last);
+        start = std::min(start, (int)(aw.srcLen - aw.taps));
+        aw.starts[i] = start;
+
+        // source pixels beyond the edges are clamped, so their weights are added
+        // to the edge pixels
+        std::fill(fw.begin(), fw.end(), 0.0);
+        double total = 0.0;
+        for (int j = lo; j <= hi; ++j) {
+            double w = filterValue(filter, (j - centre) / fscale);
+            int k = std::min(std::max(j, 0), last) - start;
+            fw[k] += w;
+            total += w;
+        }
+        if (total == 0.0) {
+            int k = std::min(std::max((int)std::lround(centre), 0), last) - start;
+            fw[k] = total = 1.0;
+        }
+
+        // quantise, putting any rounding error on the largest weight so that they
+        // still sum to exactly 1.0
+        int16_t* iw = &aw.weights[(size_t)i * aw.taps];
+        int sum = 0;
+        unsigned kmax = 0;
+        for (unsigned k = 0; k < aw.taps; ++k) {
+            iw[k] = (int16_t)std::lround(fw[k] / total * (1 << ResampleBits));
+            sum += iw[k];
+            if (fw[k] > fw[kmax]) kmax = k;
+        }
+        iw[kmax] = (int16_t)(iw[kmax] + ((1 << ResampleBits) - sum));
+    }
+}
+
+void Resampler::Scale(PixelBuffer& dst, const PixelBuffer& src, float srcX, float srcY, float srcW, float srcH)
+{
+    const unsigned dw = dst.Width();
+    const unsigned dh = dst.Height();
+    if (!dw || !dh || !src.Width() || !src.Height() || (srcW <= 0.0f) || (srcH <= 0.0f)) return;
+
+    auto& xw = GetWeights(xWeights, src.Width(), srcX, srcW, dw);
+    auto& yw = GetWeights(yWeights, src.Height(), srcY, srcH, dh);
+    auto& k = PixelKernelSet();
+
+    // horizontal pass, on just the source rows that the vertical pass will use
+    const unsigned firstRow = yw.starts.front();
+    const unsigned numRows = yw.starts.back() + yw.taps - firstRow;
+    work.resize((size_t)numRows * dw);
+    for (unsigned r = 0; r < numRows; ++r) {
+        k.resampleRowH(&work[(size_t)r * dw], src.Row(firstRow + r), dw, xw.starts.data(), xw.weights.data(), xw.taps);
+    }
+
+    // vertical pass, straight into the destination
+    rowPtrs.resize(yw.taps);
+    for (unsigned y = 0; y < dh; ++y) {
+        for (unsigned t = 0; t < yw.taps; ++t) {
+            rowPtrs[t] = &work[(size_t)(yw.starts[y] - firstRow + t) * dw];
+        }
+        k.resampleRowV(dst.Row(y), rowPtrs.data(), dw, &yw.weights[(size_t)y * yw.taps], yw.taps);
+    }
+    dst.SetPremultiplied(src.Premultiplied());
+}
+
+void Resampler::Scale(PixelBuffer& dst, const PixelBuffer& src)
+{
+    Scale(dst, src, 0.0f, 0.0f, (float)src.Width(), (float)src.Height());
+}
+
+const PixelBuffer* TileGrid::At(int col, int row) const
+{
+    if ((col < 0) || (row < 0) || (col >= (int)cols) || (row >= (int)rows)) return nullptr;
+    return tiles[row * cols + col];
+}
+
+static inline int floorDiv(int a, int b)
+{
+    return (a >= 0) ? (a / b) : -((b - 1 - a) / b);
+}
+
+void Resampler::Transform(PixelBuffer& dst, const PixelBuffer& src, const AffineTransform& m)
+{
+    TileGrid grid;
+    grid.tileW = src.Width();
+    grid.tileH = src.Height();
+    grid.cols = 1;
+    grid.rows = 1;
+    grid.tiles.push_back(&src);
+    Transform(dst, grid, m);
+}
+
+void Resampler::Transform(PixelBuffer& dst, const TileGrid& grid, const AffineTransform& m)
+{
+    const int tw = (int)grid.tileW;
+    const int th = (int)grid.tileH;
+    if (!tw || !th || (grid.tiles.size() < (size_t)grid.cols * grid.rows)) return;
+    const AffineTransform inv = m.Inverse();
+    auto& k = PixelKernelSet();
+
+    // any pixel that isn't in a tile is transparent
+    auto pixel = [&](int x, int y) -> uint32_t {
+        int col = floorDiv(x, tw);
+        int row = floorDiv(y, th);
+        auto t = grid.At(col, row);
+        return t ? t->Row(y - row * th)[x - col * tw] : 0;
+    };
+
+    // source coordinates are stepped across each row in 16.16 fixed point,
+    // offset by half a pixel so that the sample points are pixel centres
+    const int32_t du = (int32_t)std::lround(inv.a * 65536.0f);
+    const int32_t dv = (int32_t)std::lround(inv.d * 65536.0f);
+    const unsigned w = dst.Width();
+    for (unsigned y = 0; y < dst.Height(); ++y) {
+        float sx, sy;
+        inv.Apply(0.5f, y + 0.5f, sx, sy);
+        int32_t u = (int32_t)std::lround((sx - 0.5f) * 65536.0f);
+        int32_t v = (int32_t)std::lround((sy - 0.5f) * 65536.0f);
+        uint32_t* d = dst.Row(y);
+        unsigned x = 0;
+        while (x < w) {
+            const int ix = u >> 16;
+            const int iy = v >> 16;
+            const int col = floorDiv(ix, tw);
+            const int row = floorDiv(iy, th);
+            auto t = grid.At(col, row);
+            if (t && ((ix - col * tw) < (tw - 1)) && ((iy - row * th) < (th - 1))) {
+                // find the run of pixels whose samples are all inside this tile, and
+                // do them in one go
+                unsigned n = 1;
+                int32_t un = u + du;
+                int32_t vn = v + dv;
+                while ((x + n) < w) {
+                    int lx = (un >> 16) - col * tw;
+                    int ly = (vn >> 16) - row * th;
+                    if ((lx < 0) || (ly < 0) || (lx >= (tw - 1)) || (ly >= (th - 1))) break;
+                    ++n; un += du; vn += dv;
+                }
+                k.bilinearRow(d + x, n, t->Row(0), t->Span(), u - ((col * tw) << 16), v - ((row * th) << 16), du, dv);
+                x += n; u = un; v = vn;
+            } else {
+                // the sample straddles tiles, or is outside them all
+                d[x] = BilinearPixel(pixel(ix, iy), pixel(ix + 1, iy), pixel(ix, iy + 1), pixel(ix + 1, iy + 1), (u >> 8) & 0xff, (v >> 8) & 0xff);
+                ++x; u += du; v += dv;
+            }
+        }
+    }
+
+    for (auto t : grid.tiles) {
+        if (t) {
+            dst.SetPremultiplied(t->Premultiplied());
+            break;
+        }
+    }
+}
+
+} // namespace navitab
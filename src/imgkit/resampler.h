@@ -0,0 +1,110 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "navitab/pixelbuffer.h"
+
+// This header file defines the Resampler, which scales regions of RGBA8888
+// pixel buffers, for fractional zoom, overzooming beyond a tile server's
+// maximum zoom level, thumbnails and high-DPI panels. Scaling is done as two
+// separable passes (horizontal then vertical) using fixed point weight tables
+// that are computed once and reused while the geometry is unchanged. Affine
+// transforms (eg rotation) are done by bilinear sampling.
+//
+// The filters should be given premultiplied pixels if there is any variation
+// in alpha, otherwise transparent pixels will bleed their colour into their
+// neighbours. A Resampler holds working storage and must only be used by one
+// thread at a time.
+
+namespace navitab {
+
+enum class ResampleFilter
+{
+    BILINEAR,   // triangle filter, fast, a little soft when upscaling
+    LANCZOS3    // windowed sinc, sharp, best for downscaling and thumbnails
+};
+
+// A 2D affine transform mapping (x, y) to (a*x + b*y + c, d*x + e*y + f).
+struct AffineTransform
+{
+    float a, b, c;
+    float d, e, f;
+
+    static AffineTransform Identity();
+    static AffineTransform Translate(float tx, float ty);
+    static AffineTransform Scale(float sx, float sy);
+    static AffineTransform Rotate(float radians);   // clockwise, since y is down
+
+    // The transform that applies this one and then next.
+    AffineTransform Then(const AffineTransform& next) const;
+
+    // The inverse transform. A singular transform gives all zeros.
+    AffineTransform Inverse() const;
+
+    void Apply(float x, float y, float& ox, float& oy) const;
+};
+
+// A grid of equally sized tiles (eg map tiles) that form one large image, with
+// the tiles held in row order. Missing tiles can be nullptr, and are transparent.
+struct TileGrid
+{
+    unsigned tileW, tileH;
+    unsigned cols, rows;
+    std::vector<const PixelBuffer*> tiles;
+
+    const PixelBuffer* At(int col, int row) const;
+};
+
+class Resampler
+{
+public:
+    Resampler(ResampleFilter filter = ResampleFilter::LANCZOS3);
+    ~Resampler() = default;
+
+    // Scale the region of src at (srcX, srcY) of size srcW x srcH to fill the
+    // whole of dst. The region can have fractional coordinates, and pixels
+    // beyond the edges of src are taken to repeat the edge pixels.
+    void Scale(PixelBuffer& dst, const PixelBuffer& src, float srcX, float srcY, float srcW, float srcH);
+    void Scale(PixelBuffer& dst, const PixelBuffer& src);
+
+    // Fill dst by mapping each of its pixels through m to a point in src, and
+    // sampling it bilinearly. Points outside src give transparent pixels. Only
+    // use this for scale factors down to about 0.5, for smaller images Scale()
+    // the source first.
+    void Transform(PixelBuffer& dst, const PixelBuffer& src, const AffineTransform& m);
+
+    // As above, but sampling directly from a grid of tiles, so that they don't have
+    // to be assembled into one image first. The transform maps the grid's pixel
+    // coordinates (from the top-left of the first tile) to dst.
+    void Transform(PixelBuffer& dst, const TileGrid& grid, const AffineTransform& m);
+
+private:
+    // The weights for one axis of a scaling operation. Every output pixel uses
+    // the same number of taps, starting at its own position in the source.
+    struct AxisWeights
+    {
+        unsigned srcLen, dstLen;
+        float offset, extent;
+        unsigned taps;
+        std::vector<int32_t> starts;
+        std::vector<int16_t> weights;
+    };
+
+    const AxisWeights& GetWeights(AxisWeights& cached, unsigned srcLen, float offset, float extent, unsigned dstLen);
+    void ComputeWeights(AxisWeights& aw);
+
+private:
+    const ResampleFilter filter;
+
+    // the most recently used weights, which are reused for every tile at a zoom level
+    AxisWeights xWeights;
+    AxisWeights yWeights;
+
+    // the horizontally scaled source rows, and the pointers to them for one output row
+    std::vector<uint32_t> work;
+    std::vector<const uint32_t*> rowPtrs;
+};
+
+} // namespace navitab
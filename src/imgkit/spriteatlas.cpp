@@ -0,0 +1,19 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "spriteatlas.h"
+
+namespace navitab {
+
+SpriteAtlas::SpriteAtlas(unsigned w, unsigned h, unsigned count)
+:   cellW(w),
+    cellH(h),
+    image(w, h * count)
+{
+    sprites.reserve(count);
+    for (unsigned i = 0; i < count; ++i) {
+        sprites.emplace_back(cellW, cellH, image.PixAt(i * cellH, 0));
+        sprites.back().SetPremultiplied(true);
+    }
+}
+
+} // namespace navitab
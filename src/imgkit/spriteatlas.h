@@ -0,0 +1,36 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <vector>
+#include "navitab/pixelbuffer.h"
+
+// This header file defines the SpriteAtlas, which holds a set of equally sized
+// sprites (eg icons at each heading) in a single contiguous image. The sprites
+// are drawn once, normally at startup, and then only need an index to find
+// them when they are blended onto the canvas on each frame.
+
+namespace navitab {
+
+class SpriteAtlas
+{
+public:
+    // The sprites are stacked vertically, so each one's pixels are contiguous.
+    // All of the sprites are initially transparent.
+    SpriteAtlas(unsigned cellWidth, unsigned cellHeight, unsigned count);
+    ~SpriteAtlas() = default;
+
+    unsigned Count() const { return (unsigned)sprites.size(); }
+    unsigned CellWidth() const { return cellW; }
+    unsigned CellHeight() const { return cellH; }
+
+    // The sprite's pixels, for drawing into the sprite or drawing the sprite.
+    PixelBuffer& Sprite(unsigned i) { return sprites[i]; }
+
+private:
+    const unsigned cellW, cellH;
+    ImageBuffer image;
+    std::vector<PixelBuffer> sprites;
+};
+
+} // namespace navitab
@@ -0,0 +1,138 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include <cstring>
+#include <fmt/core.h>
+#include "tilepool.h"
+#include "navitab/tiles.h"
+
+namespace navitab {
+
+// Tiles are allocated uninitialised by the pool, and are only cleared on request.
+static const unsigned kPoolAllocFlags = ImageAlloc::UNINITIALISED;
+
+std::shared_ptr<TilePool> TilePool::GetTilePool()
+{
+    // The TilePool uses a singleton pattern, and is created on first use
+    static std::shared_ptr<TilePool> me(new TilePool());
+    return me;
+}
+
+TilePool::TilePool()
+:   LOG(std::make_unique<logging::Logger>("tilepool")),
+    highWaterMark(kDefaultHighWaterMark),
+    stats()
+{
+}
+
+TilePool::~TilePool()
+{
+    Trim();
+}
+
+void* TilePool::Acquire(size_t bytes, bool zeroed)
+{
+    void *p = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& fl = freeLists[bytes];
+        if (!fl.empty()) {
+            p = fl.back();
+            fl.pop_back();
+            --stats.free;
+            stats.freeBytes -= bytes;
+            ++stats.reuses;
+        } else {
+            ++stats.allocations;
+        }
+        if (++stats.inUse > stats.peakInUse) stats.peakInUse = stats.inUse;
+    }
+    if (!p) {
+        p = AllocImageStorage(bytes, kPoolAllocFlags);
+    }
+    if (zeroed) std::memset(p, 0, bytes);
+    return p;
+}
+
+void TilePool::Release(void *p, size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --stats.inUse;
+        auto& fl = freeLists[bytes];
+        if (fl.size() < highWaterMark) {
+            fl.push_back(p);
+            ++stats.free;
+            stats.freeBytes += bytes;
+            return;
+        }
+        ++stats.discards;
+    }
+    FreeImageStorage(p, bytes, kPoolAllocFlags);
+}
+
+void TilePool::SetHighWaterMark(unsigned maxFree)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    LOGI(fmt::format("Keeping up to {} free tile buffers of each size", maxFree));
+    highWaterMark = maxFree;
+    for (auto& fl : freeLists) {
+        while (fl.second.size() > highWaterMark) {
+            FreeImageStorage(fl.second.back(), fl.first, kPoolAllocFlags);
+            fl.second.pop_back();
+            --stats.free;
+            stats.freeBytes -= fl.first;
+            ++stats.discards;
+        }
+    }
+}
+
+TilePool::Stats TilePool::GetStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void TilePool::Trim()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& fl : freeLists) {
+        for (auto p : fl.second) {
+            FreeImageStorage(p, fl.first, kPoolAllocFlags);
+        }
+        fl.second.clear();
+    }
+    stats.free = 0;
+    stats.freeBytes = 0;
+}
+
+// RasterTiles always have padded rows, and get their storage from the TilePool.
+
+static unsigned tileSpan(unsigned w)
+{
+    return (w + 15) & ~15u;
+}
+
+static uint32_t* acquireTileStorage(unsigned w, unsigned h, unsigned allocFlags)
+{
+    size_t bytes = (size_t)tileSpan(w) * h * sizeof(uint32_t);
+    bool zeroed = !(allocFlags & ImageAlloc::UNINITIALISED);
+    return static_cast<uint32_t *>(TilePool::GetTilePool()->Acquire(bytes, zeroed));
+}
+
+RasterTile::RasterTile(unsigned w, unsigned h, unsigned allocFlags)
+:   ImageBuffer(w, h, tileSpan(w), acquireTileStorage(w, h, allocFlags)),
+    pool(TilePool::GetTilePool())
+{
+}
+
+RasterTile::RasterTile()
+:   RasterTile(DefaultWidth, DefaultHeight)
+{
+}
+
+RasterTile::~RasterTile()
+{
+    pool->Release(Row(0), Bytes());
+}
+
+} // namespace navitab
@@ -0,0 +1,72 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "navitab/logger.h"
+
+// This header file defines the pool that recycles the pixel storage for
+// RasterTiles. Tiles are created and dropped at a high rate as the map is
+// scrolled and zoomed, and all have the same few sizes, so reusing their
+// storage avoids fragmenting the heap (especially inside the simulator's
+// process, which we share with everyone else).
+
+namespace navitab {
+
+// Aligned image storage, as used by ImageBuffers. See pixelbuffer.cpp.
+void* AllocImageStorage(size_t bytes, unsigned allocFlags);
+void FreeImageStorage(void *p, size_t bytes, unsigned allocFlags);
+
+class TilePool
+{
+public:
+    // The TilePool is a singleton, created on first use.
+    static std::shared_ptr<TilePool> GetTilePool();
+
+    ~TilePool();
+
+    // Get storage of the given size, either recycled or newly allocated. The
+    // storage is cleared to 0 only if requested.
+    void* Acquire(size_t bytes, bool zeroed);
+
+    // Return storage to the pool. If the pool already holds its high-water mark
+    // of free buffers then the storage is freed instead.
+    void Release(void *p, size_t bytes);
+
+    // Set the maximum number of free buffers kept for reuse (of each size).
+    void SetHighWaterMark(unsigned maxFree);
+
+    // Enough free buffers to refill a large canvas after a zoom change.
+    static const unsigned kDefaultHighWaterMark = 64;
+
+    struct Stats {
+        unsigned inUse;         // buffers currently held by tiles
+        unsigned peakInUse;     // most buffers held by tiles at any one time
+        unsigned free;          // buffers in the pool waiting to be reused
+        size_t freeBytes;       // total size of the free buffers
+        uint64_t allocations;   // number of buffers newly allocated
+        uint64_t reuses;        // number of buffers recycled from the pool
+        uint64_t discards;      // number of buffers freed due to the high-water mark
+    };
+    Stats GetStats();
+
+    // Free all of the buffers that are waiting in the pool.
+    void Trim();
+
+private:
+    TilePool();
+
+private:
+    std::unique_ptr<logging::Logger> LOG;
+    std::mutex mutex;
+    std::map<size_t, std::vector<void *>> freeLists;
+    unsigned highWaterMark;
+    Stats stats;
+};
+
+} // namespace navitab
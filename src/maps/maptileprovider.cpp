@@ -7,17 +7,28 @@
 #include "navitab/tiles.h"
 #include "../docs/docmanager.h"
 #include "../docs/document.h"
+#include "../imgkit/imgkit.h"
+#include "../store/backingstore.h"
 #include <fmt/core.h>
 #include <nlohmann/json.hpp>
 #include <cmath>
+#include <ctime>
 
 
 namespace navitab {
 
-MapTileProvider::MapTileProvider(std::shared_ptr<PathServices> ps, std::shared_ptr<Settings> prefs, std::shared_ptr<DocumentManager> d)
+MapTileProvider::MapTileProvider(std::shared_ptr<PathServices> ps, std::shared_ptr<Settings> prefs, std::shared_ptr<DocumentManager> d, std::shared_ptr<ImagingKit> ik, std::shared_ptr<BackingStore> bs)
 :   LOG(std::make_unique<logging::Logger>("maps")),
     docMgr(d),
+    imgKit(ik),
+    store(bs),
+    tileCache(kDefaultCacheMB << 20),
+    upscaler(ResampleFilter::BILINEAR),
+    focus(0.0, 0.0),
+    rendered(std::make_shared<RenderedTiles>()),
+    stored(std::make_shared<StoredTiles>()),
     missingTile(nullptr),
+    onScreenMisses(0),
     zoom(8)
 {
     std::filesystem::path cfg = ps->DataFilesPath();
@@ -35,8 +46,40 @@ MapTileProvider::MapTileProvider(std::shared_ptr<PathServices> ps, std::shared_p
         prefs->Put("/maps", mtp);
     }
     smapConfig = providerCfg->GetConfig(preferred);
+    providerName = preferred;
+
+    // local archives provide their own zoom range
+    if (!smapConfig->archive.empty()) {
+        archive = TileArchive::Open(smapConfig->archive);
+        if (!archive) {
+            LOGE(fmt::format("Unable to open tile archive {}, maps will be blank", smapConfig->archive));
+        } else if (archive->MaxZoom() > 0) {
+            smapConfig->minZoomLevel = archive->MinZoom();
+            smapConfig->maxZoomLevel = archive->MaxZoom();
+        }
+    }
+
+    // tiles downloaded in previous runs are kept in the backing store, along with
+    // the provider's details in the MBTiles metadata
+    storedFormat = store->GetTileMetadata(providerName, "format");
+    storedType = TileFormatMimeType(storedFormat);
+    store->StoreTileMetadata(providerName, "name", providerName);
+    store->StoreTileMetadata(providerName, "attribution", smapConfig->copyright);
+    store->StoreTileMetadata(providerName, "minzoom", std::to_string(smapConfig->minZoomLevel));
+    store->StoreTileMetadata(providerName, "maxzoom", std::to_string(smapConfig->maxZoomLevel));
+
+    // the cache holds tiles from several zoom levels, up to a memory budget
+    unsigned cacheMB = kDefaultCacheMB;
+    try {
+        cacheMB = mtp.at("/tilecachemb"_json_pointer);
+    }
+    catch (...) {
+        mtp["tilecachemb"] = cacheMB;
+        prefs->Put("/maps", mtp);
+    }
+    tileCache.SetBudget((size_t)cacheMB << 20);
     
-    missingTile = std::make_shared<RasterTile>();
+    missingTile = std::make_shared<RasterTile>(RasterTile::DefaultWidth, RasterTile::DefaultHeight, ImageAlloc::UNINITIALISED);
     for (unsigned r = 0; r < missingTile->Height(); ++r) {
         uint32_t *rs = missingTile->Row(r);
         for (unsigned c = 0; c < missingTile->Width(); ++c) {
@@ -44,24 +87,46 @@ MapTileProvider::MapTileProvider(std::shared_ptr<PathServices> ps, std::shared_p
             *(rs + c) = dark ? 0xff606060 : 0xffd0d0d0;
         }
     }
+    missingTile->Premultiply();
 }
 
 MapTileProvider::~MapTileProvider()
 {
+    imgKit->Cancel(this);
+    auto s = tileCache.GetStats();
+    LOGS(fmt::format("Tile cache: {} tiles, {} bytes, {} hits, {} misses, {} evictions",
+                s.entries, s.bytes, s.hits, s.misses, s.evictions));
 }
 
 void MapTileProvider::MaintenanceTick()
 {
-    // called periodically so that the maps provider can drop tiles from
-    // the cache if they are not being used.
-    auto ci = tileCache.begin();
-    while (ci != tileCache.end()) {
-        auto uc = --(ci->second.useCount);
-        // remove from the cache if unused for some time.
-        if (uc < 0) {
-            tileCache.erase(ci++);
+    // called periodically. the tile cache evicts the least recently used tiles
+    // as new ones are added, so only the hashes of tiles that have gone need
+    // tidying up.
+    auto si = sharedTiles.begin();
+    while (si != sharedTiles.end()) {
+        if (si->second.tile.expired()) {
+            si = sharedTiles.erase(si);
         } else {
-            ++ci;
+            ++si;
+        }
+    }
+}
+
+void MapTileProvider::SetFocus(const std::pair<double, double>& tyx)
+{
+    focus = tyx;
+
+    // documents that are still being fetched for tiles that have scrolled off the
+    // screen are cancelled, unless they are being prefetched
+    auto fi = fetchingTiles.begin();
+    while (fi != fetchingTiles.end()) {
+        if (!fi->second.wanted && !fi->second.background) {
+            docMgr->CancelFetch(fi->second.url);
+            fi = fetchingTiles.erase(fi);
+        } else {
+            fi->second.wanted = false;
+            ++fi;
         }
     }
 }
@@ -79,37 +144,336 @@ std::shared_ptr<RasterTile> MapTileProvider::GetTile(double ty, double tx)
     while (x >= xn) x -= xn;
 
     // do we have the requested tile in the cache?
-    auto tci = tileCache.find(std::make_pair(y, x));
-    if (tci != tileCache.end()) {
-        ++(tci->second.useCount);
-        return tci->second.tile;
+    CollectRenderedTiles();
+    TileKey key{ zoom, y, x };
+    auto ct = tileCache.Find(key);
+    if (ct) {
+        // if the colour mode has changed, or the tile is only a stand-in, then get
+        // the tile rendered in the background. this one is shown until it's ready.
+        auto tile = ct->tile;
+        if ((ct->provisional || (ct->colourMode != imgKit->GetColourMode())) && (pendingTiles.find(key) == pendingTiles.end())) {
+            RequestTile(key);
+        }
+        return tile;
     }
 
-    // TODO - might want to iterate to lower zoom levels and then draw more
-    // blurred map until the detailed one appears. the idea here would be to
-    // enhance the cache indexing from a simple x,y to x,y,z where z ranges from 0 (natural zoom) to (eg) 4.
+    // tile is not in the cache. if it's not already being rendered then request
+    // it from the Document Manager.
+    ++onScreenMisses;
+    if (pendingTiles.find(key) == pendingTiles.end()) {
+        RequestTile(key);
 
-    // tile is not in the cache. request it from the Document Manager.
-    assert(smapConfig);
-    std::string url = smapConfig->FormatUrl(zoom, y, x);
-    auto doc = docMgr->GetDocument(url);
-    if (doc && (doc->Status() == Document::DocStatus::OK)) {
-        unsigned &twpx = smapConfig->tileWidthPx;
-        unsigned &thpx = smapConfig->tileHeightPx;
-        // work out a scaling factor to get a 256x256 tile from whatever MuPDF thinks is the doc size
-        auto ps = doc->PageSize();
-        float sx = (float)twpx / ps.first;
-        float sy = (float)thpx / ps.second;
-        auto tile = doc->GetTile(0, sx, sy, 0, 0, twpx, thpx);
-        CachedTile ct(tile);
-        tileCache[std::make_pair(y, x)] = ct;
-        return tile;
+        // a tile that the archive doesn't have is marked as missing straight
+        // away, and that mark must not be replaced by a provisional tile
+        auto mt = tileCache.Peek(key);
+        if (mt && (mt->tile == missingTile)) return missingTile;
     }
 
+    // meanwhile, a blurred version of the tile can be made from one at a lower
+    // zoom level, if there is one in the cache
+    auto fallback = MakeProvisionalTile(key);
+    if (fallback) return fallback;
+
     // finally if no tile was available then return the chessboard
     return missingTile;
 }
 
+std::shared_ptr<RasterTile> MapTileProvider::MakeProvisionalTile(const TileKey& key)
+{
+    for (unsigned d = 1; (d <= kMaxFallbackLevels) && (d <= key.z); ++d) {
+        // the ancestor tile at d levels up covers 2^d x 2^d tiles at this level
+        TileKey ak{ key.z - d, key.y >> d, key.x >> d };
+        auto act = tileCache.Peek(ak);
+        if (!act || act->provisional || (act->tile == missingTile)) continue;
+
+        auto& src = *act->tile;
+        const unsigned n = 1 << d;
+        float sw = (float)src.Width() / n;
+        float sh = (float)src.Height() / n;
+        auto tile = std::make_shared<RasterTile>(src.Width(), src.Height(), ImageAlloc::UNINITIALISED);
+        upscaler.Scale(*tile, src, (key.x & (n - 1)) * sw, (key.y & (n - 1)) * sh, sw, sh);
+
+        // the provisional tile is cached so that it is only scaled once, and it is
+        // replaced when the real tile arrives
+        tileCache.Put(key, tile, act->colourMode, true);
+        return tile;
+    }
+    return nullptr;
+}
+
+void MapTileProvider::Prefetch(const Trajectory& plane)
+{
+    assert(smapConfig);
+    prefetcher.Update(plane, zoom, smapConfig->minZoomLevel, smapConfig->maxZoomLevel);
+
+    // the tiles on screen come first, so nothing is prefetched until they have all
+    // been found in the cache
+    if (onScreenMisses) {
+        onScreenMisses = 0;
+        return;
+    }
+
+    // ask again for a few of the prefetched documents in turn, so that any that
+    // have arrived get rendered without asking for all of them on every frame.
+    // tiles that have since been got on screen, or cancelled, are dropped.
+    unsigned n = 0;
+    while ((n < kPrefetchPerTick) && !prefetchPolls.empty()) {
+        TileKey k = prefetchPolls.front();
+        prefetchPolls.pop_front();
+        auto fi = fetchingTiles.find(k);
+        if ((fi == fetchingTiles.end()) || !fi->second.background) continue;
+        RequestTile(k, true);
+        fi = fetchingTiles.find(k);
+        if ((fi != fetchingTiles.end()) && fi->second.background) prefetchPolls.push_back(k);
+        ++n;
+    }
+
+    n = 0;
+    TileKey key;
+    while ((n < kPrefetchPerTick) && prefetcher.Next(key)) {
+        auto ct = tileCache.Peek(key);
+        if ((ct && !ct->provisional) || pendingTiles.count(key) || fetchingTiles.count(key)) continue;
+        RequestTile(key, true);
+        ++n;
+    }
+}
+
+int MapTileProvider::FetchPriority(const TileKey& key, bool background) const
+{
+    // on screen tiles are prioritised by their distance from the centre of the map
+    // in sixteenths of a tile, allowing for the date line. prefetched tiles are
+    // fetched in the order they are requested, after all of the on screen ones.
+    if (background) return kBackgroundPriority;
+    const double n = (double)(1 << key.z);
+    double dy = key.y + 0.5 - focus.first;
+    double dx = std::fabs(key.x + 0.5 - focus.second);
+    dx = std::min(dx, n - dx);
+    return std::min((int)(std::hypot(dy, dx) * 16), kBackgroundPriority - 1);
+}
+
+void MapTileProvider::LoadStoredTile(const TileKey& key, const std::string& url, bool background)
+{
+    // the tile is looked up by the backing store's reader thread, and the result
+    // is collected on a subsequent call. meanwhile the tile counts as pending, so
+    // that it isn't asked for again.
+    auto inbox = stored;
+    store->LoadTile(providerName, key.z, key.y, key.x,
+            [inbox, key, url, background](bool found, std::vector<uint8_t>&& data, const BackingStore::Validators& v) {
+        std::lock_guard<std::mutex> lock(inbox->mutex);
+        inbox->tiles.push_back(StoredTiles::Tile{ key, url, background, found, std::move(data), v.expires, v.etag, v.lastModified });
+    });
+    pendingTiles.insert(key);
+}
+
+void MapTileProvider::StoredTileLoaded(StoredTiles::Tile& t)
+{
+    // tiles that aren't stored are downloaded
+    pendingTiles.erase(t.key);
+    if (!t.found) {
+        FetchTile(t.key, t.url, nullptr, t.background);
+        return;
+    }
+    if (t.expires > (int64_t)std::time(nullptr)) {
+        auto doc = docMgr->AddDocument(t.url, storedType, std::move(t.data));
+        if (doc->Status() == Document::DocStatus::OK) {
+            RenderTile(t.key, doc, TileDataHash(doc->Data(), doc->Size()), t.background);
+        }
+        return;
+    }
+
+    // an expired tile is shown while the server is asked whether it has changed.
+    // the revalidation is remembered as a prefetch, so that its outcome is stored
+    // even if the tile goes off screen.
+    auto doc = std::make_shared<Document>(t.url, storedType, std::move(t.data));
+    Document::CacheInfo ci;
+    ci.etag = t.etag;
+    ci.lastModified = t.lastModified;
+    doc->SetCaching(ci);
+    docMgr->PrepareDocument(*doc);
+    if (doc->Status() == Document::DocStatus::OK) {
+        RenderTile(t.key, doc, TileDataHash(doc->Data(), doc->Size()), t.background);
+    }
+    docMgr->GetDocument(t.url, kBackgroundPriority, false, doc);
+    fetchingTiles[t.key] = Fetch{ t.url, true, true };
+    prefetchPolls.push_back(t.key);
+}
+
+void MapTileProvider::StoreTile(const TileKey& key, const Document& doc, uint64_t hash)
+{
+    auto& ci = doc.Caching();
+    if (!smapConfig->expiryDays || ci.noStore) return;
+
+    // the server's freshness lifetime is used if it gave one, otherwise the
+    // provider's configured expiry
+    BackingStore::Validators v;
+    v.etag = ci.etag;
+    v.lastModified = ci.lastModified;
+    v.expires = (int64_t)std::time(nullptr) + ((ci.maxAge >= 0) ? ci.maxAge : (int64_t)smapConfig->expiryDays * 24 * 60 * 60);
+    if (ci.revalidated) {
+        store->RefreshTile(providerName, key.z, key.y, key.x, v);
+        return;
+    }
+
+    // the format is only stored when it changes, all of a provider's tiles are the
+    // same. MBTiles names the format (eg png) rather than giving its MIME type.
+    auto format = TileFormatName(doc.Type());
+    if (storedFormat != format) {
+        storedFormat = format;
+        storedType = TileFormatMimeType(format);
+        store->StoreTileMetadata(providerName, "format", storedFormat);
+    }
+    store->StoreTile(providerName, key.z, key.y, key.x, doc.Data(), doc.Size(), hash, v);
+}
+
+void MapTileProvider::RequestTile(const TileKey& key, bool background)
+{
+    assert(smapConfig);
+    if (!smapConfig->archive.empty()) {
+        if (archive) RequestArchiveTile(key, background);
+        return;
+    }
+    std::string url = smapConfig->FormatUrl(key.z, key.y, key.x);
+
+    // the document may already be in memory, otherwise the backing store is
+    // tried before downloading it. a tile that is being fetched has already
+    // been looked for in the store.
+    auto doc = docMgr->FindDocument(url);
+    if (!doc && (fetchingTiles.find(key) == fetchingTiles.end())) {
+        LoadStoredTile(key, url, background);
+        return;
+    }
+    FetchTile(key, url, doc, background);
+}
+
+void MapTileProvider::FetchTile(const TileKey& key, const std::string& url, std::shared_ptr<Document> doc, bool background)
+{
+    if (!doc) {
+        doc = docMgr->GetDocument(url, FetchPriority(key, background), false);
+    }
+    if (!doc) {
+        // remember the fetch, so that it can be cancelled if the tile is no
+        // longer wanted. a prefetched tile that comes on screen is promoted.
+        auto fi = fetchingTiles.insert(std::make_pair(key, Fetch{ url, true, background }));
+        if (fi.second && background) prefetchPolls.push_back(key);
+        fi.first->second.wanted = true;
+        fi.first->second.background = fi.first->second.background && background;
+        return;
+    }
+    // documents that have just been downloaded are kept for future runs
+    bool downloaded = fetchingTiles.erase(key) > 0;
+    if (doc->Status() == Document::DocStatus::OK) {
+        auto hash = TileDataHash(doc->Data(), doc->Size());
+        if (downloaded) StoreTile(key, *doc, hash);
+        RenderTile(key, doc, hash, background);
+    }
+}
+
+void MapTileProvider::RequestArchiveTile(const TileKey& key, bool background)
+{
+    // the tile is used straight from the archive's mapping if possible, and the
+    // document keeps the archive open until it has been rendered
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    auto buffer = std::make_shared<std::vector<uint8_t>>();
+    if (!archive->GetTile(key.z, key.y, key.x, data, size, *buffer)) {
+        // remember that the archive doesn't have this tile, rather than looking
+        // for it on every frame
+        tileCache.Put(key, missingTile, imgKit->GetColourMode());
+        return;
+    }
+    std::shared_ptr<const void> backing = archive;
+    if (buffer->size()) backing = buffer;
+    auto doc = std::make_shared<Document>(fmt::format("{}#{}/{}/{}", smapConfig->archive, key.z, key.x, key.y),
+                archive->Format(), data, size, backing);
+    docMgr->PrepareDocument(*doc);
+    if (doc->Status() == Document::DocStatus::OK) {
+        RenderTile(key, doc, TileDataHash(data, size), background);
+    }
+}
+
+std::shared_ptr<RasterTile> MapTileProvider::FindSharedTile(uint64_t hash, size_t size, ColourMode m)
+{
+    auto si = sharedTiles.find(hash);
+    if ((si == sharedTiles.end()) || (si->second.size != size) || (si->second.colourMode != m)) return nullptr;
+    return si->second.tile.lock();
+}
+
+void MapTileProvider::RenderTile(const TileKey& key, std::shared_ptr<Document> doc, uint64_t hash, bool background)
+{
+    // a tile with the same image that is still in use (normally in the cache) is
+    // shared rather than rendered again
+    const size_t size = doc->Size();
+    auto shared = FindSharedTile(hash, size, imgKit->GetColourMode());
+    if (shared) {
+        tileCache.Put(key, shared, imgKit->GetColourMode());
+        return;
+    }
+
+    unsigned &twpx = smapConfig->tileWidthPx;
+    unsigned &thpx = smapConfig->tileHeightPx;
+    // work out a scaling factor to get a 256x256 tile from whatever MuPDF thinks is the doc size
+    auto ps = doc->PageSize();
+    float sx = (float)twpx / ps.first;
+    float sy = (float)thpx / ps.second;
+
+    // the tile is rendered by one of the imaging kit's threads, and will be
+    // collected on a subsequent call
+    TileJob job;
+    job.doc = doc;
+    job.page = 0;
+    job.scaleX = sx;
+    job.scaleY = sy;
+    job.x = 0;
+    job.y = 0;
+    job.w = twpx;
+    job.h = thpx;
+    job.colourMode = imgKit->GetColourMode();
+    job.background = background;
+    job.owner = this;
+    auto cm = job.colourMode;
+    auto inbox = rendered;
+    job.done = [inbox, key, cm, hash, size](std::shared_ptr<RasterTile> t) {
+        std::lock_guard<std::mutex> lock(inbox->mutex);
+        inbox->tiles.push_back(RenderedTiles::Tile{ key, cm, hash, size, t });
+    };
+    imgKit->Render(std::move(job));
+    pendingTiles.insert(key);
+}
+
+void MapTileProvider::CollectRenderedTiles()
+{
+    // the tiles that have been looked up in the backing store are dealt with
+    // first, since any that were found are then rendered
+    std::vector<StoredTiles::Tile> loaded;
+    {
+        std::lock_guard<std::mutex> lock(stored->mutex);
+        std::swap(loaded, stored->tiles);
+    }
+    for (auto& t : loaded) {
+        StoredTileLoaded(t);
+    }
+
+    std::vector<RenderedTiles::Tile> tiles;
+    {
+        std::lock_guard<std::mutex> lock(rendered->mutex);
+        if (rendered->tiles.empty()) return;
+        std::swap(tiles, rendered->tiles);
+    }
+    for (auto& t : tiles) {
+        // tiles requested before the zoom level was changed are still worth keeping
+        pendingTiles.erase(t.key);
+
+        // identical tiles that were rendered at the same time are merged here
+        auto shared = FindSharedTile(t.hash, t.size, t.colourMode);
+        if (shared) {
+            t.tile = shared;
+        } else {
+            sharedTiles[t.hash] = SharedTile{ t.tile, t.size, t.colourMode };
+        }
+        tileCache.Put(t.key, t.tile, t.colourMode);
+    }
+}
+
 std::pair<unsigned, unsigned> MapTileProvider::GetTileDimensions() const
 {
     assert(smapConfig);
@@ -127,7 +491,10 @@ void MapTileProvider::SetZoom(unsigned z)
     if ((z >= smapConfig->minZoomLevel) && (z <= smapConfig->maxZoomLevel)) {
         if (zoom != z) {
             zoom = z;
-            tileCache.clear();  // cache is only for one zoom level at a time
+            // the cache keeps the tiles from the old zoom level, but any that
+            // haven't been started are no longer wanted
+            imgKit->Cancel(this, false);
+            pendingTiles.clear();
         }
     }
 }
@@ -7,9 +7,19 @@
 #pragma once
 
 #include <memory>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <mutex>
 #include "navitab/geometrics.h"
 #include "navitab/logger.h"
+#include "../imgkit/colourtransform.h"
+#include "../imgkit/resampler.h"
+#include "tilecache.h"
+#include "tileprefetcher.h"
+#include "tilearchive.h"
 
 namespace navitab {
 
@@ -17,18 +27,26 @@ class RasterTile;
 struct Settings;
 struct PathServices;
 class DocumentManager;
+class Document;
+class ImagingKit;
+class BackingStore;
 class TileProviderConfigLoader;
 struct OnlineSlippyMapConfig;
 
 class MapTileProvider
 {
 public:
-    MapTileProvider(std::shared_ptr<PathServices>, std::shared_ptr<Settings>, std::shared_ptr<DocumentManager>);
+    MapTileProvider(std::shared_ptr<PathServices>, std::shared_ptr<Settings>, std::shared_ptr<DocumentManager>, std::shared_ptr<ImagingKit>, std::shared_ptr<BackingStore>);
     ~MapTileProvider();
 
     void SetZoom(unsigned z);
     unsigned GetZoom();
 
+    // Set the tile coordinates of the centre of the map, once per frame before the
+    // tiles are got. Tiles are fetched nearest the centre first, and the fetches of
+    // any tiles that weren't got since the previous frame are cancelled.
+    void SetFocus(const std::pair<double, double>& tyx);
+
     std::shared_ptr<RasterTile> GetTile(double y, double x);
     std::pair<unsigned, unsigned> GetTileDimensions() const; // height,width
 
@@ -44,22 +62,107 @@ public:
 
     void MaintenanceTick();
 
+    // Request a few of the tiles that the plane is expected to fly over soon, at a
+    // lower priority than the tiles on screen. Call once per frame, after the tiles
+    // for the frame have been got.
+    void Prefetch(const Trajectory& plane);
+
+    TileCache::Stats GetCacheStats() const { return tileCache.GetStats(); }
+
 private:
-    struct CachedTile {
-        CachedTile() = default;
-        CachedTile(std::shared_ptr<RasterTile> t) : tile(t), useCount(1) { }
-        std::shared_ptr<RasterTile> tile;
-        int useCount;
+    // Tiles are rendered by the imaging kit's worker threads, which put them here
+    // until they are collected into the cache on the core thread. This is shared
+    // with the jobs, so it outlives the provider if any are still running.
+    struct RenderedTiles {
+        struct Tile {
+            TileKey key;
+            ColourMode colourMode;
+            uint64_t hash;
+            size_t size;
+            std::shared_ptr<RasterTile> tile;
+        };
+        std::mutex mutex;
+        std::vector<Tile> tiles;
     };
 
+    // Tiles are looked up in the backing store by its reader thread, and the
+    // results wait here to be collected along with the rendered tiles.
+    struct StoredTiles {
+        struct Tile {
+            TileKey key;
+            std::string url;
+            bool background;
+            bool found;
+            std::vector<uint8_t> data;
+            int64_t expires;
+            std::string etag;
+            std::string lastModified;
+        };
+        std::mutex mutex;
+        std::vector<Tile> tiles;
+    };
+
+    void RequestTile(const TileKey& key, bool background = false);
+    void RequestArchiveTile(const TileKey& key, bool background);
+    void RenderTile(const TileKey& key, std::shared_ptr<Document> doc, uint64_t hash, bool background);
+    std::shared_ptr<RasterTile> FindSharedTile(uint64_t hash, size_t size, ColourMode m);
+    int FetchPriority(const TileKey& key, bool background) const;
+    void FetchTile(const TileKey& key, const std::string& url, std::shared_ptr<Document> doc, bool background);
+    void LoadStoredTile(const TileKey& key, const std::string& url, bool background);
+    void StoredTileLoaded(StoredTiles::Tile& t);
+    void StoreTile(const TileKey& key, const Document& doc, uint64_t hash);
+    std::shared_ptr<RasterTile> MakeProvisionalTile(const TileKey& key);
+    void CollectRenderedTiles();
+
 private:
+    static const unsigned kDefaultCacheMB = 64;
+    static const unsigned kMaxFallbackLevels = 4;
+    static const unsigned kPrefetchPerTick = 2;
+    static const int kBackgroundPriority = 1 << 20;
+
     std::unique_ptr<logging::Logger> LOG;
     std::shared_ptr<TileProviderConfigLoader> providerCfg;
     std::shared_ptr<OnlineSlippyMapConfig> smapConfig;
+    std::shared_ptr<TileArchive> archive;
     std::shared_ptr<Settings> prefs;
     std::shared_ptr<DocumentManager> docMgr;
-    std::map<std::pair<int, int>, CachedTile> tileCache;
+    std::shared_ptr<ImagingKit> imgKit;
+    std::shared_ptr<BackingStore> store;
+    std::string providerName;
+    // the MBTiles name of the stored tiles' format (eg png), and their MIME type
+    std::string storedFormat;
+    std::string storedType;
+    TileCache tileCache;
+    Resampler upscaler;
+    std::unordered_set<TileKey, TileKeyHash> pendingTiles;
+
+    // tiles whose documents are being fetched, and whether they were wanted for
+    // the current frame
+    struct Fetch {
+        std::string url;
+        bool wanted;
+        bool background;
+    };
+    std::unordered_map<TileKey, Fetch, TileKeyHash> fetchingTiles;
+
+    // the prefetched tiles whose documents are being fetched, in the order that
+    // they are checked for having arrived, a few on each frame
+    std::deque<TileKey> prefetchPolls;
+    std::pair<double, double> focus;
+    std::shared_ptr<RenderedTiles> rendered;
+    std::shared_ptr<StoredTiles> stored;
+
+    // tiles by the hash of their image data, so that tiles with identical images
+    // (eg open sea at low zoom levels) are only rendered once and share one buffer
+    struct SharedTile {
+        std::weak_ptr<RasterTile> tile;
+        size_t size;
+        ColourMode colourMode;
+    };
+    std::unordered_map<uint64_t, SharedTile> sharedTiles;
     std::shared_ptr<RasterTile> missingTile;
+    TilePrefetcher prefetcher;
+    unsigned onScreenMisses;
     unsigned zoom;
 };
 
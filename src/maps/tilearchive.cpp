@@ -0,0 +1,329 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "tilearchive.h"
+#include "../store/mappedfile.h"
+#include <fmt/core.h>
+#include <sqlite3.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+
+namespace navitab {
+
+std::shared_ptr<TileArchive> TileArchive::Open(const std::filesystem::path& path)
+{
+    auto file = std::make_unique<MappedFile>(path);
+    if (!file->IsOpen()) return nullptr;
+    if ((file->Size() >= 7) && (std::memcmp(file->Data(), "PMTiles", 7) == 0)) {
+        auto pmt = std::make_shared<PMTilesArchive>(std::move(file));
+        return pmt->IsOpen() ? pmt : nullptr;
+    }
+    if ((file->Size() >= 16) && (std::memcmp(file->Data(), "SQLite format 3", 16) == 0)) {
+        // SQLite does its own memory mapping
+        file.reset();
+        auto mbt = std::make_shared<MBTilesArchive>(path);
+        return mbt->IsOpen() ? mbt : nullptr;
+    }
+    return nullptr;
+}
+
+std::string TileFormatMimeType(const std::string& format)
+{
+    if ((format == "jpg") || (format == "jpeg")) return "image/jpeg";
+    if (format == "webp") return "image/webp";
+    if (format == "pbf") return "application/x-protobuf";
+    return "image/png";
+}
+
+std::string TileFormatName(const std::string& mimeType)
+{
+    // servers sometimes give non-standard types, eg image/jpg
+    if (mimeType.find("jp") != std::string::npos) return "jpg";
+    if (mimeType.find("webp") != std::string::npos) return "webp";
+    if ((mimeType.find("protobuf") != std::string::npos) || (mimeType.find("vector-tile") != std::string::npos)) return "pbf";
+    return "png";
+}
+
+// ---------------------------------------------------------------------------
+// MBTiles
+
+MBTilesArchive::MBTilesArchive(const std::filesystem::path& path)
+:   LOG(std::make_unique<logging::Logger>("archive")),
+    db(nullptr),
+    getTile(nullptr)
+{
+    int r = sqlite3_open_v2(path.string().c_str(), &db, SQLITE_OPEN_READONLY, nullptr);
+    if (r != SQLITE_OK) {
+        LOGE(fmt::format("Unable to open MBTiles archive {} - {}", path.string(), sqlite3_errstr(r)));
+        return;
+    }
+
+    // let SQLite read the database through a memory mapping, rather than copying
+    // each page it needs into its page cache
+    std::error_code ec;
+    auto fsize = std::filesystem::file_size(path, ec);
+    if (!ec) {
+        auto pragma = fmt::format("PRAGMA mmap_size = {};", (uint64_t)fsize);
+        sqlite3_exec(db, pragma.c_str(), nullptr, nullptr, nullptr);
+    }
+
+    r = sqlite3_prepare_v2(db, "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &getTile, nullptr);
+    if (r != SQLITE_OK) {
+        LOGE(fmt::format("{} is not an MBTiles archive - {}", path.string(), sqlite3_errmsg(db)));
+        getTile = nullptr;
+        return;
+    }
+
+    format = TileFormatMimeType(GetMetadata("format"));
+    auto minz = GetMetadata("minzoom");
+    auto maxz = GetMetadata("maxzoom");
+    if (minz.size() && maxz.size()) {
+        minZoom = (unsigned)std::stoul(minz);
+        maxZoom = (unsigned)std::stoul(maxz);
+    } else {
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(db, "SELECT MIN(zoom_level), MAX(zoom_level) FROM tiles", -1, &stmt, nullptr);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            minZoom = sqlite3_column_int(stmt, 0);
+            maxZoom = sqlite3_column_int(stmt, 1);
+        }
+        sqlite3_finalize(stmt);
+    }
+    LOGI(fmt::format("Opened MBTiles archive {}, {} zoom {}-{}", path.string(), format, minZoom, maxZoom));
+}
+
+MBTilesArchive::~MBTilesArchive()
+{
+    if (getTile) sqlite3_finalize(getTile);
+    if (db) sqlite3_close(db);
+}
+
+std::string MBTilesArchive::GetMetadata(const std::string& name)
+{
+    std::string value;
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(db, "SELECT value FROM metadata WHERE name = ?", -1, &stmt, nullptr);
+    sqlite3_bind_text(stmt, 1, name.c_str(), (int)name.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        auto v = sqlite3_column_text(stmt, 0);
+        if (v) value = reinterpret_cast<const char*>(v);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+bool MBTilesArchive::GetTile(unsigned z, int y, int x, const uint8_t*& data, size_t& size, std::vector<uint8_t>& buffer)
+{
+    // the blob is only valid until the statement is reset, so it has to be copied
+    bool found = false;
+    sqlite3_bind_int(getTile, 1, z);
+    sqlite3_bind_int(getTile, 2, x);
+    sqlite3_bind_int(getTile, 3, (1 << z) - 1 - y);
+    if (sqlite3_step(getTile) == SQLITE_ROW) {
+        auto bptr = static_cast<const uint8_t*>(sqlite3_column_blob(getTile, 0));
+        auto bsize = sqlite3_column_bytes(getTile, 0);
+        if (bptr && (bsize > 0)) {
+            buffer.assign(bptr, bptr + bsize);
+            data = buffer.data();
+            size = buffer.size();
+            found = true;
+        }
+    }
+    sqlite3_reset(getTile);
+    return found;
+}
+
+// ---------------------------------------------------------------------------
+// PMTiles (version 3)
+
+static const size_t kHeaderSize = 127;
+static const size_t kMaxLeafDirs = 64;
+
+enum PMCompression : uint8_t { PM_UNKNOWN = 0, PM_NONE = 1, PM_GZIP = 2, PM_BROTLI = 3, PM_ZSTD = 4 };
+enum PMTileType : uint8_t { PM_MVT = 1, PM_PNG = 2, PM_JPEG = 3, PM_WEBP = 4 };
+
+static uint64_t readLE64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+static bool readVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; (p < end) && (shift < 64); shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// The tile id counts all of the tiles at the lower zoom levels, and then along a
+// Hilbert curve through the tiles at this level.
+static uint64_t tileId(unsigned z, uint64_t x, uint64_t y)
+{
+    uint64_t id = ((1ULL << (2 * z)) - 1) / 3;
+    for (uint64_t s = (1ULL << z) / 2; s > 0; s /= 2) {
+        uint64_t rx = (x & s) ? 1 : 0;
+        uint64_t ry = (y & s) ? 1 : 0;
+        id += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - (x & (s - 1));
+                y = s - 1 - (y & (s - 1));
+            }
+            std::swap(x, y);
+        }
+    }
+    return id;
+}
+
+PMTilesArchive::PMTilesArchive(std::unique_ptr<MappedFile> f)
+:   LOG(std::make_unique<logging::Logger>("archive")),
+    file(std::move(f)),
+    leafDirsOffset(0),
+    tileDataOffset(0),
+    internalCompression(PM_UNKNOWN),
+    tileCompression(PM_UNKNOWN)
+{
+    const uint8_t* h = file->Data();
+    if ((file->Size() < kHeaderSize) || (h[7] != 3)) {
+        LOGE("Only version 3 PMTiles archives are supported");
+        return;
+    }
+    uint64_t rootOffset = readLE64(h + 8);
+    uint64_t rootLength = readLE64(h + 16);
+    leafDirsOffset = readLE64(h + 40);
+    tileDataOffset = readLE64(h + 56);
+    internalCompression = h[97];
+    tileCompression = h[98];
+    minZoom = h[100];
+    maxZoom = h[101];
+    switch (h[99]) {
+    case PM_PNG: format = "image/png"; break;
+    case PM_JPEG: format = "image/jpeg"; break;
+    case PM_WEBP: format = "image/webp"; break;
+    default:
+        LOGE(fmt::format("PMTiles archive has unsupported tile type {}, only raster tiles can be shown", h[99]));
+        return;
+    }
+    if (!ReadDirectory(rootOffset, rootLength, rootDir)) {
+        rootDir.clear();
+        return;
+    }
+    LOGI(fmt::format("Opened PMTiles archive, {} zoom {}-{}", format, minZoom, maxZoom));
+}
+
+PMTilesArchive::~PMTilesArchive()
+{
+}
+
+bool PMTilesArchive::Decompress(uint8_t compression, const uint8_t* src, size_t len, std::vector<uint8_t>& out)
+{
+    if ((compression == PM_NONE) || (compression == PM_UNKNOWN)) {
+        out.assign(src, src + len);
+        return true;
+    }
+    if (compression != PM_GZIP) {
+        LOGE(fmt::format("PMTiles compression type {} is not supported", compression));
+        return false;
+    }
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) return false;
+    zs.next_in = const_cast<Bytef*>(src);
+    zs.avail_in = (uInt)len;
+    out.resize(std::max<size_t>(len * 4, 4096));
+    int r = Z_OK;
+    while (r == Z_OK) {
+        if (zs.total_out == out.size()) out.resize(out.size() * 2);
+        zs.next_out = out.data() + zs.total_out;
+        zs.avail_out = (uInt)(out.size() - zs.total_out);
+        r = inflate(&zs, Z_NO_FLUSH);
+    }
+    out.resize(zs.total_out);
+    inflateEnd(&zs);
+    return r == Z_STREAM_END;
+}
+
+bool PMTilesArchive::ReadDirectory(uint64_t offset, uint64_t length, Directory& dir)
+{
+    if ((offset > file->Size()) || (length > (file->Size() - offset))) return false;
+    std::vector<uint8_t> raw;
+    if (!Decompress(internalCompression, file->Data() + offset, length, raw)) return false;
+
+    // the entries are stored column by column: tile ids (as deltas), run lengths,
+    // lengths and then offsets, where 0 means immediately after the previous entry
+    const uint8_t* p = raw.data();
+    const uint8_t* end = p + raw.size();
+    uint64_t n, v;
+    if (!readVarint(p, end, n) || (n > raw.size())) return false;
+    dir.resize(n);
+    uint64_t id = 0;
+    for (auto& e : dir) {
+        if (!readVarint(p, end, v)) return false;
+        id += v;
+        e.tileId = id;
+    }
+    for (auto& e : dir) {
+        if (!readVarint(p, end, v)) return false;
+        e.runLength = (uint32_t)v;
+    }
+    for (auto& e : dir) {
+        if (!readVarint(p, end, v)) return false;
+        e.length = (uint32_t)v;
+    }
+    for (size_t i = 0; i < dir.size(); ++i) {
+        if (!readVarint(p, end, v)) return false;
+        if ((v == 0) && (i > 0)) {
+            dir[i].offset = dir[i - 1].offset + dir[i - 1].length;
+        } else {
+            dir[i].offset = v - 1;
+        }
+    }
+    return true;
+}
+
+bool PMTilesArchive::GetTile(unsigned z, int y, int x, const uint8_t*& data, size_t& size, std::vector<uint8_t>& buffer)
+{
+    if ((z < minZoom) || (z > maxZoom) || (y < 0) || (x < 0)) return false;
+    const uint64_t id = tileId(z, x, y);
+
+    // search the root directory, and then any leaf directories it leads to
+    const Directory* dir = &rootDir;
+    for (int depth = 0; depth < 4; ++depth) {
+        auto ei = std::upper_bound(dir->begin(), dir->end(), id, [](uint64_t t, const Entry& e) { return t < e.tileId; });
+        if (ei == dir->begin()) return false;
+        // copied, since a leaf directory's entries go if the leaf cache is cleared
+        const Entry e = *(ei - 1);
+
+        if (e.runLength > 0) {
+            if (id >= (e.tileId + e.runLength)) return false;
+            uint64_t pos = tileDataOffset + e.offset;
+            if ((pos > file->Size()) || (e.length > (file->Size() - pos))) return false;
+            if ((tileCompression == PM_NONE) || (tileCompression == PM_UNKNOWN)) {
+                data = file->Data() + pos;
+                size = e.length;
+                return true;
+            }
+            if (!Decompress(tileCompression, file->Data() + pos, e.length, buffer)) return false;
+            data = buffer.data();
+            size = buffer.size();
+            return true;
+        }
+
+        auto li = leafDirs.find(e.offset);
+        if (li == leafDirs.end()) {
+            if (leafDirs.size() >= kMaxLeafDirs) leafDirs.clear();
+            Directory leaf;
+            if (!ReadDirectory(leafDirsOffset + e.offset, e.length, leaf)) return false;
+            li = leafDirs.emplace(e.offset, std::move(leaf)).first;
+        }
+        dir = &li->second;
+    }
+    return false;
+}
+
+} // namespace navitab
@@ -0,0 +1,115 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include "navitab/logger.h"
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// This header file defines the local tile archives, which provide map tiles from
+// a single file rather than a tile server, for use offline. Two formats are
+// supported: MBTiles (an SQLite database) and PMTiles (a single file with a
+// directory of tiles indexed along a Hilbert curve). Both are read through a
+// memory mapping, and PMTiles tiles are returned in place, without being copied.
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace navitab {
+
+class MappedFile;
+
+// Convert between the tile format names used in MBTiles metadata (png, jpg, webp
+// or pbf) and MIME types.
+std::string TileFormatMimeType(const std::string& format);
+std::string TileFormatName(const std::string& mimeType);
+
+class TileArchive
+{
+public:
+    // Open an archive, choosing the format from the file's contents. Returns
+    // nullptr if the file is not a usable archive.
+    static std::shared_ptr<TileArchive> Open(const std::filesystem::path& path);
+
+    virtual ~TileArchive() = default;
+
+    // Find a tile, where y is the slippy map (north down) row. If the tile is held
+    // in the archive as-is then data points into the archive's mapping and stays
+    // valid while the archive is open. Otherwise the tile is copied or decompressed
+    // into buffer. Returns false if the archive has no such tile.
+    virtual bool GetTile(unsigned z, int y, int x, const uint8_t*& data, size_t& size, std::vector<uint8_t>& buffer) = 0;
+
+    // The MIME type of the tile images, and the range of zoom levels held.
+    const std::string& Format() const { return format; }
+    unsigned MinZoom() const { return minZoom; }
+    unsigned MaxZoom() const { return maxZoom; }
+
+protected:
+    TileArchive() : minZoom(0), maxZoom(0) { }
+
+    std::string format;
+    unsigned minZoom;
+    unsigned maxZoom;
+};
+
+class MBTilesArchive : public TileArchive
+{
+public:
+    MBTilesArchive(const std::filesystem::path& path);
+    ~MBTilesArchive();
+
+    bool IsOpen() const { return getTile != nullptr; }
+
+    bool GetTile(unsigned z, int y, int x, const uint8_t*& data, size_t& size, std::vector<uint8_t>& buffer) override;
+
+private:
+    std::string GetMetadata(const std::string& name);
+
+private:
+    std::unique_ptr<logging::Logger> LOG;
+    sqlite3* db;
+    sqlite3_stmt* getTile;
+};
+
+class PMTilesArchive : public TileArchive
+{
+public:
+    PMTilesArchive(std::unique_ptr<MappedFile> file);
+    ~PMTilesArchive();
+
+    bool IsOpen() const { return !rootDir.empty(); }
+
+    bool GetTile(unsigned z, int y, int x, const uint8_t*& data, size_t& size, std::vector<uint8_t>& buffer) override;
+
+private:
+    // a directory entry covers runLength consecutive tiles with the same data, or
+    // if runLength is 0 it refers to a leaf directory
+    struct Entry {
+        uint64_t tileId;
+        uint64_t offset;
+        uint32_t length;
+        uint32_t runLength;
+    };
+    typedef std::vector<Entry> Directory;
+
+    bool ReadDirectory(uint64_t offset, uint64_t length, Directory& dir);
+    bool Decompress(uint8_t compression, const uint8_t* src, size_t len, std::vector<uint8_t>& out);
+
+private:
+    std::unique_ptr<logging::Logger> LOG;
+    std::unique_ptr<MappedFile> file;
+    uint64_t leafDirsOffset;
+    uint64_t tileDataOffset;
+    uint8_t internalCompression;
+    uint8_t tileCompression;
+    Directory rootDir;
+
+    // recently used leaf directories, keyed by their offset
+    std::map<uint64_t, Directory> leafDirs;
+};
+
+} // namespace navitab
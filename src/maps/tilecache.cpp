@@ -0,0 +1,120 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "tilecache.h"
+#include "navitab/tiles.h"
+#include <cstring>
+
+namespace navitab {
+
+uint64_t TileDataHash(const uint8_t* data, size_t size)
+{
+    // 8 bytes at a time, each word mixed in with a multiply and xor-shift
+    const uint64_t m = 0xbf58476d1ce4e5b9ull;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ ((uint64_t)size * m);
+    size_t i = 0;
+    for (; (i + 8) <= size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
+    }
+    uint64_t w = 0;
+    if (i < size) std::memcpy(&w, data + i, size - i);
+    h = (h ^ w) * m;
+    h ^= h >> 32;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 29);
+}
+
+TileCache::TileCache(size_t b)
+:   bytes(0),
+    budget(b),
+    hits(0),
+    misses(0),
+    evictions(0)
+{
+}
+
+const TileCache::CachedTile* TileCache::Find(const TileKey& key)
+{
+    auto i = index.find(key);
+    if (i == index.end()) {
+        ++misses;
+        return nullptr;
+    }
+    ++hits;
+    lru.splice(lru.begin(), lru, i->second);
+    return &i->second->ct;
+}
+
+const TileCache::CachedTile* TileCache::Peek(const TileKey& key) const
+{
+    auto i = index.find(key);
+    return (i != index.end()) ? &i->second->ct : nullptr;
+}
+
+void TileCache::Put(const TileKey& key, std::shared_ptr<RasterTile> tile, ColourMode m, bool provisional)
+{
+    Hold(tile);
+    auto i = index.find(key);
+    if (i != index.end()) {
+        auto n = i->second;
+        Release(n->ct.tile);
+        n->ct.tile = tile;
+        n->ct.colourMode = m;
+        n->ct.provisional = provisional;
+        lru.splice(lru.begin(), lru, n);
+    } else {
+        lru.push_front(Node{ key, CachedTile{ tile, m, provisional } });
+        index[key] = lru.begin();
+    }
+    Evict();
+}
+
+void TileCache::Hold(const std::shared_ptr<RasterTile>& tile)
+{
+    if (tile && (++holds[tile.get()] == 1)) bytes += tile->Bytes();
+}
+
+void TileCache::Release(const std::shared_ptr<RasterTile>& tile)
+{
+    if (!tile) return;
+    auto h = holds.find(tile.get());
+    if (--h->second == 0) {
+        holds.erase(h);
+        bytes -= tile->Bytes();
+    }
+}
+
+void TileCache::SetBudget(size_t b)
+{
+    budget = b;
+    Evict();
+}
+
+void TileCache::Clear()
+{
+    index.clear();
+    lru.clear();
+    holds.clear();
+    bytes = 0;
+}
+
+TileCache::Stats TileCache::GetStats() const
+{
+    return Stats{ lru.size(), holds.size(), bytes, budget, hits, misses, evictions };
+}
+
+void TileCache::Evict()
+{
+    // always keep the most recent tile, even if it alone is over budget
+    while ((bytes > budget) && (lru.size() > 1)) {
+        auto& n = lru.back();
+        Release(n.ct.tile);
+        index.erase(n.key);
+        lru.pop_back();
+        ++evictions;
+    }
+}
+
+} // namespace navitab
@@ -0,0 +1,111 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "../imgkit/colourtransform.h"
+
+// This header file defines the cache of rendered map tiles. Tiles from several
+// zoom levels are kept at once, so zooming in and back out again doesn't need
+// everything to be rendered again. The cache is limited by the total size of
+// the tiles' pixels, and the least recently used tiles are evicted first. A tile
+// that is cached under several keys (eg identical tiles of open sea) is only
+// counted once.
+
+namespace navitab {
+
+class RasterTile;
+
+struct TileKey
+{
+    unsigned z;
+    int y, x;
+
+    bool operator==(const TileKey& k) const { return (z == k.z) && (y == k.y) && (x == k.x); }
+    bool operator!=(const TileKey& k) const { return !(*this == k); }
+};
+
+struct TileKeyHash
+{
+    size_t operator()(const TileKey& k) const
+    {
+        uint64_t h = (uint64_t)k.z * 0x9e3779b97f4a7c15ull;
+        h ^= ((uint64_t)(uint32_t)k.y << 32) | (uint32_t)k.x;
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ull;
+        return (size_t)(h ^ (h >> 32));
+    }
+};
+
+// A 64-bit hash of a tile's encoded image data, which is used to find tiles with
+// identical images. The hash isn't cryptographic, so tiles are only treated as
+// identical if their sizes match too.
+uint64_t TileDataHash(const uint8_t* data, size_t size);
+
+class TileCache
+{
+public:
+    TileCache(size_t budgetBytes);
+    ~TileCache() = default;
+
+    struct CachedTile
+    {
+        std::shared_ptr<RasterTile> tile;
+        ColourMode colourMode;
+        bool provisional;   // stand-in for a tile that is not available yet
+    };
+
+    // Look up a tile and make it the most recently used. Returns nullptr if the
+    // tile isn't cached. The pointer is only valid until the cache is modified.
+    const CachedTile* Find(const TileKey& key);
+
+    // Look up a tile without affecting its age or the statistics.
+    const CachedTile* Peek(const TileKey& key) const;
+
+    // Add or replace a tile, evicting the least recently used tiles if this takes
+    // the cache over its budget.
+    void Put(const TileKey& key, std::shared_ptr<RasterTile> tile, ColourMode m, bool provisional = false);
+
+    void SetBudget(size_t budgetBytes);
+    void Clear();
+
+    struct Stats {
+        size_t entries;
+        size_t tiles;       // distinct tiles, less than entries if some are shared
+        size_t bytes;
+        size_t budget;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+    Stats GetStats() const;
+
+private:
+    void Evict();
+    void Hold(const std::shared_ptr<RasterTile>& tile);
+    void Release(const std::shared_ptr<RasterTile>& tile);
+
+private:
+    struct Node
+    {
+        TileKey key;
+        CachedTile ct;
+    };
+
+    // most recently used at the front
+    std::list<Node> lru;
+    std::unordered_map<TileKey, std::list<Node>::iterator, TileKeyHash> index;
+    // the number of entries holding each tile, only the first one counts its bytes
+    std::unordered_map<const RasterTile*, unsigned> holds;
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+} // namespace navitab
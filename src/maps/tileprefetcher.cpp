@@ -0,0 +1,123 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "tileprefetcher.h"
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+namespace navitab {
+
+// mean radius of the earth, for converting the speed to and from radians
+static const double kEarthRadiusMetres = 6371000.0;
+
+// faster than this is a reposition or a replay, not flying
+static const double kMaxSpeedMetres = 1000.0;
+
+// the number of points along the track that tiles are fetched around
+static const int kTrackSteps = 12;
+
+// the plan is refreshed at least this often, in case the speed has changed
+static const auto kReplanInterval = std::chrono::seconds(10);
+
+static TileKey tileAt(const Location& loc, unsigned z)
+{
+    auto m = loc.toMercator();
+    const int n = 1 << z;
+    int y = std::min(std::max((int)std::floor(m.first * n), 0), n - 1);
+    int x = (int)std::floor(m.second * n) % n;
+    if (x < 0) x += n;
+    return TileKey{ z, y, x };
+}
+
+TilePrefetcher::TilePrefetcher(double la)
+:   lookahead(la),
+    havePosition(false),
+    speed(0.0),
+    planned(false),
+    planTile{ 0, 0, 0 },
+    planHeading(0.0)
+{
+}
+
+double TilePrefetcher::GroundSpeed() const
+{
+    return speed * kEarthRadiusMetres;
+}
+
+void TilePrefetcher::Update(const Trajectory& plane, unsigned zoom, unsigned minZoom, unsigned maxZoom)
+{
+    // estimate the ground speed over intervals of at least a second, smoothed
+    // since the simulator's positions are a little jittery
+    auto now = std::chrono::steady_clock::now();
+    if (!havePosition) {
+        havePosition = true;
+        lastPosition = plane;
+        lastTime = now;
+    } else {
+        double dt = std::chrono::duration<double>(now - lastTime).count();
+        if (dt >= 1.0) {
+            double v = plane.angDistanceTo(lastPosition) / dt;
+            if (v * kEarthRadiusMetres > kMaxSpeedMetres) {
+                speed = 0.0;
+                planned = false;
+            } else {
+                speed = (0.7 * speed) + (0.3 * v);
+            }
+            lastPosition = plane;
+            lastTime = now;
+        }
+    }
+
+    // plan again if the plane has moved into another tile, or turned, or if the
+    // last plan is getting old
+    auto here = tileAt(plane, zoom);
+    double turn = std::fabs(std::remainder(plane.hdg_rad - planHeading, 2 * M_PI));
+    if (!planned || (here != planTile) || (turn > (10.0 * DEG_TO_RAD)) || ((now - planTime) > kReplanInterval)) {
+        planned = true;
+        planTile = here;
+        planHeading = plane.hdg_rad;
+        planTime = now;
+        Plan(plane, zoom, minZoom, maxZoom);
+    }
+}
+
+void TilePrefetcher::Plan(const Trajectory& plane, unsigned zoom, unsigned minZoom, unsigned maxZoom)
+{
+    queue = std::priority_queue<Candidate>();
+    if (speed <= 0.0) return;
+
+    // at each point along the track, the tile under the plane and its neighbours
+    // are wanted at the current zoom. the other zoom levels are wanted later, since
+    // the pilot may not zoom at all.
+    std::unordered_set<TileKey, TileKeyHash> seen;
+    for (int step = 1; step <= kTrackSteps; ++step) {
+        double t = lookahead * step / kTrackSteps;
+        auto wp = plane.getWaypoint(speed * t);
+        for (unsigned z = (zoom > minZoom ? zoom - 1 : zoom); z <= std::min(zoom + 1, maxZoom); ++z) {
+            auto centre = tileAt(wp, z);
+            const int n = 1 << z;
+            const int r = (z == zoom) ? 1 : 0;
+            const double when = (z == zoom) ? t : t + (lookahead / 2);
+            for (int dy = -r; dy <= r; ++dy) {
+                for (int dx = -r; dx <= r; ++dx) {
+                    int y = centre.y + dy;
+                    if ((y < 0) || (y >= n)) continue;
+                    TileKey k{ z, y, ((centre.x + dx) % n + n) % n };
+                    if (seen.insert(k).second) {
+                        queue.push(Candidate{ when, k });
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool TilePrefetcher::Next(TileKey& key)
+{
+    if (queue.empty()) return false;
+    key = queue.top().key;
+    queue.pop();
+    return true;
+}
+
+} // namespace navitab
@@ -0,0 +1,63 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <chrono>
+#include <queue>
+#include <vector>
+#include "navitab/geometrics.h"
+#include "tilecache.h"
+
+// This header file defines the tile prefetcher, which predicts which map tiles
+// will be needed soon by projecting the plane's position ahead along its track.
+// The ground speed is estimated from successive positions. The tiles that are
+// found are handed out nearest first, a few at a time, so that the prefetching
+// never competes with the tiles that are needed on screen.
+
+namespace navitab {
+
+class TilePrefetcher
+{
+public:
+    TilePrefetcher(double lookaheadSeconds = 120.0);
+    ~TilePrefetcher() = default;
+
+    // Update the estimated ground speed from the plane's latest position, and plan
+    // a new set of tiles if the plane has moved on, turned or the zoom has changed.
+    // Tiles are planned at the current zoom level and the levels either side.
+    void Update(const Trajectory& plane, unsigned zoom, unsigned minZoom, unsigned maxZoom);
+
+    // Get the next tile to prefetch. Returns false if there are none left.
+    bool Next(TileKey& key);
+
+    // Estimated ground speed, in metres per second.
+    double GroundSpeed() const;
+
+private:
+    void Plan(const Trajectory& plane, unsigned zoom, unsigned minZoom, unsigned maxZoom);
+
+private:
+    const double lookahead;
+
+    // ground speed estimate, in radians (of arc) per second
+    bool havePosition;
+    Location lastPosition;
+    std::chrono::steady_clock::time_point lastTime;
+    double speed;
+
+    // what the current plan was based on
+    bool planned;
+    TileKey planTile;
+    double planHeading;
+    std::chrono::steady_clock::time_point planTime;
+
+    // the planned tiles, soonest needed first
+    struct Candidate {
+        double when;
+        TileKey key;
+        bool operator<(const Candidate& c) const { return when > c.when; }
+    };
+    std::priority_queue<Candidate> queue;
+};
+
+} // namespace navitab
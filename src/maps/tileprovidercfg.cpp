@@ -42,6 +42,7 @@ TileProviderConfigLoader::TileProviderConfigLoader(std::filesystem::path cfg)
         tscfg->maxZoomLevel = 12;
         tscfg->tileWidthPx = 256;
         tscfg->tileHeightPx = 256;
+        tscfg->expiryDays = 0;
         smConfigs[""] = tscfg;
     }
 }
@@ -131,12 +132,24 @@ void TileProviderConfigLoader::Populate(json cfg)
                 continue;
             }
             getKey(ts, "copyright", tscfg->copyright, "No copyright declared");
-            getKey(ts, "protocol", tscfg->protocol, "https");
-            getKey(ts, "url", tscfg->url);
             getKey(ts, "min_zoom_level", tscfg->minZoomLevel, 1);
             getKey(ts, "max_zoom_level", tscfg->maxZoomLevel, 12);
             getKey(ts, "tile_width_px", tscfg->tileWidthPx, 256);
             getKey(ts, "tile_height_px", tscfg->tileHeightPx, 256);
+            getKey(ts, "expiry_days", tscfg->expiryDays, 30);
+
+            // local archives are found relative to the config file
+            getKey(ts, "archive", tscfg->archive, "");
+            if (!tscfg->archive.empty()) {
+                std::filesystem::path ap(tscfg->archive);
+                if (ap.is_relative()) ap = configFilePath.parent_path() / ap;
+                tscfg->archive = ap.string();
+                smConfigs[name] = tscfg;
+                continue;
+            }
+
+            getKey(ts, "protocol", tscfg->protocol, "https");
+            getKey(ts, "url", tscfg->url);
             auto tsit = ts.find("servers");
             if (tsit == ts.end()) {
                 throw std::runtime_error("namdatory key 'servers' is missing");
@@ -242,8 +255,10 @@ void OnlineSlippyMapConfig::splitUrl(size_t p1, size_t p2, size_t p3)
 
 std::string OnlineSlippyMapConfig::FormatUrl(unsigned zoom, int y, int x) const
 {
+    // the server is chosen from the tile's position, so that the load is spread
+    // across the servers but each tile always has the same URL
     size_t si = 0;
-    if (servers.size() > 1) si = rand() % servers.size();
+    if (servers.size() > 1) si = ((unsigned)x + (unsigned)y) % servers.size();
     std::string base = protocol + "://" + servers[si] + "/";
     auto zs = std::to_string(zoom);
     auto xs = std::to_string(x);
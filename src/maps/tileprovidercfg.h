@@ -11,8 +11,12 @@
 
 namespace navitab {
 
+// The configuration of a slippy map tile provider. This is normally an online tile
+// server, but if an archive is given then the tiles come from that local MBTiles
+// or PMTiles file instead, and the servers, protocol and url are not used.
 struct OnlineSlippyMapConfig {
     std::string copyright;
+    std::string archive;
     std::vector<std::string> servers;
     std::string protocol;
     std::string url;
@@ -20,6 +24,7 @@ struct OnlineSlippyMapConfig {
     unsigned maxZoomLevel;
     unsigned tileHeightPx;
     unsigned tileWidthPx;
+    unsigned expiryDays;    // how long downloaded tiles are kept in the backing store
     void Validate();
     std::string FormatUrl(unsigned zoom, int y, int x) const;
     // internal working state
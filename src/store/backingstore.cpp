@@ -6,6 +6,7 @@
 #include <fmt/core.h>
 #include <sqlite3.h>
 #include <cassert>
+#include <ctime>
 
 namespace navitab {
 
@@ -18,9 +19,24 @@ namespace navitab {
 
 static int callback(void *p, int n, char **data, char **names);
 
+// how long a connection waits for the other connection to finish writing
+static const int kBusyTimeoutMs = 2000;
+
+// the stored documents are checked against their size limit after this fraction
+// of the limit has been written
+static const size_t kPruneFraction = 8;
+
+// how long stale tiles and documents are kept for revalidation after they expire
+static const int64_t kStaleLifetime = 30 * 24 * 60 * 60;
+
 BackingStore::BackingStore(std::shared_ptr<PathServices> ps)
 :   LOG(std::make_unique<logging::Logger>("store")),
-    dbHandle(nullptr)
+    dbHandle(nullptr),
+    docHandle(nullptr),
+    running(true),
+    writeHandle(nullptr),
+    reading(true),
+    readHandle(nullptr)
 {
     sqlite3_initialize();
     std::filesystem::path db = ps->DataFilesPath();
@@ -36,10 +52,74 @@ BackingStore::BackingStore(std::shared_ptr<PathServices> ps)
         errmsg = nullptr;
         CreateTables();
     }
+    UpgradeTables();
+
+    // the tiles are written by a background thread on its own connection. in WAL
+    // mode the core thread can still read while the writer is busy.
+    sqlite3_exec(dbHandle, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+    sqlite3_busy_timeout(dbHandle, kBusyTimeoutMs);
+    r = sqlite3_open_v2(db.string().c_str(), &writeHandle, SQLITE_OPEN_READWRITE, 0);
+    if (r != SQLITE_OK) {
+        LOGE(fmt::format("Unable to open backing store for writing, tiles will not be stored - {}", sqlite3_errstr(r)));
+        sqlite3_close(writeHandle);
+        writeHandle = nullptr;
+    } else {
+        sqlite3_busy_timeout(writeHandle, kBusyTimeoutMs);
+        writer = std::make_unique<std::thread>([this]() { AsyncWriter(); });
+    }
+
+    // documents can be large, so they are read on a connection of their own
+    r = sqlite3_open_v2(db.string().c_str(), &docHandle, SQLITE_OPEN_READONLY, 0);
+    if (r != SQLITE_OK) {
+        LOGE(fmt::format("Unable to open backing store for reading documents - {}", sqlite3_errstr(r)));
+        sqlite3_close(docHandle);
+        docHandle = nullptr;
+    } else {
+        sqlite3_busy_timeout(docHandle, kBusyTimeoutMs);
+    }
+
+    // tiles are looked up by another background thread, so that the map is never
+    // held up by a large blob, or by the writer
+    r = sqlite3_open_v2(db.string().c_str(), &readHandle, SQLITE_OPEN_READONLY, 0);
+    if (r != SQLITE_OK) {
+        LOGE(fmt::format("Unable to open backing store for reading, stored tiles will not be used - {}", sqlite3_errstr(r)));
+        sqlite3_close(readHandle);
+        readHandle = nullptr;
+    } else {
+        sqlite3_busy_timeout(readHandle, kBusyTimeoutMs);
+        reader = std::make_unique<std::thread>([this]() { AsyncReader(); });
+    }
 }
 
 BackingStore::~BackingStore()
 {
+    // any tile lookups that haven't been done are abandoned
+    {
+        std::lock_guard<std::mutex> lock(rmutex);
+        reading = false;
+    }
+    rsync.notify_one();
+    if (reader) reader->join();
+    if (readHandle) {
+        sqlite3_close(readHandle);
+        readHandle = nullptr;
+    }
+
+    // let the writer finish any pending writes before closing the database
+    {
+        std::lock_guard<std::mutex> lock(wmutex);
+        running = false;
+    }
+    wsync.notify_one();
+    if (writer) writer->join();
+    if (writeHandle) {
+        sqlite3_close(writeHandle);
+        writeHandle = nullptr;
+    }
+    if (docHandle) {
+        sqlite3_close(docHandle);
+        docHandle = nullptr;
+    }
     if (dbHandle) {
         int r = sqlite3_close(dbHandle);
         dbHandle = nullptr;
@@ -47,41 +127,353 @@ BackingStore::~BackingStore()
     }
 }
 
-std::shared_ptr<ImageBuffer> BackingStore::GetPixmap(const std::string &name)
+// MBTiles numbers the rows from the south (TMS), slippy maps from the north
+static int tmsRow(unsigned z, int y)
+{
+    return (1 << z) - 1 - y;
+}
+
+// the validators are optional, and are stored as NULL if the server didn't give them
+static void bindValidator(sqlite3_stmt* stmt, int i, const std::string &v)
+{
+    if (v.empty()) {
+        sqlite3_bind_null(stmt, i);
+    } else {
+        sqlite3_bind_text(stmt, i, v.c_str(), (int)v.size(), SQLITE_STATIC);
+    }
+}
+
+static std::string columnText(sqlite3_stmt* stmt, int i)
+{
+    auto t = sqlite3_column_text(stmt, i);
+    return t ? reinterpret_cast<const char*>(t) : "";
+}
+
+void BackingStore::LoadTile(const std::string &provider, unsigned z, int y, int x, TileLoaded done)
+{
+    if (!reader) {
+        done(false, std::vector<uint8_t>(), Validators());
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(rmutex);
+        pendingReads.push_back(PendingRead{ provider, z, y, x, std::move(done) });
+    }
+    rsync.notify_one();
+}
+
+void BackingStore::AsyncReader()
+{
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(readHandle, "SELECT images.tile_data, map.expires, map.etag, map.last_modified FROM map JOIN images ON images.tile_id = map.tile_id"
+                            " WHERE map.provider = ? AND map.zoom_level = ? AND map.tile_column = ? AND map.tile_row = ?", -1, &stmt, nullptr);
+    while (1) {
+        PendingRead rd;
+        {
+            std::unique_lock<std::mutex> lock(rmutex);
+            rsync.wait(lock, [this]() { return !reading || !pendingReads.empty(); });
+            if (!reading) break;
+            rd = std::move(pendingReads.front());
+            pendingReads.pop_front();
+        }
+
+        bool found = false;
+        std::vector<uint8_t> data;
+        Validators v;
+        sqlite3_bind_text(stmt, 1, rd.provider.c_str(), (int)rd.provider.size(), SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, rd.z);
+        sqlite3_bind_int(stmt, 3, rd.x);
+        sqlite3_bind_int(stmt, 4, tmsRow(rd.z, rd.y));
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            auto bptr = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0));
+            auto bsize = sqlite3_column_bytes(stmt, 0);
+            data.assign(bptr, bptr + bsize);
+            v.expires = sqlite3_column_int64(stmt, 1);
+            v.etag = columnText(stmt, 2);
+            v.lastModified = columnText(stmt, 3);
+            found = bsize > 0;
+        }
+        sqlite3_reset(stmt);
+        rd.done(found, std::move(data), v);
+    }
+    sqlite3_finalize(stmt);
+}
+
+void BackingStore::StoreTile(const std::string &provider, unsigned z, int y, int x, const uint8_t *data, size_t size, uint64_t hash, const Validators &v)
+{
+    if (!writer) return;
+    PendingWrite w;
+    w.kind = PendingWrite::TILE;
+    w.provider = provider;
+    w.z = z;
+    w.row = tmsRow(z, y);
+    w.col = x;
+    w.data.assign(data, data + size);
+    w.tileId = fmt::format("{:016x}-{:x}", hash, size);
+    w.expires = v.expires;
+    w.etag = v.etag;
+    w.lastModified = v.lastModified;
+    QueueWrite(std::move(w));
+}
+
+void BackingStore::RefreshTile(const std::string &provider, unsigned z, int y, int x, const Validators &v)
+{
+    if (!writer) return;
+    PendingWrite w;
+    w.kind = PendingWrite::REFRESH_TILE;
+    w.provider = provider;
+    w.z = z;
+    w.row = tmsRow(z, y);
+    w.col = x;
+    w.expires = v.expires;
+    w.etag = v.etag;
+    w.lastModified = v.lastModified;
+    QueueWrite(std::move(w));
+}
+
+std::string BackingStore::GetTileMetadata(const std::string &provider, const std::string &name)
+{
+    std::string value;
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(dbHandle, "SELECT value FROM metadata WHERE provider = ? AND name = ?", -1, &stmt, nullptr);
+    sqlite3_bind_text(stmt, 1, provider.c_str(), (int)provider.size(), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, name.c_str(), (int)name.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        auto v = sqlite3_column_text(stmt, 0);
+        if (v) value = reinterpret_cast<const char*>(v);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+void BackingStore::StoreTileMetadata(const std::string &provider, const std::string &name, const std::string &value)
+{
+    if (!writer) return;
+    PendingWrite w;
+    w.kind = PendingWrite::METADATA;
+    w.provider = provider;
+    w.name = name;
+    w.value = value;
+    QueueWrite(std::move(w));
+}
+
+bool BackingStore::GetDocument(const std::string &url, std::string &type, std::vector<uint8_t> &data, Validators &v)
+{
+    if (!docHandle) return false;
+    bool found = false;
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(docHandle, "SELECT type, bindata, expires, etag, last_modified FROM doc WHERE name = ?", -1, &stmt, nullptr);
+    sqlite3_bind_text(stmt, 1, url.c_str(), (int)url.size(), SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        type = columnText(stmt, 0);
+        auto bptr = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, 1));
+        auto bsize = sqlite3_column_bytes(stmt, 1);
+        data.assign(bptr, bptr + bsize);
+        v.expires = sqlite3_column_int64(stmt, 2);
+        v.etag = columnText(stmt, 3);
+        v.lastModified = columnText(stmt, 4);
+        found = bsize > 0;
+    }
+    sqlite3_finalize(stmt);
+
+    // the document's last use is recorded in the background, for pruning
+    if (found && writer) {
+        PendingWrite w;
+        w.kind = PendingWrite::TOUCH;
+        w.name = url;
+        QueueWrite(std::move(w));
+    }
+    return found;
+}
+
+void BackingStore::StoreDocument(const std::string &url, const std::string &type, const uint8_t *data, size_t size, const Validators &v)
+{
+    if (!writer) return;
+    PendingWrite w;
+    w.kind = PendingWrite::DOCUMENT;
+    w.name = url;
+    w.value = type;
+    w.data.assign(data, data + size);
+    w.expires = v.expires;
+    w.etag = v.etag;
+    w.lastModified = v.lastModified;
+    QueueWrite(std::move(w));
+}
+
+void BackingStore::RefreshDocument(const std::string &url, const Validators &v)
+{
+    if (!writer) return;
+    PendingWrite w;
+    w.kind = PendingWrite::REFRESH_DOCUMENT;
+    w.name = url;
+    w.expires = v.expires;
+    w.etag = v.etag;
+    w.lastModified = v.lastModified;
+    QueueWrite(std::move(w));
+}
+
+void BackingStore::SetDocumentLimit(size_t bytes)
+{
+    if (!writer) return;
+    PendingWrite w;
+    w.kind = PendingWrite::PRUNE;
+    w.limit = bytes;
+    QueueWrite(std::move(w));
+}
+
+void BackingStore::QueueWrite(PendingWrite&& w)
 {
-    std::shared_ptr<ImageBuffer> pixmap = nullptr;
-    sqlite3_stmt* stmtRetrieve = nullptr;
-    sqlite3_prepare_v2(dbHandle, "SELECT height, width, pixels FROM pixmap WHERE name = ?", -1, &stmtRetrieve, nullptr);
-    sqlite3_bind_text(stmtRetrieve, 1, name.c_str(), (int)name.size(), SQLITE_STATIC);
-    if (sqlite3_step(stmtRetrieve) == SQLITE_ROW)
     {
-        auto height = sqlite3_column_int(stmtRetrieve, 0);
-        auto width = sqlite3_column_int(stmtRetrieve, 1);
-        pixmap = std::make_shared<ImageBuffer>(width, height);
-        auto bsize = sqlite3_column_bytes(stmtRetrieve, 2);
-        assert(bsize <= (height * width * sizeof(uint32_t)));
-        auto bptr = sqlite3_column_blob(stmtRetrieve, 2);
-        memcpy(pixmap->Row(0), bptr, bsize);
+        std::lock_guard<std::mutex> lock(wmutex);
+        pendingWrites.push_back(std::move(w));
     }
-    sqlite3_finalize(stmtRetrieve);
-    return pixmap;
+    wsync.notify_one();
 }
 
-void BackingStore::StorePixmap(const std::string &name, std::shared_ptr<ImageBuffer> pixmap)
+void BackingStore::AsyncWriter()
 {
-    sqlite3_stmt* stmtInsert = nullptr;
-    sqlite3_prepare_v2(dbHandle, "INSERT INTO pixmap (name, height, width, pixels) VALUES (?, ?, ?, ?)", -1, &stmtInsert, nullptr);
-    sqlite3_bind_text(stmtInsert, 1, name.c_str(), (int)name.size(), SQLITE_STATIC);
-    int h = pixmap->Height();
-    sqlite3_bind_int(stmtInsert, 2, h);
-    int w = pixmap->Width();
-    sqlite3_bind_int(stmtInsert, 3, w);
-    sqlite3_bind_blob(stmtInsert, 4, pixmap->Row(0), h * w * sizeof(uint32_t), SQLITE_STATIC);
-    if (sqlite3_step(stmtInsert) != SQLITE_DONE) {
-        // LOGE();
+    // tiles and documents that have been stale for too long are removed once per
+    // run, along with any images that no tiles use any more
+    char *errmsg = nullptr;
+    auto purge = fmt::format("DELETE FROM map WHERE expires <= {0};"
+                             "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);"
+                             "DELETE FROM doc WHERE expires <= {0};", (int64_t)std::time(nullptr) - kStaleLifetime);
+    if (sqlite3_exec(writeHandle, purge.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE(fmt::format("Failed to remove expired tiles - {}", errmsg ? errmsg : ""));
+        sqlite3_free(errmsg);
     }
-    sqlite3_finalize(stmtInsert);
 
+    // an image that is already stored for another tile is kept as it is
+    sqlite3_stmt* imageStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "INSERT OR IGNORE INTO images (tile_id, tile_data) VALUES (?, ?)", -1, &imageStmt, nullptr);
+    sqlite3_stmt* tileStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "INSERT OR REPLACE INTO map (provider, zoom_level, tile_column, tile_row, tile_id, expires, etag, last_modified) VALUES (?, ?, ?, ?, ?, ?, ?, ?)", -1, &tileStmt, nullptr);
+    sqlite3_stmt* refreshTileStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "UPDATE map SET expires = ?, etag = ?, last_modified = ? WHERE provider = ? AND zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &refreshTileStmt, nullptr);
+    sqlite3_stmt* metaStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "INSERT OR REPLACE INTO metadata (provider, name, value) VALUES (?, ?, ?)", -1, &metaStmt, nullptr);
+    sqlite3_stmt* docStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "INSERT OR REPLACE INTO doc (name, type, expires, accessed, bindata, etag, last_modified) VALUES (?, ?, ?, ?, ?, ?, ?)", -1, &docStmt, nullptr);
+    sqlite3_stmt* refreshDocStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "UPDATE doc SET expires = ?, etag = ?, last_modified = ?, accessed = ? WHERE name = ?", -1, &refreshDocStmt, nullptr);
+    sqlite3_stmt* touchStmt = nullptr;
+    sqlite3_prepare_v2(writeHandle, "UPDATE doc SET accessed = ? WHERE name = ?", -1, &touchStmt, nullptr);
+    size_t docLimit = (size_t)kDefaultDocumentLimitMB << 20;
+    size_t docBytesWritten = 0;
+
+    while (1) {
+        // wait for some writes, and then do all of those waiting in one transaction
+        std::deque<PendingWrite> writes;
+        {
+            std::unique_lock<std::mutex> lock(wmutex);
+            wsync.wait(lock, [this]() { return !running || !pendingWrites.empty(); });
+            if (pendingWrites.empty()) break;
+            std::swap(writes, pendingWrites);
+        }
+
+        sqlite3_exec(writeHandle, "BEGIN;", nullptr, nullptr, nullptr);
+        bool prune = false;
+        for (auto& w : writes) {
+            sqlite3_stmt* stmt = nullptr;
+            switch (w.kind) {
+            case PendingWrite::TILE:
+                sqlite3_bind_text(imageStmt, 1, w.tileId.c_str(), (int)w.tileId.size(), SQLITE_STATIC);
+                sqlite3_bind_blob(imageStmt, 2, w.data.data(), (int)w.data.size(), SQLITE_STATIC);
+                if (sqlite3_step(imageStmt) != SQLITE_DONE) {
+                    LOGE(fmt::format("Failed to store tile image - {}", sqlite3_errmsg(writeHandle)));
+                }
+                sqlite3_reset(imageStmt);
+                stmt = tileStmt;
+                sqlite3_bind_text(stmt, 1, w.provider.c_str(), (int)w.provider.size(), SQLITE_STATIC);
+                sqlite3_bind_int(stmt, 2, w.z);
+                sqlite3_bind_int(stmt, 3, w.col);
+                sqlite3_bind_int(stmt, 4, w.row);
+                sqlite3_bind_text(stmt, 5, w.tileId.c_str(), (int)w.tileId.size(), SQLITE_STATIC);
+                sqlite3_bind_int64(stmt, 6, (sqlite3_int64)w.expires);
+                bindValidator(stmt, 7, w.etag);
+                bindValidator(stmt, 8, w.lastModified);
+                break;
+            case PendingWrite::REFRESH_TILE:
+                stmt = refreshTileStmt;
+                sqlite3_bind_int64(stmt, 1, (sqlite3_int64)w.expires);
+                bindValidator(stmt, 2, w.etag);
+                bindValidator(stmt, 3, w.lastModified);
+                sqlite3_bind_text(stmt, 4, w.provider.c_str(), (int)w.provider.size(), SQLITE_STATIC);
+                sqlite3_bind_int(stmt, 5, w.z);
+                sqlite3_bind_int(stmt, 6, w.col);
+                sqlite3_bind_int(stmt, 7, w.row);
+                break;
+            case PendingWrite::METADATA:
+                stmt = metaStmt;
+                sqlite3_bind_text(stmt, 1, w.provider.c_str(), (int)w.provider.size(), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, w.name.c_str(), (int)w.name.size(), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 3, w.value.c_str(), (int)w.value.size(), SQLITE_STATIC);
+                break;
+            case PendingWrite::DOCUMENT:
+                stmt = docStmt;
+                sqlite3_bind_text(stmt, 1, w.name.c_str(), (int)w.name.size(), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, w.value.c_str(), (int)w.value.size(), SQLITE_STATIC);
+                sqlite3_bind_int64(stmt, 3, (sqlite3_int64)w.expires);
+                sqlite3_bind_int64(stmt, 4, (sqlite3_int64)std::time(nullptr));
+                sqlite3_bind_blob(stmt, 5, w.data.data(), (int)w.data.size(), SQLITE_STATIC);
+                bindValidator(stmt, 6, w.etag);
+                bindValidator(stmt, 7, w.lastModified);
+                docBytesWritten += w.data.size();
+                break;
+            case PendingWrite::REFRESH_DOCUMENT:
+                stmt = refreshDocStmt;
+                sqlite3_bind_int64(stmt, 1, (sqlite3_int64)w.expires);
+                bindValidator(stmt, 2, w.etag);
+                bindValidator(stmt, 3, w.lastModified);
+                sqlite3_bind_int64(stmt, 4, (sqlite3_int64)std::time(nullptr));
+                sqlite3_bind_text(stmt, 5, w.name.c_str(), (int)w.name.size(), SQLITE_STATIC);
+                break;
+            case PendingWrite::TOUCH:
+                stmt = touchStmt;
+                sqlite3_bind_int64(stmt, 1, (sqlite3_int64)std::time(nullptr));
+                sqlite3_bind_text(stmt, 2, w.name.c_str(), (int)w.name.size(), SQLITE_STATIC);
+                break;
+            case PendingWrite::PRUNE:
+                docLimit = w.limit;
+                prune = true;
+                break;
+            }
+            if (!stmt) continue;
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                LOGE(fmt::format("Failed to store {} - {}", w.provider.empty() ? w.name : w.provider, sqlite3_errmsg(writeHandle)));
+            }
+            sqlite3_reset(stmt);
+        }
+        if (prune || (docBytesWritten > (docLimit / kPruneFraction))) {
+            PruneDocuments(docLimit);
+            docBytesWritten = 0;
+        }
+        sqlite3_exec(writeHandle, "COMMIT;", nullptr, nullptr, nullptr);
+    }
+
+    sqlite3_finalize(imageStmt);
+    sqlite3_finalize(tileStmt);
+    sqlite3_finalize(metaStmt);
+    sqlite3_finalize(refreshTileStmt);
+    sqlite3_finalize(docStmt);
+    sqlite3_finalize(refreshDocStmt);
+    sqlite3_finalize(touchStmt);
+}
+
+void BackingStore::PruneDocuments(size_t limit)
+{
+    // keep the most recently used documents that fit within the limit, this runs
+    // on the writer thread
+    auto cmd = fmt::format("DELETE FROM doc WHERE name IN (SELECT name FROM"
+                           " (SELECT name, SUM(LENGTH(bindata)) OVER (ORDER BY accessed DESC, name) AS total FROM doc)"
+                           " WHERE total > {});", (int64_t)limit);
+    char *errmsg = nullptr;
+    if (sqlite3_exec(writeHandle, cmd.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LOGE(fmt::format("Failed to prune stored documents - {}", errmsg ? errmsg : ""));
+        sqlite3_free(errmsg);
+    } else if (sqlite3_changes(writeHandle)) {
+        LOGD(fmt::format("Removed {} stored documents to stay within {}MB", sqlite3_changes(writeHandle), limit >> 20));
+    }
 }
 
 int BackingStore::ExecCallback(int n, char **data, char **names)
@@ -106,6 +498,81 @@ void BackingStore::CreateTables()
     }
 }
 
+// The schema version is kept in SQLite's user_version field. Version 0 is the
+// original schema where the pixmap table held straight alpha pixels. Version 2
+// added the MBTiles style tile tables. Version 3 split the tiles into the map
+// and images tables, so identical tiles are stored once. Version 4 gave the doc
+// table (which had never been used) a MIME type and last use time. Version 5
+// added the HTTP validators to the tiles and documents.
+static const int SCHEMA_VERSION = 5;
+
+void BackingStore::UpgradeTables()
+{
+    int version = 0;
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(dbHandle, "PRAGMA user_version", -1, &stmt, nullptr);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (version >= SCHEMA_VERSION) return;
+
+    // the upgrade is done in one transaction (SQLite's DDL is transactional), so
+    // that a failure part way through leaves the database as it was, to be
+    // upgraded again on the next run
+    std::string cmd = "BEGIN;";
+    if (version < 1) {
+        // pixmaps are now premultiplied, the old ones are regenerated when next needed
+        cmd += "DELETE FROM pixmap;";
+    }
+    if (version < 2) {
+        cmd += "CREATE TABLE IF NOT EXISTS metadata (provider TEXT, name TEXT, value TEXT, PRIMARY KEY (provider, name));";
+    }
+    if (version < 3) {
+        cmd += "CREATE TABLE IF NOT EXISTS map (provider TEXT, zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT, expires INTEGER,"
+               " PRIMARY KEY (provider, zoom_level, tile_column, tile_row));"
+               "CREATE INDEX IF NOT EXISTS idx_map_expires ON map(expires);"
+               "CREATE INDEX IF NOT EXISTS idx_map_tile_id ON map(tile_id);"
+               "CREATE TABLE IF NOT EXISTS images (tile_id TEXT PRIMARY KEY, tile_data BLOB);";
+        if (version == 2) {
+            // tiles stored by version 2 keep their own images until they expire
+            const char* oldId = "printf('v2/%s/%d/%d/%d', provider, zoom_level, tile_column, tile_row)";
+            cmd += fmt::format("INSERT INTO images (tile_id, tile_data) SELECT {0}, tile_data FROM tiles;"
+                               "INSERT INTO map (provider, zoom_level, tile_column, tile_row, tile_id, expires)"
+                               " SELECT provider, zoom_level, tile_column, tile_row, {0}, expires FROM tiles;"
+                               "DROP TABLE tiles;", oldId);
+        }
+        cmd += "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.provider AS provider, map.zoom_level AS zoom_level,"
+               " map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data, map.expires AS expires"
+               " FROM map JOIN images ON images.tile_id = map.tile_id;";
+    }
+    if (version < 4) {
+        cmd += "DROP TABLE IF EXISTS doc;"
+               "CREATE TABLE doc (name TEXT PRIMARY KEY, type TEXT, expires INTEGER, accessed INTEGER, bindata BLOB);"
+               "CREATE INDEX idx_doc_expires ON doc(expires);";
+    }
+    if (version < 5) {
+        cmd += "ALTER TABLE map ADD COLUMN etag TEXT;"
+               "ALTER TABLE map ADD COLUMN last_modified TEXT;"
+               "ALTER TABLE doc ADD COLUMN etag TEXT;"
+               "ALTER TABLE doc ADD COLUMN last_modified TEXT;";
+    }
+    cmd += fmt::format("PRAGMA user_version = {};", SCHEMA_VERSION);
+    cmd += "COMMIT;";
+
+    char *errmsg = nullptr;
+    int r = sqlite3_exec(dbHandle, cmd.c_str(), nullptr, nullptr, &errmsg);
+    if (r || errmsg) {
+        LOGE(fmt::format("Failed to upgrade backing store database - {}", errmsg ? errmsg : ""));
+        sqlite3_free(errmsg);
+        if (!sqlite3_get_autocommit(dbHandle)) {
+            sqlite3_exec(dbHandle, "ROLLBACK;", nullptr, nullptr, nullptr);
+        }
+    } else {
+        LOGI(fmt::format("Upgraded backing store database from version {} to {}", version, SCHEMA_VERSION));
+    }
+}
+
 static int callback(void *p, int n, char **data, char **names)
 {
     BackingStore *bs = reinterpret_cast<BackingStore *>(p);
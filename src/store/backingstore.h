@@ -3,18 +3,41 @@
 #pragma once
 
 #include "navitab/logger.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 // This header file defines the interface for the cache database which
 // manages the SQLite database that is used for persistent caching of
-// documents and map tiles, as well as for storing icon bitmaps that
-// are used in the map overlays.
+// documents and map tiles.
+//
+// Map tiles are stored in the deduplicated MBTiles layout (a map table of
+// zoom_level, tile_column, tile_row and tile_id, with the rows numbered from
+// the south as in TMS, an images table of tile_id and tile_data, a tiles view
+// joining them, and a metadata table of name/value pairs), with the addition
+// of a provider column so that several tile servers can share the database,
+// and an expiry time for each tile. Identical tiles, such as open sea, share
+// one image. Tiles and their metadata are written in the background, and tiles
+// are read in the background, so that the store never holds up the map.
+//
+// Other downloaded documents (eg charts) are kept in the doc table, with their
+// MIME type, expiry time and when they were last used. These are also written
+// in the background, and the least recently used documents are removed when the
+// table goes over its size limit.
+//
+// Tiles and documents are kept for a while after they expire, along with their
+// HTTP validators, so that a stale copy can be used straight away and then
+// revalidated with the server, which is much cheaper than downloading it again.
 
 struct sqlite3;
 
 namespace navitab {
 
 struct PathServices;
-class ImageBuffer;
 
 class BackingStore
 {
@@ -22,17 +45,97 @@ public:
     BackingStore(std::shared_ptr<PathServices>);
     virtual ~BackingStore();
 
-    std::shared_ptr<ImageBuffer> GetPixmap(const std::string &name);
-    void StorePixmap(const std::string &name, std::shared_ptr<ImageBuffer>);
+    // The HTTP validators of a stored tile or document, and when it expires.
+    struct Validators {
+        std::string etag;
+        std::string lastModified;
+        int64_t expires = 0;
+    };
+
+    // Queue a lookup of a map tile's encoded image data. y is the slippy map
+    // (north down) row. done is called from the reader thread, with found false
+    // if the tile isn't stored. Stale tiles are also found, the caller should
+    // check the expiry time.
+    typedef std::function<void(bool found, std::vector<uint8_t>&& data, const Validators& v)> TileLoaded;
+    void LoadTile(const std::string &provider, unsigned z, int y, int x, TileLoaded done);
+
+    // Queue a map tile to be stored, replacing any existing copy. The hash and size
+    // identify identical images, which are only stored once.
+    void StoreTile(const std::string &provider, unsigned z, int y, int x, const uint8_t *data, size_t size, uint64_t hash, const Validators &v);
+
+    // Queue a new expiry time and validators for a stored tile, when the server has
+    // confirmed that the stale copy is still current.
+    void RefreshTile(const std::string &provider, unsigned z, int y, int x, const Validators &v);
+
+    // The MBTiles metadata for a tile provider, eg format, attribution, minzoom.
+    std::string GetTileMetadata(const std::string &provider, const std::string &name);
+    void StoreTileMetadata(const std::string &provider, const std::string &name, const std::string &value);
+
+    // Get a document's contents and MIME type, if it is stored. Stale documents are
+    // also returned, the caller should check the expiry time. This has its own
+    // database connection, and can be used from one other thread (eg the document
+    // downloader's) without holding up the tile lookups.
+    bool GetDocument(const std::string &url, std::string &type, std::vector<uint8_t> &data, Validators &v);
+
+    // Queue a document to be stored, replacing any existing copy.
+    void StoreDocument(const std::string &url, const std::string &type, const uint8_t *data, size_t size, const Validators &v);
+
+    // Queue a new expiry time and validators for a stored document.
+    void RefreshDocument(const std::string &url, const Validators &v);
+
+    // Limit the total size of the stored documents.
+    void SetDocumentLimit(size_t bytes);
+
+    static const unsigned kDefaultDocumentLimitMB = 256;
 
     int ExecCallback(int n, char **data, char **names);
 
     protected:
     void CreateTables();
+    void UpgradeTables();
+    void AsyncWriter();
+    void AsyncReader();
+    void PruneDocuments(size_t limit);
 
 private:
     std::unique_ptr<logging::Logger> LOG;
     sqlite3 *dbHandle;
+    sqlite3 *docHandle;
+
+    // Writes waiting for the writer thread, which has its own database connection.
+    struct PendingWrite {
+        enum { TILE, REFRESH_TILE, METADATA, DOCUMENT, REFRESH_DOCUMENT, TOUCH, PRUNE } kind;
+        std::string provider;
+        unsigned z;
+        int row, col;
+        std::vector<uint8_t> data;
+        std::string tileId;
+        int64_t expires;
+        std::string etag, lastModified;
+        std::string name, value;
+        size_t limit;
+    };
+    void QueueWrite(PendingWrite&& w);
+    std::deque<PendingWrite> pendingWrites;
+    std::mutex wmutex;
+    std::condition_variable wsync;
+    bool running;
+    sqlite3 *writeHandle;
+    std::unique_ptr<std::thread> writer;
+
+    // Tile lookups waiting for the reader thread, which also has its own connection.
+    struct PendingRead {
+        std::string provider;
+        unsigned z;
+        int y, x;
+        TileLoaded done;
+    };
+    std::deque<PendingRead> pendingReads;
+    std::mutex rmutex;
+    std::condition_variable rsync;
+    bool reading;
+    sqlite3 *readHandle;
+    std::unique_ptr<std::thread> reader;
 };
 
 } // namespace navitab
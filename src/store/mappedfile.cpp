@@ -0,0 +1,69 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#include "mappedfile.h"
+#if defined(NAVITAB_WINDOWS)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace navitab {
+
+#if defined(NAVITAB_WINDOWS)
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+:   data(nullptr),
+    size(0),
+    fileHandle(INVALID_HANDLE_VALUE),
+    mapHandle(nullptr)
+{
+    fileHandle = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER fsize;
+    if (!GetFileSizeEx(fileHandle, &fsize) || (fsize.QuadPart == 0)) return;
+    mapHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapHandle) return;
+    data = static_cast<const uint8_t*>(MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0));
+    if (data) size = (size_t)fsize.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data) UnmapViewOfFile(data);
+    if (mapHandle) CloseHandle(mapHandle);
+    if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+}
+
+#else
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+:   data(nullptr),
+    size(0)
+{
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            // tiles and pages are read in no particular order, so read-ahead is wasted
+            (void)madvise(p, (size_t)st.st_size, MADV_RANDOM);
+            data = static_cast<const uint8_t*>(p);
+            size = (size_t)st.st_size;
+        }
+    }
+    // the mapping remains valid after the file is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data) munmap(const_cast<uint8_t*>(data), size);
+}
+
+#endif
+
+} // namespace navitab
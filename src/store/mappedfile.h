@@ -0,0 +1,40 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// This header file defines the MappedFile, which maps a whole file read-only into
+// memory, so that large files (eg tile archives and charts) can be read in place
+// without being loaded or copied. The operating system pages the file in as it
+// is used, and can drop the pages again when memory is short.
+
+namespace navitab {
+
+class MappedFile
+{
+public:
+    MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // False if the file could not be opened or mapped. Empty files are not mapped.
+    bool IsOpen() const { return data != nullptr; }
+
+    const uint8_t* Data() const { return data; }
+    size_t Size() const { return size; }
+
+private:
+    const uint8_t* data;
+    size_t size;
+#if defined(NAVITAB_WINDOWS)
+    void* fileHandle;
+    void* mapHandle;
+#endif
+};
+
+} // namespace navitab
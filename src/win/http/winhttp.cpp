@@ -3,10 +3,12 @@
 #include <cassert>
 #include <memory>
 #include <fmt/core.h>
+#include <nlohmann/json.hpp>
 #include "winhttp.h"
 #include "navitab/core.h"
 #include "navitab/platform.h"
 #include "../texbuffer.h"
+#include "../../imgkit/pixelkernels.h"
 #include "htmlserver.h"
 #include "cmdhandler.h"
 
@@ -21,6 +23,7 @@ WindowHTTP::WindowHTTP()
 :   LOG(std::make_unique<logging::Logger>("winhttp")),
     winWidth(WIN_STD_WIDTH),
     winHeight(WIN_STD_HEIGHT),
+    rgb565(false),
     brightness(1.0f),
     running(true),
     activeModes(0),
@@ -43,6 +46,14 @@ void WindowHTTP::Connect(std::shared_ptr<CoreServices> c)
     core = c;
     core->SetWindowControl(shared_from_this());
     prefs = core->GetSettingsManager();
+    auto hp = prefs->Get("/http");
+    try {
+        rgb565 = hp.at("/rgb565"_json_pointer);
+    }
+    catch (...) {
+        hp["rgb565"] = rgb565;
+        prefs->Put("/http", hp);
+    }
     toolbarClient = core->SetToolbar(shared_from_this());
     modebarClient = core->SetModebar(shared_from_this());
     doodlerClient = core->SetDoodler(shared_from_this());
@@ -167,6 +178,10 @@ void WindowHTTP::RunLater(std::function<void()> j, int*)
 void WindowHTTP::EncodeBMP(std::vector<unsigned char> &bmp)
 {
     std::lock_guard<std::mutex> lock(paintMutex);
+    if (rgb565) {
+        EncodeBMP565(bmp);
+        return;
+    }
     unsigned w = image->Width();
     unsigned h = image->Height();
     unsigned ncanvas = (4 * w * h);
@@ -220,6 +235,59 @@ void WindowHTTP::EncodeBMP(std::vector<unsigned char> &bmp)
     }
 }
 
+void WindowHTTP::EncodeBMP565(std::vector<unsigned char> &bmp)
+{
+    // The 16-bit BMP uses the BITFIELDS compression method, with the colour masks
+    // following the DIB header. These masks match Navitab's RGB565 pixel format, so
+    // no swizzling is needed. Each row is padded to a multiple of 4 bytes.
+    unsigned w = image->Width();
+    unsigned h = image->Height();
+    const unsigned rl = ((2 * w) + 3) & ~3u;
+    unsigned ncanvas = rl * h;
+    unsigned offset = 14 + 40 + 12;
+    unsigned bmpLength = offset + ncanvas;
+
+    bmp.resize(bmpLength);
+
+    static const unsigned char hdr[] = {
+        0x42, 0x4d,                 // signature
+        0x00, 0x00, 0x00, 0x00,     // file length
+        0x00, 0x00,                 // res1
+        0x00, 0x00,                 // res2
+        0x42, 0x00, 0x00, 0x00,     // offset of pixel map
+        0x28, 0x00, 0x00, 0x00,     // length of DIB header
+        0x00, 0x00, 0x00, 0x00,     // width in pixels
+        0x00, 0x00, 0x00, 0x00,     // height in pixels
+        0x01, 0x00,                 // # colour planes (1)
+        0x10, 0x00,                 // # bits per pixel (16)
+        0x03, 0x00, 0x00, 0x00,     // compression method (BITFIELDS)
+        0x00, 0x00, 0x00, 0x00,     // image size in bytes
+        0xc3, 0x0e, 0x00, 0x00,     // horizontal resolution (pixels/m)
+        0xc3, 0x0e, 0x00, 0x00,     // vertical resolution (pixels/m)
+        0x00, 0x00, 0x00, 0x00,     // # colours in palette
+        0x00, 0x00, 0x00, 0x00,     // # important colours in palette
+        0x00, 0xf8, 0x00, 0x00,     // red mask
+        0xe0, 0x07, 0x00, 0x00,     // green mask
+        0x1f, 0x00, 0x00, 0x00      // blue mask
+    };
+
+    memcpy(bmp.data(), hdr, sizeof(hdr));
+    *(reinterpret_cast<uint32_t *>(&bmp[2])) = bmpLength;   // blob length
+    *(reinterpret_cast<uint32_t *>(&bmp[18])) = w;          // width in pixels
+    *(reinterpret_cast<uint32_t *>(&bmp[22])) = h;          // height in pixels
+    *(reinterpret_cast<uint32_t *>(&bmp[34])) = ncanvas;    // image size in bytes
+
+    // rows are still stored bottom to top, see EncodeBMP()
+    auto toRgb565Row = PixelKernelSet().toRgb565Row;
+    const uint32_t *sr = image->Data();
+    unsigned char* dr = bmp.data() + offset + ncanvas - rl;
+    for (unsigned i = 0; i < h; ++i) {
+        toRgb565Row(reinterpret_cast<uint16_t *>(dr), sr, w);
+        sr += w;
+        dr -= rl;
+    }
+}
+
 void WindowHTTP::EncodeStatus(std::vector<unsigned char> &status)
 {
     int zth = zuluTime / (60 * 60);
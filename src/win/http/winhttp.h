@@ -81,6 +81,7 @@ protected:
     void RunLater(std::function<void ()>, int* s = nullptr) override;
 
     void onFinish() { running = false; }
+    void EncodeBMP565(std::vector<unsigned char> &bmp);
 
 private:
     std::unique_ptr<logging::Logger> LOG;
@@ -98,6 +99,7 @@ private:
 
     int winWidth;
     int winHeight;
+    bool rgb565; // send 16-bit BMPs to the panel, halving the transfer size
 
     float brightness;
     int zuluTime;
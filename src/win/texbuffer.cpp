@@ -2,6 +2,7 @@
 
 #include "texbuffer.h"
 #include "navitab/window.h"
+#include "../imgkit/pixelkernels.h"
 
 namespace navitab {
 
@@ -12,7 +13,7 @@ void TextureBuffer::CopyRegionFrom(const FrameBuffer *src, const ImageRegion &re
 
     assert(src->Width() == width);
     assert(src->Height() == height);
-    std::copy(src->Data().begin(), src->Data().end(), data.begin());
+    copyImage(src);
 }
 
 void TextureBuffer::CopyRegionsFrom(const FrameBuffer *src, const std::vector<ImageRegion> &regions)
@@ -22,7 +23,21 @@ void TextureBuffer::CopyRegionsFrom(const FrameBuffer *src, const std::vector<Im
 
     assert(src->Width() == width);
     assert(src->Height() == height);
-    std::copy(src->Data().begin(), src->Data().end(), data.begin());
+    copyImage(src);
+}
+
+void TextureBuffer::copyImage(const FrameBuffer *src)
+{
+    // The texture won't be read again until it is uploaded, so use non-temporal
+    // stores to avoid flushing the rest of the cache on every frame.
+    auto streamRow = PixelKernelSet().streamRow;
+    if (src->Contiguous()) {
+        streamRow(data.data(), src->Data(), (size_t)width * height);
+    } else {
+        for (int r = 0; r < height; ++r) {
+            streamRow(data.data() + (r * width), src->Row(r), width);
+        }
+    }
 }
 
 } // namespace navitab
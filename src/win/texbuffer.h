@@ -5,10 +5,10 @@
 #include <cassert>
 #include <stdint.h>
 #include <vector>
+#include "navitab/pixelbuffer.h"
 
 namespace navitab {
 
-class ImageBuffer;
 struct ImageRegion;
 
 // TextureBuffer objects contain RGBA pixel data that has been generated by
@@ -34,6 +34,9 @@ public:
     void CopyRegionFrom(const ImageBuffer* src, const ImageRegion& region);
     void CopyRegionsFrom(const ImageBuffer* src, const std::vector<ImageRegion>& regions);
 
+private:
+    void copyImage(const ImageBuffer* src);
+
 private:
     int const maxWidth, maxHeight;
     int width, height;
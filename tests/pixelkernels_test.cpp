@@ -0,0 +1,251 @@
+/* This file is part of the Navitab project. See the README and LICENSE for details. */
+
+// Checks that every vector pixel kernel set usable on this CPU gives results
+// identical to the scalar reference kernels, over random rows of every length
+// up to a few vector widths and at unaligned offsets, so that the tails are
+// exercised as well as the main loops.
+
+#include "../src/imgkit/pixelkernels.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace navitab;
+
+static const size_t kMaxRow = 71;
+static const int kRounds = 20;
+
+static std::mt19937 rng(20240511);
+
+static uint32_t randomPixel()
+{
+    uint32_t p = rng();
+    // favour the alpha values that the kernels treat as special cases
+    switch (rng() % 4) {
+    case 0: return p & 0x00ffffff;
+    case 1: return p | 0xff000000;
+    default: return p;
+    }
+}
+
+static std::vector<uint32_t> randomRow(size_t n)
+{
+    std::vector<uint32_t> r(n);
+    for (auto &p : r) p = randomPixel();
+    return r;
+}
+
+static std::vector<uint32_t> premultipliedRow(size_t n)
+{
+    std::vector<uint32_t> r = randomRow(n);
+    ScalarPixelKernels()->premultiplyRow(r.data(), r.data(), n);
+    return r;
+}
+
+// Resampling weights for taps pixels summing to 1 << ResampleBits, with some
+// negative lobes to push the sums outside 0..255.
+static std::vector<int16_t> randomWeights(size_t count, unsigned taps)
+{
+    std::vector<int16_t> w(count * taps);
+    for (size_t i = 0; i < count; ++i) {
+        int32_t sum = 0;
+        for (unsigned k = 1; k < taps; ++k) {
+            int16_t x = (int16_t)((int32_t)(rng() % 12000) - 2000);
+            w[i * taps + k] = x;
+            sum += x;
+        }
+        w[i * taps] = (int16_t)((1 << ResampleBits) - sum);
+    }
+    return w;
+}
+
+static int failures = 0;
+
+template <typename T>
+static void check(const PixelKernels &k, const char *kernel, size_t n, const std::vector<T> &expected, const std::vector<T> &actual)
+{
+    for (size_t i = 0; i < expected.size(); ++i) {
+        if (expected[i] != actual[i]) {
+            fmt::print("FAIL {} {} n={} at {}: expected {:08x} got {:08x}\n",
+                    k.name, kernel, n, i, (uint32_t)expected[i], (uint32_t)actual[i]);
+            ++failures;
+            return;
+        }
+    }
+}
+
+static void testRows(const PixelKernels &k, size_t n)
+{
+    const PixelKernels &ref = *ScalarPixelKernels();
+
+    // the destinations have a guard pixel either side, and are offset by one so
+    // that they are not aligned
+    auto s = randomRow(n);
+    auto d0 = randomRow(n + 2);
+
+    {
+        auto e = d0, a = d0;
+        ref.copyRow(&e[1], s.data(), n);
+        k.copyRow(&a[1], s.data(), n);
+        check(k, "copyRow", n, e, a);
+    }
+    {
+        auto e = d0, a = d0;
+        ref.streamRow(&e[1], s.data(), n);
+        k.streamRow(&a[1], s.data(), n);
+        check(k, "streamRow", n, e, a);
+    }
+    {
+        auto e = d0, a = d0;
+        uint32_t px = randomPixel();
+        ref.fillRow(&e[1], px, n);
+        k.fillRow(&a[1], px, n);
+        check(k, "fillRow", n, e, a);
+    }
+    {
+        auto ks = s;
+        for (auto &p : ks) if (rng() % 3 == 0) p = 0;
+        auto e = d0, a = d0;
+        uint32_t bg = randomPixel();
+        ref.keyRow(&e[1], ks.data(), n, bg);
+        k.keyRow(&a[1], ks.data(), n, bg);
+        check(k, "keyRow", n, e, a);
+    }
+    {
+        auto e = d0, a = d0;
+        ref.blendRow(&e[1], s.data(), n);
+        k.blendRow(&a[1], s.data(), n);
+        check(k, "blendRow", n, e, a);
+    }
+    {
+        auto ps = premultipliedRow(n);
+        auto pd = premultipliedRow(n + 2);
+        auto e = pd, a = pd;
+        ref.blendPremulRow(&e[1], ps.data(), n);
+        k.blendPremulRow(&a[1], ps.data(), n);
+        check(k, "blendPremulRow", n, e, a);
+    }
+    {
+        auto e = d0, a = d0;
+        ref.premultiplyRow(&e[1], s.data(), n);
+        k.premultiplyRow(&a[1], s.data(), n);
+        check(k, "premultiplyRow", n, e, a);
+
+        // and in place
+        e = d0; a = d0;
+        ref.premultiplyRow(&e[1], &e[1], n);
+        k.premultiplyRow(&a[1], &a[1], n);
+        check(k, "premultiplyRow in place", n, e, a);
+    }
+    {
+        std::vector<uint8_t> m(n);
+        for (auto &c : m) {
+            uint32_t r = rng() % 4;
+            c = (r == 0) ? 0 : (r == 1) ? 0xff : (uint8_t)rng();
+        }
+        uint32_t colour = randomPixel();
+        ref.premultiplyRow(&colour, &colour, 1);
+        auto pd = premultipliedRow(n + 2);
+        auto e = pd, a = pd;
+        ref.blendMaskRow(&e[1], m.data(), n, colour);
+        k.blendMaskRow(&a[1], m.data(), n, colour);
+        check(k, "blendMaskRow", n, e, a);
+    }
+    {
+        std::vector<uint16_t> d16(n + 2);
+        for (auto &p : d16) p = (uint16_t)rng();
+        auto e = d16, a = d16;
+        ref.toRgb565Row(&e[1], s.data(), n);
+        k.toRgb565Row(&a[1], s.data(), n);
+        check(k, "toRgb565Row", n, e, a);
+
+        auto e32 = d0, a32 = d0;
+        ref.fromRgb565Row(&e32[1], &d16[1], n);
+        k.fromRgb565Row(&a32[1], &d16[1], n);
+        check(k, "fromRgb565Row", n, e32, a32);
+    }
+    {
+        std::vector<uint8_t> d8(n + 2);
+        for (auto &c : d8) c = (uint8_t)rng();
+        auto e = d8, a = d8;
+        ref.alphaRow(&e[1], s.data(), n);
+        k.alphaRow(&a[1], s.data(), n);
+        check(k, "alphaRow", n, e, a);
+    }
+    for (unsigned taps = 1; taps <= 8; ++taps) {
+        auto src = randomRow(n + taps + 8);
+        std::vector<int32_t> starts(n);
+        for (auto &x : starts) x = (int32_t)(rng() % 9);
+        auto w = randomWeights(n, taps);
+        auto e = d0, a = d0;
+        ref.resampleRowH(&e[1], src.data(), n, starts.data(), w.data(), taps);
+        k.resampleRowH(&a[1], src.data(), n, starts.data(), w.data(), taps);
+        check(k, fmt::format("resampleRowH taps={}", taps).c_str(), n, e, a);
+
+        std::vector<std::vector<uint32_t>> rows;
+        std::vector<const uint32_t*> rowPtrs;
+        for (unsigned t = 0; t < taps; ++t) rows.push_back(randomRow(n));
+        for (auto &r : rows) rowPtrs.push_back(r.data());
+        auto wv = randomWeights(1, taps);
+        e = d0; a = d0;
+        ref.resampleRowV(&e[1], rowPtrs.data(), n, wv.data(), taps);
+        k.resampleRowV(&a[1], rowPtrs.data(), n, wv.data(), taps);
+        check(k, fmt::format("resampleRowV taps={}", taps).c_str(), n, e, a);
+    }
+    {
+        // sample along a random line that stays inside the source, leaving room
+        // for the right and lower neighbours
+        const size_t sw = 40, sh = 30;
+        auto src = randomRow(sw * sh);
+        int32_t u0 = (int32_t)(rng() % ((sw - 1) << 16));
+        int32_t v0 = (int32_t)(rng() % ((sh - 1) << 16));
+        int32_t u1 = (int32_t)(rng() % ((sw - 1) << 16));
+        int32_t v1 = (int32_t)(rng() % ((sh - 1) << 16));
+        int32_t du = n > 1 ? (u1 - u0) / (int32_t)n : 0;
+        int32_t dv = n > 1 ? (v1 - v0) / (int32_t)n : 0;
+        auto e = d0, a = d0;
+        ref.bilinearRow(&e[1], n, src.data(), sw, u0, v0, du, dv);
+        k.bilinearRow(&a[1], n, src.data(), sw, u0, v0, du, dv);
+        check(k, "bilinearRow", n, e, a);
+    }
+}
+
+// The kernel sets to compare with the scalar ones: the one dispatched for this
+// CPU, and any others that it can also run.
+static std::vector<const PixelKernels*> variants()
+{
+    std::vector<const PixelKernels*> v;
+    v.push_back(&PixelKernelSet());
+#if defined(NAVITAB_KERNELS_X86) && !defined(_MSC_VER)
+    if (__builtin_cpu_supports("sse4.1") && Sse41PixelKernels()) v.push_back(Sse41PixelKernels());
+    if (__builtin_cpu_supports("avx2") && Avx2PixelKernels()) v.push_back(Avx2PixelKernels());
+#elif defined(NAVITAB_KERNELS_NEON)
+    if (NeonPixelKernels()) v.push_back(NeonPixelKernels());
+#endif
+    return v;
+}
+
+int main()
+{
+    std::vector<std::string> tested;
+    for (auto k : variants()) {
+        if (k == ScalarPixelKernels()) continue;
+        if (std::find(tested.begin(), tested.end(), k->name) != tested.end()) continue;
+        tested.push_back(k->name);
+        for (int round = 0; round < kRounds; ++round) {
+            for (size_t n = 0; n <= kMaxRow; ++n) {
+                testRows(*k, n);
+            }
+        }
+    }
+
+    if (tested.empty()) {
+        fmt::print("Only the scalar kernels are available, nothing to compare\n");
+    }
+    for (auto &t : tested) {
+        fmt::print("Compared the {} kernels with the scalar ones\n", t);
+    }
+    return failures ? 1 : 0;
+}